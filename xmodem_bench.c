@@ -0,0 +1,1373 @@
+/**
+ * Throughput benchmarks for the xmodem client & server
+ * Usage: xmodem_bench [-e] [-s] [-t] [-p] [-d DIR]... [SIZE]
+ * SIZE is the amount of data to transfer, and may have a k, M or G suffix.
+ * With -e, only the end-to-end comparison against lrzsz rz is run. With -s,
+ * only the file sink comparison is run, writing into each DIR (by default
+ * /dev/shm & /tmp). With -t, only the pty transport comparison is run. With
+ * -p, only the worker pool scaling run is done, with SIZE shared between
+ * all the senders
+ */
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "xmodem_client.h"
+#include "xmodem_pool.h"
+#include "xmodem_server.h"
+#include "xmodem_sink.h"
+#include "xmodem_tty.h"
+#include "zmodem_server.h"
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int64_t ms_time(void)
+{
+	return (int64_t)(now() * 1000);
+}
+
+static bool have_program(const char *name)
+{
+	char command[100];
+	snprintf(command, sizeof(command), "command -v %s > /dev/null 2>&1", name);
+	return system(command) == 0;
+}
+
+/**
+ * Run a client & server against each other in memory
+ * @return Time taken in seconds, or < 0 on failure
+ */
+static double bench_loopback(int packet_size, uint32_t flags, const uint8_t *data, size_t data_size)
+{
+	struct xmodem_client client;
+	struct xmodem_server server;
+	double start = now();
+
+	xmodem_client_init_mem(&client, packet_size, data, data_size);
+	xmodem_server_init_flags(&server, NULL, NULL, flags);
+	while (!xmodem_client_is_done(&client) || !xmodem_server_is_done(&server)) {
+		const uint8_t *pending;
+		const uint8_t *packet;
+		uint32_t block_nr;
+		size_t len;
+
+		xmodem_client_process(&client, 1);
+		pending = xmodem_client_pending_tx(&client, &len);
+		xmodem_client_tx_done(&client, xmodem_server_rx_bytes(&server, pending, len));
+		if (xmodem_server_process_borrow(&server, &packet, &block_nr, 1) > 0)
+			xmodem_server_release_packet(&server);
+		pending = xmodem_server_pending_tx(&server, &len);
+		for (size_t i = 0; i < len; i++)
+			xmodem_client_rx_byte(&client, pending[i]);
+		xmodem_server_tx_done(&server, len);
+		if (xmodem_client_get_state(&client) == XMODEM_CLIENT_STATE_FAILURE)
+			return -1;
+	}
+	return now() - start;
+}
+
+/**
+ * One direction of a simulated serial link, with a fixed baud rate and
+ * latency. Times are in microseconds of simulated time
+ */
+struct sim_link {
+	uint8_t data[65536];
+	int64_t arrival[65536]; // When each byte reaches the other end
+	size_t head, tail;
+	int64_t busy_until; // When the transmitter will have sent everything queued
+	int64_t byte_time;
+	int64_t latency;
+	uint64_t written; // Total bytes written
+	uint64_t drop_interval; // Lose every Nth byte (0 for none)
+};
+
+static void sim_link_init(struct sim_link *link, int baud, int latency_ms)
+{
+	link->head = link->tail = 0;
+	link->busy_until = 0;
+	link->written = 0;
+	link->drop_interval = 0;
+	// 8N1, so 10 bits per byte
+	link->byte_time = 10000000 / baud;
+	link->latency = latency_ms * 1000;
+}
+
+static size_t sim_link_write(struct sim_link *link, const uint8_t *data, size_t len, int64_t now)
+{
+	size_t i;
+	for (i = 0; i < len && link->head - link->tail < sizeof(link->data); i++) {
+		size_t pos;
+		if (link->busy_until < now)
+			link->busy_until = now;
+		link->busy_until += link->byte_time;
+		if (link->drop_interval && ++link->written % link->drop_interval == 0)
+			continue;
+		pos = link->head++ % sizeof(link->data);
+		link->data[pos] = data[i];
+		link->arrival[pos] = link->busy_until + link->latency;
+	}
+	return i;
+}
+
+static size_t sim_link_read(struct sim_link *link, uint8_t *data, size_t len, int64_t now)
+{
+	size_t i;
+	for (i = 0; i < len && link->tail != link->head; i++) {
+		size_t pos = link->tail % sizeof(link->data);
+		if (link->arrival[pos] > now)
+			break;
+		data[i] = link->data[pos];
+		link->tail++;
+	}
+	return i;
+}
+
+struct sim_config {
+	int packet_size;
+	int window_slots; // Blocks of window to give the server, or 0 for plain XMODEM
+	uint32_t flags; // XMODEM_FLAG_xxx for the server, when not using a window
+	int baud;
+	int rtt_ms;
+	uint64_t drop_interval; // Lose every Nth byte sent by the client (0 for none)
+};
+
+/**
+ * Send data from a client to a server over a simulated link
+ * @return Simulated time taken in seconds, or < 0 on failure
+ */
+static double bench_sim(const struct sim_config *config, const uint8_t *data, size_t data_size)
+{
+	static struct sim_link to_server, to_client;
+	static uint8_t window[XMODEM_MAX_WINDOW_SLOTS * XMODEM_MAX_PACKET_SIZE];
+	struct xmodem_client client;
+	struct xmodem_server server;
+	int64_t now;
+
+	sim_link_init(&to_server, config->baud, config->rtt_ms / 2);
+	sim_link_init(&to_client, config->baud, config->rtt_ms / 2);
+	to_server.drop_interval = config->drop_interval;
+	xmodem_client_init_mem(&client, config->packet_size, data, data_size);
+	if (config->window_slots)
+		xmodem_server_init_window(&server, NULL, NULL, window, config->window_slots * XMODEM_MAX_PACKET_SIZE);
+	else
+		xmodem_server_init_flags(&server, NULL, NULL, config->flags);
+
+	// Step through time in 100us increments
+	for (now = 0; !xmodem_client_is_done(&client) || !xmodem_server_is_done(&server); now += 100) {
+		uint8_t buffer[4096];
+		const uint8_t *pending;
+		size_t len, count, pos = 0;
+
+		if (now > 3600 * 1000000LL || xmodem_client_get_state(&client) == XMODEM_CLIENT_STATE_FAILURE ||
+				xmodem_server_get_state(&server) == XMODEM_STATE_FAILURE)
+			return -1;
+		xmodem_client_process(&client, now / 1000 + 1);
+		pending = xmodem_client_pending_tx(&client, &len);
+		xmodem_client_tx_done(&client, sim_link_write(&to_server, pending, len, now));
+
+		count = sim_link_read(&to_server, buffer, sizeof(buffer), now);
+		do {
+			const uint8_t *packet;
+			uint32_t block_nr;
+
+			pos += xmodem_server_rx_bytes(&server, &buffer[pos], count - pos);
+			if (xmodem_server_process_borrow(&server, &packet, &block_nr, now / 1000 + 1) > 0)
+				xmodem_server_release_packet(&server);
+			pending = xmodem_server_pending_tx(&server, &len);
+			xmodem_server_tx_done(&server, sim_link_write(&to_client, pending, len, now));
+		} while (pos < count && !xmodem_server_is_done(&server));
+
+		count = sim_link_read(&to_client, buffer, sizeof(buffer), now);
+		for (size_t i = 0; i < count; i++)
+			xmodem_client_rx_byte(&client, buffer[i]);
+	}
+	if (xmodem_server_get_state(&server) != XMODEM_STATE_SUCCESSFUL)
+		return -1;
+	return now / 1e6;
+}
+
+/**
+ * Start a process with its stdin/stdout connected to the given fds
+ */
+static pid_t spawn(const char *command, int in_fd, int out_fd)
+{
+	pid_t pid = fork();
+	if (pid == 0) {
+		dup2(in_fd, STDIN_FILENO);
+		dup2(out_fd, STDOUT_FILENO);
+		execl("/bin/sh", "sh", "-c", command, (char *)NULL);
+		_exit(127);
+	}
+	return pid;
+}
+
+/**
+ * Send a file to lrzsz rz, either from lrzsz sz or from xmodem_client
+ * @return Time taken in seconds, or < 0 on failure
+ */
+static double bench_to_rz(bool use_client, int packet_size, const uint8_t *data, size_t data_size)
+{
+	char src_name[] = "/tmp/xmodem_bench.XXXXXX";
+	char dst_name[] = "/tmp/xmodem_bench.XXXXXX";
+	char command[200];
+	int to_rz[2], from_rz[2];
+	pid_t rz_pid, sz_pid = -1;
+	double start, elapsed;
+	bool ok = false;
+	int fd;
+
+	fd = mkstemp(src_name);
+	if (fd < 0 || write(fd, data, data_size) != (ssize_t)data_size)
+		return -1;
+	close(fd);
+	fd = mkstemp(dst_name);
+	if (fd < 0)
+		return -1;
+	close(fd);
+	if (pipe(to_rz) < 0 || pipe(from_rz) < 0)
+		return -1;
+
+	start = now();
+	// rz refuses absolute paths, so run it from /tmp
+	snprintf(command, sizeof(command), "cd /tmp && exec rz --xmodem --with-crc --overwrite --quiet %s", &dst_name[5]);
+	rz_pid = spawn(command, to_rz[0], from_rz[1]);
+	close(to_rz[0]);
+	close(from_rz[1]);
+
+	if (!use_client) {
+		snprintf(command, sizeof(command), "exec sz --xmodem %s --quiet %s", packet_size == 1024 ? "--1k" : "", src_name);
+		sz_pid = spawn(command, from_rz[0], to_rz[1]);
+	} else {
+		struct xmodem_client client;
+		xmodem_client_init_mem(&client, packet_size, data, data_size);
+		while (!xmodem_client_is_done(&client)) {
+			fd_set rd_fds, wr_fds;
+			struct timeval tv = {.tv_sec = 0, .tv_usec = 10000};
+			const uint8_t *pending;
+			size_t len;
+
+			FD_ZERO(&rd_fds);
+			FD_ZERO(&wr_fds);
+			FD_SET(from_rz[0], &rd_fds);
+			pending = xmodem_client_pending_tx(&client, &len);
+			if (len > 0)
+				FD_SET(to_rz[1], &wr_fds);
+			if (select((from_rz[0] > to_rz[1] ? from_rz[0] : to_rz[1]) + 1, &rd_fds, &wr_fds, NULL, &tv) < 0)
+				break;
+			if (FD_ISSET(to_rz[1], &wr_fds)) {
+				ssize_t r = write(to_rz[1], pending, len);
+				if (r > 0)
+					xmodem_client_tx_done(&client, r);
+			}
+			if (FD_ISSET(from_rz[0], &rd_fds)) {
+				uint8_t buffer[32];
+				ssize_t count = read(from_rz[0], buffer, sizeof(buffer));
+				if (count <= 0)
+					break;
+				for (ssize_t i = 0; i < count; i++)
+					xmodem_client_rx_byte(&client, buffer[i]);
+			}
+			xmodem_client_process(&client, ms_time());
+		}
+		ok = xmodem_client_get_state(&client) == XMODEM_CLIENT_STATE_SUCCESSFUL;
+	}
+	close(from_rz[0]);
+	close(to_rz[1]);
+	if (sz_pid > 0) {
+		int status;
+		waitpid(sz_pid, &status, 0);
+		ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+	}
+	waitpid(rz_pid, NULL, 0);
+	elapsed = now() - start;
+	unlink(src_name);
+	unlink(dst_name);
+	return ok ? elapsed : -1;
+}
+
+/**
+ * Receive a file from lrzsz sz, with either xmodem_server (XMODEM-1K) or
+ * zmodem_server
+ * @return Time taken in seconds, or < 0 on failure
+ */
+static double bench_from_sz(bool zmodem, const uint8_t *data, size_t data_size)
+{
+	char src_name[] = "/tmp/xmodem_bench.XXXXXX";
+	char command[200];
+	int to_sz[2], from_sz[2];
+	struct xmodem_server xdm;
+	struct zmodem_server zdm;
+	size_t received = 0, len;
+	pid_t sz_pid;
+	double start, elapsed;
+	bool ok;
+	int fd;
+
+	fd = mkstemp(src_name);
+	if (fd < 0 || write(fd, data, data_size) != (ssize_t)data_size)
+		return -1;
+	close(fd);
+	if (pipe(to_sz) < 0 || pipe(from_sz) < 0)
+		return -1;
+
+	start = now();
+	snprintf(command, sizeof(command), "exec sz %s --quiet %s", zmodem ? "--zmodem" : "--xmodem --1k", src_name);
+	sz_pid = spawn(command, to_sz[0], from_sz[1]);
+	close(to_sz[0]);
+	close(from_sz[1]);
+	if (zmodem)
+		zmodem_server_init(&zdm, NULL, NULL);
+	else
+		xmodem_server_init(&xdm, NULL, NULL);
+
+	while (zmodem ? !zmodem_server_is_done(&zdm) : !xmodem_server_is_done(&xdm)) {
+		fd_set rd_fds, wr_fds;
+		struct timeval tv = {.tv_sec = 0, .tv_usec = 10000};
+		uint8_t buffer[4096];
+		const uint8_t *pending;
+		ssize_t count = 0, pos = 0;
+
+		FD_ZERO(&rd_fds);
+		FD_ZERO(&wr_fds);
+		FD_SET(from_sz[0], &rd_fds);
+		pending = zmodem ? zmodem_server_pending_tx(&zdm, &len) : xmodem_server_pending_tx(&xdm, &len);
+		if (len > 0)
+			FD_SET(to_sz[1], &wr_fds);
+		if (select((from_sz[0] > to_sz[1] ? from_sz[0] : to_sz[1]) + 1, &rd_fds, &wr_fds, NULL, &tv) < 0)
+			break;
+		if (FD_ISSET(to_sz[1], &wr_fds)) {
+			ssize_t r = write(to_sz[1], pending, len);
+			if (r > 0 && zmodem)
+				zmodem_server_tx_done(&zdm, r);
+			else if (r > 0)
+				xmodem_server_tx_done(&xdm, r);
+		}
+		if (FD_ISSET(from_sz[0], &rd_fds)) {
+			count = read(from_sz[0], buffer, sizeof(buffer));
+			if (count <= 0)
+				break;
+		}
+		do {
+			const uint8_t *packet;
+			uint64_t offset;
+			uint32_t block_nr;
+			int packet_len;
+
+			if (zmodem) {
+				pos += zmodem_server_rx_bytes(&zdm, &buffer[pos], count - pos);
+				packet_len = zmodem_server_process_borrow(&zdm, &packet, &offset, ms_time());
+			} else {
+				pos += xmodem_server_rx_bytes(&xdm, &buffer[pos], count - pos);
+				packet_len = xmodem_server_process_borrow(&xdm, &packet, &block_nr, ms_time());
+			}
+			if (packet_len > 0)
+				received += packet_len;
+		} while (pos < count && (zmodem ? !zmodem_server_is_done(&zdm) : !xmodem_server_is_done(&xdm)));
+	}
+	// Let sz see our final ZFIN/ACK
+	if (zmodem) {
+		const uint8_t *pending = zmodem_server_pending_tx(&zdm, &len);
+		ok = zmodem_server_get_state(&zdm) == ZMODEM_STATE_SUCCESSFUL && write(to_sz[1], pending, len) == (ssize_t)len;
+	} else {
+		const uint8_t *pending = xmodem_server_pending_tx(&xdm, &len);
+		ok = xmodem_server_get_state(&xdm) == XMODEM_STATE_SUCCESSFUL && write(to_sz[1], pending, len) == (ssize_t)len;
+	}
+	close(from_sz[0]);
+	close(to_sz[1]);
+	waitpid(sz_pid, NULL, 0);
+	elapsed = now() - start;
+	unlink(src_name);
+	// XMODEM pads out the last block
+	return ok && received >= data_size ? elapsed : -1;
+}
+
+/**
+ * Two ends of a link for the end-to-end benchmarks. With a pty, the
+ * receiver has the (raw mode) tty side, as it would for a serial port
+ */
+struct e2e_link {
+	int sender_in, sender_out;
+	int receiver_in, receiver_out;
+};
+
+/**
+ * Resource usage of one receiver run
+ */
+struct e2e_usage {
+	double wall, user, sys;
+	uint64_t syscalls; // read & write calls, from /proc/<pid>/io
+	long voluntary_cs, involuntary_cs;
+};
+
+static int e2e_link_open(struct e2e_link *link, bool pty)
+{
+	if (pty) {
+		struct termios tio;
+		int master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+		int slave;
+
+		if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0)
+			return -1;
+		slave = open(ptsname(master), O_RDWR | O_NOCTTY | O_CLOEXEC);
+		if (slave < 0 || tcgetattr(slave, &tio) < 0)
+			return -1;
+		cfmakeraw(&tio);
+		if (tcsetattr(slave, TCSANOW, &tio) < 0)
+			return -1;
+		link->sender_in = link->sender_out = master;
+		link->receiver_in = link->receiver_out = slave;
+	} else {
+		int to_receiver[2], to_sender[2];
+
+		if (pipe(to_receiver) < 0 || pipe(to_sender) < 0)
+			return -1;
+		// Neither end should leak into the other's process
+		for (int i = 0; i < 2; i++) {
+			fcntl(to_receiver[i], F_SETFD, FD_CLOEXEC);
+			fcntl(to_sender[i], F_SETFD, FD_CLOEXEC);
+		}
+		link->sender_in = to_sender[0];
+		link->sender_out = to_receiver[1];
+		link->receiver_in = to_receiver[0];
+		link->receiver_out = to_sender[1];
+	}
+	return 0;
+}
+
+static void e2e_link_close(struct e2e_link *link)
+{
+	int fds[4] = {link->sender_in, link->sender_out, link->receiver_in, link->receiver_out};
+
+	for (int i = 0; i < 4; i++) {
+		bool dup = false;
+		for (int j = 0; j < i; j++)
+			dup |= fds[j] == fds[i];
+		if (!dup)
+			close(fds[i]);
+	}
+}
+
+/**
+ * Receive a file with xmodem_server, reading up to buffer_size bytes at a
+ * time. Run in a child process, so its resource usage can be measured
+ * @return 0 on success
+ */
+static int e2e_receive(int in_fd, int out_fd, int file_fd, size_t buffer_size)
+{
+	struct xmodem_server xdm;
+	uint8_t *buffer = malloc(buffer_size);
+	const uint8_t *pending;
+	size_t len;
+
+	if (!buffer)
+		return 1;
+	xmodem_server_init(&xdm, NULL, NULL);
+	xmodem_server_process(&xdm, NULL, NULL, ms_time());
+	while (!xmodem_server_is_done(&xdm)) {
+		struct pollfd pfd = {.fd = in_fd, .events = POLLIN};
+		int64_t deadline = xmodem_server_next_deadline(&xdm);
+		int64_t timeout = deadline > 0 ? deadline - ms_time() : 0;
+		ssize_t count = 0, pos = 0;
+
+		pending = xmodem_server_pending_tx(&xdm, &len);
+		if (len > 0) {
+			ssize_t r = write(out_fd, pending, len);
+			if (r <= 0)
+				break;
+			xmodem_server_tx_done(&xdm, r);
+		}
+		if (poll(&pfd, 1, timeout < 0 ? 0 : timeout) > 0) {
+			count = read(in_fd, buffer, buffer_size);
+			if (count <= 0)
+				break;
+		}
+		do {
+			const uint8_t *packet;
+			uint32_t block_nr;
+			int packet_len;
+
+			pos += xmodem_server_rx_bytes(&xdm, &buffer[pos], count - pos);
+			packet_len = xmodem_server_process_borrow(&xdm, &packet, &block_nr, ms_time());
+			if (packet_len > 0) {
+				if (write(file_fd, packet, packet_len) != packet_len)
+					return 1;
+				xmodem_server_release_packet(&xdm);
+			}
+		} while (pos < count && !xmodem_server_is_done(&xdm));
+	}
+	// Let sz see our final ACK
+	pending = xmodem_server_pending_tx(&xdm, &len);
+	if (len > 0 && write(out_fd, pending, len) != (ssize_t)len)
+		return 1;
+	free(buffer);
+	return xmodem_server_get_state(&xdm) == XMODEM_STATE_SUCCESSFUL ? 0 : 1;
+}
+
+/**
+ * Count the read & write calls a finished (but not yet reaped) process made
+ */
+static uint64_t process_syscalls(pid_t pid)
+{
+	char path[40];
+	char line[80];
+	uint64_t total = 0;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+	while (fgets(line, sizeof(line), f)) {
+		unsigned long long value;
+		if (sscanf(line, "syscr: %llu", &value) == 1 || sscanf(line, "syscw: %llu", &value) == 1)
+			total += value;
+	}
+	fclose(f);
+	return total;
+}
+
+/**
+ * Check that the received file starts with the data that was sent. XMODEM
+ * pads out the last block, so it may be longer
+ */
+static bool same_prefix(const char *a_name, const char *b_name, uint64_t size)
+{
+	static uint8_t a[1 << 20], b[1 << 20];
+	int a_fd = open(a_name, O_RDONLY);
+	int b_fd = open(b_name, O_RDONLY);
+	bool same = a_fd >= 0 && b_fd >= 0;
+
+	while (same && size > 0) {
+		size_t chunk = size < sizeof(a) ? size : sizeof(a);
+		same = read(a_fd, a, chunk) == (ssize_t)chunk && read(b_fd, b, chunk) == (ssize_t)chunk &&
+			memcmp(a, b, chunk) == 0;
+		size -= chunk;
+	}
+	if (a_fd >= 0)
+		close(a_fd);
+	if (b_fd >= 0)
+		close(b_fd);
+	return same;
+}
+
+/**
+ * Send a file from lrzsz sz, over a pipe or pty, to either lrzsz rz or
+ * xmodem_server (in a child process)
+ * @param buffer_size Read size for xmodem_server, or 0 to use rz
+ * @return 0 on success
+ */
+static int bench_e2e(bool pty, size_t buffer_size, const char *src_name, const char *dst_name, uint64_t data_size,
+		struct e2e_usage *usage)
+{
+	struct e2e_link link;
+	struct rusage ru;
+	siginfo_t info;
+	char command[200];
+	pid_t rx_pid, sz_pid;
+	double start;
+	int status;
+
+	if (e2e_link_open(&link, pty) < 0)
+		return -1;
+	start = now();
+	if (buffer_size) {
+		rx_pid = fork();
+		if (rx_pid == 0) {
+			int file_fd;
+
+			// Leave sz as the only writer, so we see it go away
+			close(link.sender_in);
+			if (link.sender_out != link.sender_in)
+				close(link.sender_out);
+			file_fd = open(dst_name, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+			_exit(file_fd < 0 ? 1 : e2e_receive(link.receiver_in, link.receiver_out, file_fd, buffer_size));
+		}
+	} else {
+		// rz refuses absolute paths, so run it from /tmp
+		snprintf(command, sizeof(command), "cd /tmp && exec rz --xmodem --with-crc --overwrite --quiet %s", &dst_name[5]);
+		rx_pid = spawn(command, link.receiver_in, link.receiver_out);
+	}
+	snprintf(command, sizeof(command), "exec sz --xmodem --1k --quiet %s", src_name);
+	sz_pid = spawn(command, link.sender_in, link.sender_out);
+	e2e_link_close(&link);
+	if (rx_pid < 0 || sz_pid < 0)
+		return -1;
+
+	// Collect the I/O counts before the receiver is reaped
+	if (waitid(P_PID, rx_pid, &info, WEXITED | WNOWAIT) < 0)
+		return -1;
+	usage->syscalls = process_syscalls(rx_pid);
+	if (wait4(rx_pid, &status, 0, &ru) < 0)
+		return -1;
+	waitpid(sz_pid, NULL, 0);
+	usage->wall = now() - start;
+	usage->user = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+	usage->sys = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+	usage->voluntary_cs = ru.ru_nvcsw;
+	usage->involuntary_cs = ru.ru_nivcsw;
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 || !same_prefix(src_name, dst_name, data_size))
+		return -1;
+	return 0;
+}
+
+static void report_e2e(const char *name, uint64_t data_size, int result, const struct e2e_usage *usage)
+{
+	if (result < 0)
+		printf("%-28s FAILED\n", name);
+	else
+		printf("%-28s %8.3fs %9.2f MB/s %7.3fs %7.3fs %10llu %8ld %8ld\n", name, usage->wall,
+			data_size / usage->wall / 1e6, usage->user, usage->sys, (unsigned long long)usage->syscalls,
+			usage->voluntary_cs, usage->involuntary_cs);
+}
+
+/**
+ * Compare xmodem_server with lrzsz rz, receiving the same file from sz
+ * over pipes & ptys. The file is generated on disk, so can be much larger
+ * than memory
+ */
+static int bench_end_to_end(uint64_t data_size)
+{
+	const size_t buffer_sizes[] = {32, 256, 1024, 4096, 65536};
+	char src_name[] = "/tmp/xmodem_bench.XXXXXX";
+	char dst_name[] = "/tmp/xmodem_bench.XXXXXX";
+	uint8_t chunk[65536];
+	bool have_rz = have_program("rz");
+	int fd;
+
+	if (!have_program("sz")) {
+		printf("lrzsz not found, skipping end-to-end benchmarks\n");
+		return EXIT_SUCCESS;
+	}
+	fd = mkstemp(src_name);
+	if (fd < 0)
+		return EXIT_FAILURE;
+	for (uint64_t written = 0; written < data_size; written += sizeof(chunk)) {
+		size_t len = data_size - written < sizeof(chunk) ? data_size - written : sizeof(chunk);
+		for (size_t i = 0; i < len; i++)
+			chunk[i] = rand();
+		if (write(fd, chunk, len) != (ssize_t)len) {
+			close(fd);
+			unlink(src_name);
+			return EXIT_FAILURE;
+		}
+	}
+	close(fd);
+	fd = mkstemp(dst_name);
+	if (fd < 0) {
+		unlink(src_name);
+		return EXIT_FAILURE;
+	}
+	close(fd);
+
+	printf("sz (XMODEM-1K) -> receiver, %llu bytes\n", (unsigned long long)data_size);
+	printf("%-28s %9s %14s %8s %8s %10s %8s %8s\n", "receiver", "wall", "throughput", "user", "sys",
+		"rd/wr calls", "vol cs", "invol cs");
+	for (int pty = 0; pty < 2; pty++) {
+		struct e2e_usage usage;
+		char name[60];
+		int result;
+
+		if (have_rz) {
+			snprintf(name, sizeof(name), "rz (%s)", pty ? "pty" : "pipe");
+			result = bench_e2e(pty, 0, src_name, dst_name, data_size, &usage);
+			report_e2e(name, data_size, result, &usage);
+		}
+		for (size_t i = 0; i < sizeof(buffer_sizes) / sizeof(buffer_sizes[0]); i++) {
+			snprintf(name, sizeof(name), "xmodem_server (%s, %zuB)", pty ? "pty" : "pipe", buffer_sizes[i]);
+			result = bench_e2e(pty, buffer_sizes[i], src_name, dst_name, data_size, &usage);
+			report_e2e(name, data_size, result, &usage);
+		}
+	}
+	unlink(src_name);
+	unlink(dst_name);
+	return EXIT_SUCCESS;
+}
+
+struct sink_result {
+	double elapsed;
+	double write_total; // Time the protocol loop spent in xmodem_sink_write
+	double write_max;
+	int writes;
+	double sync; // Time for the barrier at EOT
+};
+
+/**
+ * Run a client & server against each other in memory, as bench_loopback,
+ * storing the packets with an xmodem_sink. Time spent in the sink delays
+ * the ACK of each block. If rate is non-zero, blocks are delivered no
+ * faster than that many bytes/s, as if over a real link
+ * @return < 0 on failure
+ */
+static int bench_sink(const char *dir, uint32_t flags, double rate, const uint8_t *data, size_t data_size,
+		struct sink_result *result)
+{
+	static struct xmodem_sink sink;
+	struct xmodem_client client;
+	struct xmodem_server server;
+	char name[PATH_MAX];
+	double start;
+	int ret = -1;
+	int fd;
+
+	memset(result, 0, sizeof(*result));
+	snprintf(name, sizeof(name), "%s/xmodem_bench.XXXXXX", dir);
+	fd = mkstemp(name);
+	if (fd < 0)
+		return -1;
+	close(fd);
+	if (xmodem_sink_open(&sink, name, flags) < 0) {
+		unlink(name);
+		return -1;
+	}
+
+	start = now();
+	xmodem_client_init_mem(&client, 1024, data, data_size);
+	xmodem_server_init(&server, NULL, NULL);
+	while (!xmodem_client_is_done(&client) || !xmodem_server_is_done(&server)) {
+		const uint8_t *pending;
+		const uint8_t *packet;
+		uint32_t block_nr;
+		size_t len;
+		int packet_len;
+
+		xmodem_client_process(&client, 1);
+		pending = xmodem_client_pending_tx(&client, &len);
+		xmodem_client_tx_done(&client, xmodem_server_rx_bytes(&server, pending, len));
+		packet_len = xmodem_server_process_borrow(&server, &packet, &block_nr, 1);
+		if (packet_len > 0) {
+			double write_start = now();
+			double elapsed;
+
+			if (xmodem_sink_write(&sink, packet, packet_len, xmodem_server_packet_offset(&server)) < 0)
+				goto out;
+			elapsed = now() - write_start;
+			result->write_total += elapsed;
+			if (elapsed > result->write_max)
+				result->write_max = elapsed;
+			result->writes++;
+			xmodem_server_release_packet(&server);
+			while (rate > 0 && now() < start + xmodem_server_packet_offset(&server) / rate)
+				;
+		}
+		pending = xmodem_server_pending_tx(&server, &len);
+		for (size_t i = 0; i < len; i++)
+			xmodem_client_rx_byte(&client, pending[i]);
+		xmodem_server_tx_done(&server, len);
+		if (xmodem_client_get_state(&client) == XMODEM_CLIENT_STATE_FAILURE)
+			goto out;
+	}
+	result->sync = now();
+	if (xmodem_sink_sync(&sink) < 0)
+		goto out;
+	result->sync = now() - result->sync;
+	result->elapsed = now() - start;
+	ret = 0;
+out:
+	if (xmodem_sink_close(&sink, -1) < 0)
+		ret = -1;
+	unlink(name);
+	return ret;
+}
+
+/**
+ * Compare the ways of storing received data, on storage of differing
+ * latency: tmpfs, the page cache of a real disk, and the disk itself with
+ * O_DSYNC
+ */
+static int bench_sinks(const char * const *dirs, int dir_count, const uint8_t *data, size_t data_size)
+{
+	// At full speed, throughput is bound by storage whatever the sink.
+	// With the sender paced like a fast serial link, the ACK delay shows
+	// how much of the storage latency each sink hides
+	const double link_rate = 4e6;
+	const size_t paced_size = data_size < 4 * 1024 * 1024 ? data_size : 4 * 1024 * 1024;
+	const struct {
+		const char *name;
+		uint32_t flags;
+		double rate;
+	} modes[] = {
+		{"write", 0, 0},
+		{"mmap", XMODEM_SINK_MMAP, 0},
+		{"io_uring", XMODEM_SINK_URING, 0},
+		{"write, O_DSYNC", XMODEM_SINK_DSYNC, 0},
+		{"io_uring, O_DSYNC", XMODEM_SINK_URING | XMODEM_SINK_DSYNC, 0},
+		{"write, O_DSYNC, 4MB/s", XMODEM_SINK_DSYNC, link_rate},
+		{"io_uring, O_DSYNC, 4MB/s", XMODEM_SINK_URING | XMODEM_SINK_DSYNC, link_rate},
+	};
+
+	printf("client -> xmodem_server (1kB) -> sink, %zu bytes (%zu when paced)\n", data_size, paced_size);
+	printf("%-36s %9s %14s %12s %12s %10s\n", "sink", "wall", "throughput", "mean write", "max write",
+		"EOT sync");
+	for (int i = 0; i < dir_count; i++) {
+		for (size_t j = 0; j < sizeof(modes) / sizeof(modes[0]); j++) {
+			size_t size = modes[j].rate ? paced_size : data_size;
+			struct sink_result result;
+			char name[60];
+
+			snprintf(name, sizeof(name), "%s (%s)", dirs[i], modes[j].name);
+			if (bench_sink(dirs[i], modes[j].flags, modes[j].rate, data, size, &result) < 0) {
+				printf("%-36s FAILED (%s)\n", name, strerror(errno));
+				continue;
+			}
+			printf("%-36s %8.3fs %9.2f MB/s %10.1fus %10.1fus %8.2fms\n", name, result.elapsed,
+				size / result.elapsed / 1e6, result.write_total / result.writes * 1e6,
+				result.write_max * 1e6, result.sync * 1e3);
+		}
+	}
+	return EXIT_SUCCESS;
+}
+
+enum tty_receiver {
+	TTY_BYTE, // poll, then read a byte at a time
+	TTY_SELECT, // select, then read into a small buffer, as in xmodem_server_test
+	TTY_ADAPTER, // xmodem_tty
+};
+
+static int tty_discard(struct xmodem_server *xdm, const uint8_t *data, int len, uint32_t block_num, void *cb_data)
+{
+	(void)xdm;
+	(void)data;
+	(void)len;
+	(void)block_num;
+	(void)cb_data;
+	return 0;
+}
+
+static void tty_flush(struct xmodem_server *xdm, int fd)
+{
+	size_t len;
+	const uint8_t *pending = xmodem_server_pending_tx(xdm, &len);
+
+	if (len > 0 && write(fd, pending, len) > 0)
+		xmodem_server_tx_done(xdm, len);
+}
+
+/**
+ * Receive over one side of a pty, in the way an integrator might write it
+ * by hand, or with xmodem_tty
+ */
+static int tty_receive(enum tty_receiver receiver, int fd)
+{
+	static struct xmodem_tty tty;
+	struct xmodem_server xdm;
+	int r = 1;
+
+	xmodem_server_init(&xdm, NULL, NULL);
+	if (receiver == TTY_ADAPTER) {
+		if (xmodem_tty_init(&tty, fd) < 0)
+			return -1;
+		while ((r = xmodem_tty_run(&tty, &xdm, tty_discard, NULL)) > 0)
+			;
+		xmodem_tty_close(&tty);
+		return r;
+	}
+	while (!xmodem_server_is_done(&xdm)) {
+		const uint8_t *packet;
+		uint32_t block_nr;
+		uint8_t buffer[32];
+		ssize_t count = 0;
+
+		tty_flush(&xdm, fd);
+		if (receiver == TTY_BYTE) {
+			struct pollfd pfd = {.fd = fd, .events = POLLIN};
+
+			if (poll(&pfd, 1, 10) > 0)
+				count = read(fd, buffer, 1);
+		} else {
+			struct timeval tv = {.tv_usec = 10000};
+			fd_set rd_fds;
+
+			FD_ZERO(&rd_fds);
+			FD_SET(fd, &rd_fds);
+			if (select(fd + 1, &rd_fds, NULL, NULL, &tv) > 0)
+				count = read(fd, buffer, sizeof(buffer));
+		}
+		if (count < 0)
+			return -1;
+		for (ssize_t i = 0; i < count; i++)
+			xmodem_server_rx_byte(&xdm, buffer[i]);
+		if (xmodem_server_process_borrow(&xdm, &packet, &block_nr, ms_time()) > 0)
+			xmodem_server_release_packet(&xdm);
+	}
+	tty_flush(&xdm, fd);
+	return xmodem_server_get_state(&xdm) == XMODEM_STATE_SUCCESSFUL ? 0 : -1;
+}
+
+/**
+ * Send with xmodem_client over the other side of a pty
+ */
+static int tty_send(int fd, const uint8_t *data, size_t data_size)
+{
+	struct xmodem_client client;
+
+	xmodem_client_init_mem(&client, 1024, data, data_size);
+	while (!xmodem_client_is_done(&client)) {
+		struct pollfd pfd = {.fd = fd, .events = POLLIN};
+		size_t len;
+		const uint8_t *pending = xmodem_client_pending_tx(&client, &len);
+
+		if (len > 0)
+			pfd.events |= POLLOUT;
+		if (poll(&pfd, 1, 1) > 0) {
+			if (pfd.revents & POLLOUT) {
+				ssize_t w = write(fd, pending, len);
+				if (w > 0)
+					xmodem_client_tx_done(&client, w);
+			}
+			if (pfd.revents & POLLIN) {
+				uint8_t buffer[32];
+				ssize_t count = read(fd, buffer, sizeof(buffer));
+				for (ssize_t i = 0; i < count; i++)
+					xmodem_client_rx_byte(&client, buffer[i]);
+			}
+		}
+		xmodem_client_process(&client, ms_time());
+	}
+	return xmodem_client_get_state(&client) == XMODEM_CLIENT_STATE_SUCCESSFUL ? 0 : -1;
+}
+
+/**
+ * Compare receive loops over a pty pair, with xmodem_client sending from a
+ * child process. Only reads & writes are counted, not the poll/select &
+ * tcsetattr calls between them
+ */
+static int bench_tty(const uint8_t *data, size_t data_size)
+{
+	const char *names[] = {
+		[TTY_BYTE] = "poll + 1 byte reads",
+		[TTY_SELECT] = "select + 32 byte reads",
+		[TTY_ADAPTER] = "xmodem_tty",
+	};
+
+	printf("xmodem_client (1kB) -> pty -> receiver, %zu bytes\n", data_size);
+	printf("%-28s %9s %14s %8s %8s %10s %10s\n", "receiver", "wall", "throughput", "user", "sys",
+		"rd/wr calls", "per block");
+	for (int i = 0; i < 3; i++) {
+		struct e2e_link link;
+		struct rusage before, after;
+		uint64_t calls;
+		double start, wall;
+		pid_t pid;
+		int status, result;
+
+		if (e2e_link_open(&link, true) < 0)
+			return EXIT_FAILURE;
+		pid = fork();
+		if (pid < 0)
+			return EXIT_FAILURE;
+		if (pid == 0) {
+			close(link.receiver_in);
+			_exit(tty_send(link.sender_in, data, data_size) < 0 ? 1 : 0);
+		}
+		close(link.sender_in);
+		getrusage(RUSAGE_SELF, &before);
+		calls = process_syscalls(getpid());
+		start = now();
+		result = tty_receive(i, link.receiver_in);
+		wall = now() - start;
+		calls = process_syscalls(getpid()) - calls;
+		getrusage(RUSAGE_SELF, &after);
+		close(link.receiver_in);
+		if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			result = -1;
+		if (result < 0) {
+			printf("%-28s FAILED\n", names[i]);
+			continue;
+		}
+		printf("%-28s %8.3fs %9.2f MB/s %7.3fs %7.3fs %10llu %10.1f\n", names[i], wall, data_size / wall / 1e6,
+			(after.ru_utime.tv_sec - before.ru_utime.tv_sec) + (after.ru_utime.tv_usec - before.ru_utime.tv_usec) / 1e6,
+			(after.ru_stime.tv_sec - before.ru_stime.tv_sec) + (after.ru_stime.tv_usec - before.ru_stime.tv_usec) / 1e6,
+			(unsigned long long)calls, calls / (data_size / 1024.0));
+	}
+	return EXIT_SUCCESS;
+}
+
+// Simulated senders for the pool benchmark, and how many processes share them
+#define POOL_SENDERS 256
+#define POOL_SENDER_PROCS 8
+
+struct pool_bench {
+	const uint8_t *data;
+	size_t size;
+	atomic_int failures;
+};
+
+/**
+ * Stands in for the sink work, and checks nothing was lost or repeated
+ */
+static int pool_verify(struct xmodem_pool_session *session, const uint8_t *data, int len, uint32_t block_num, void *cb_data)
+{
+	const struct pool_bench *bench = cb_data;
+	uint64_t offset = xmodem_server_packet_offset(xmodem_pool_server(session));
+
+	(void)block_num;
+	if (offset + len > bench->size || memcmp(&bench->data[offset], data, len) != 0)
+		return -1;
+	return 0;
+}
+
+static void pool_finished(struct xmodem_pool_session *session, xmodem_server_state state, void *cb_data)
+{
+	struct pool_bench *bench = cb_data;
+
+	(void)session;
+	if (state != XMODEM_STATE_SUCCESSFUL)
+		atomic_fetch_add(&bench->failures, 1);
+}
+
+/**
+ * Drive a share of the senders with xmodem_client, in one process
+ */
+static int pool_send(const int *fds, int count, const uint8_t *data, size_t data_size)
+{
+	struct xmodem_client *clients = calloc(count, sizeof(*clients));
+	struct pollfd *pfds = calloc(count, sizeof(*pfds));
+	int remaining = count, failed = 0;
+
+	if (!clients || !pfds)
+		return -1;
+	for (int i = 0; i < count; i++) {
+		xmodem_client_init_mem(&clients[i], 1024, data, data_size);
+		pfds[i].fd = fds[i];
+	}
+	while (remaining > 0) {
+		for (int i = 0; i < count; i++) {
+			size_t len;
+
+			xmodem_client_pending_tx(&clients[i], &len);
+			pfds[i].events = pfds[i].fd < 0 ? 0 : len > 0 ? POLLIN | POLLOUT : POLLIN;
+		}
+		poll(pfds, count, 1);
+		for (int i = 0; i < count; i++) {
+			struct xmodem_client *client = &clients[i];
+
+			if (pfds[i].fd < 0)
+				continue;
+			if (pfds[i].revents & POLLOUT) {
+				size_t len;
+				const uint8_t *pending = xmodem_client_pending_tx(client, &len);
+				ssize_t w = write(pfds[i].fd, pending, len);
+				if (w > 0)
+					xmodem_client_tx_done(client, w);
+			}
+			if (pfds[i].revents & (POLLIN | POLLHUP)) {
+				uint8_t buffer[32];
+				ssize_t r = read(pfds[i].fd, buffer, sizeof(buffer));
+				for (ssize_t j = 0; j < r; j++)
+					xmodem_client_rx_byte(client, buffer[j]);
+			}
+			xmodem_client_process(client, ms_time());
+			if (xmodem_client_is_done(client)) {
+				if (xmodem_client_get_state(client) != XMODEM_CLIENT_STATE_SUCCESSFUL)
+					failed++;
+				close(pfds[i].fd);
+				pfds[i].fd = -1;
+				remaining--;
+			}
+		}
+	}
+	free(clients);
+	free(pfds);
+	return failed ? -1 : 0;
+}
+
+/**
+ * Receive from POOL_SENDERS senders at once with an xmodem_pool of the
+ * given size. The senders are spread over a few child processes
+ * @return Time taken in seconds, or < 0 on failure
+ */
+static double bench_pool_run(int workers, const uint8_t *data, size_t data_size, double *cpu, uint64_t *stolen)
+{
+	static struct xmodem_pool pool;
+	static struct xmodem_pool_session sessions[POOL_SENDERS];
+	struct pool_bench bench = {.data = data, .size = data_size};
+	int fds[POOL_SENDERS], child_fds[POOL_SENDERS];
+	pid_t pids[POOL_SENDER_PROCS];
+	struct rusage before, after;
+	bool ok = true;
+	double start, elapsed;
+
+	atomic_init(&bench.failures, 0);
+	for (int i = 0; i < POOL_SENDERS; i++) {
+		int pair[2];
+
+		if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0)
+			return -1;
+		fds[i] = pair[0];
+		child_fds[i] = pair[1];
+	}
+	// Before the workers are started, so the children only have one thread
+	for (int p = 0; p < POOL_SENDER_PROCS; p++) {
+		pids[p] = fork();
+		if (pids[p] < 0)
+			return -1;
+		if (pids[p] == 0) {
+			int share[POOL_SENDERS];
+			int count = 0;
+
+			for (int i = 0; i < POOL_SENDERS; i++) {
+				close(fds[i]);
+				if (i % POOL_SENDER_PROCS == p)
+					share[count++] = child_fds[i];
+				else
+					close(child_fds[i]);
+			}
+			_exit(pool_send(share, count, data, data_size) < 0 ? 1 : 0);
+		}
+	}
+	for (int i = 0; i < POOL_SENDERS; i++)
+		close(child_fds[i]);
+
+	getrusage(RUSAGE_SELF, &before);
+	start = now();
+	if (xmodem_pool_init(&pool, workers) < 0)
+		return -1;
+	for (int i = 0; i < POOL_SENDERS; i++) {
+		if (xmodem_pool_session_init(&sessions[i], fds[i], fds[i], 0, pool_verify, pool_finished, &bench) < 0 ||
+				xmodem_pool_add(&pool, &sessions[i]) < 0)
+			ok = false;
+	}
+	if (xmodem_pool_wait(&pool, 600000) != 0)
+		ok = false;
+	elapsed = now() - start;
+	*stolen = xmodem_pool_stolen(&pool);
+	xmodem_pool_close(&pool);
+	getrusage(RUSAGE_SELF, &after);
+	*cpu = (after.ru_utime.tv_sec - before.ru_utime.tv_sec) + (after.ru_utime.tv_usec - before.ru_utime.tv_usec) / 1e6 +
+		(after.ru_stime.tv_sec - before.ru_stime.tv_sec) + (after.ru_stime.tv_usec - before.ru_stime.tv_usec) / 1e6;
+
+	for (int i = 0; i < POOL_SENDERS; i++)
+		close(fds[i]);
+	for (int p = 0; p < POOL_SENDER_PROCS; p++) {
+		int status;
+
+		if (waitpid(pids[p], &status, 0) != pids[p] || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			ok = false;
+	}
+	if (!ok || atomic_load(&bench.failures) > 0)
+		return -1;
+	return elapsed;
+}
+
+/**
+ * Scale the pool from 1 worker up to one per CPU, receiving from hundreds
+ * of senders at once. The senders run on the same machine, so they take
+ * some of the CPU time away from the workers
+ */
+static int bench_pool(const uint8_t *data, size_t data_size)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t each = data_size / POOL_SENDERS / 1024 * 1024;
+	double base = 0;
+
+	if (cpus < 1)
+		cpus = 1;
+	if (cpus > XMODEM_POOL_MAX_WORKERS)
+		cpus = XMODEM_POOL_MAX_WORKERS;
+	if (each == 0)
+		each = 1024;
+	// Nobody is left to read the final responses
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("%d xmodem_client (1kB) -> socketpair -> xmodem_pool, %zu bytes each\n", POOL_SENDERS, each);
+	printf("%-8s %9s %14s %8s %9s %10s\n", "workers", "wall", "throughput", "speedup", "cpu", "stolen");
+	for (int workers = 1; workers <= cpus; workers = workers * 2 > cpus && workers < cpus ? cpus : workers * 2) {
+		uint64_t stolen = 0;
+		double cpu = 0;
+		double elapsed = bench_pool_run(workers, data, each, &cpu, &stolen);
+
+		if (elapsed < 0) {
+			printf("%-8d FAILED\n", workers);
+			return EXIT_FAILURE;
+		}
+		if (workers == 1)
+			base = elapsed;
+		printf("%-8d %8.3fs %9.2f MB/s %7.2fx %8.3fs %10llu\n", workers, elapsed,
+			(double)each * POOL_SENDERS / elapsed / 1e6, base / elapsed, cpu, (unsigned long long)stolen);
+	}
+	return EXIT_SUCCESS;
+}
+
+static void report(const char *name, size_t data_size, double elapsed)
+{
+	if (elapsed < 0)
+		printf("%-40s FAILED\n", name);
+	else
+		printf("%-40s %8.3fs %10.2f MB/s\n", name, elapsed, data_size / elapsed / 1e6);
+}
+
+static void report_recovery(const char *name, double extra, int losses)
+{
+	if (extra < 0 || losses <= 0)
+		printf("%-40s FAILED\n", name);
+	else
+		printf("%-40s %8.0fms per loss (simulated)\n", name, extra * 1e3 / losses);
+}
+
+static void report_sim(const char *name, size_t data_size, double elapsed)
+{
+	if (elapsed < 0)
+		printf("%-40s FAILED\n", name);
+	else
+		printf("%-40s %8.3fs %10.2f kB/s (simulated)\n", name, elapsed, data_size / elapsed / 1e3);
+}
+
+/**
+ * Parse a size, with an optional k/M/G suffix
+ */
+static uint64_t parse_size(const char *arg)
+{
+	char *end;
+	uint64_t size = strtoull(arg, &end, 0);
+
+	switch (*end) {
+	case 'G': size *= 1024;
+	// fall through
+	case 'M': size *= 1024;
+	// fall through
+	case 'k': size *= 1024;
+	}
+	return size;
+}
+
+int main(int argc, char *argv[])
+{
+	uint64_t data_size = 4 * 1024 * 1024;
+	bool end_to_end = false;
+	bool sinks_only = false;
+	bool tty_only = false;
+	bool pool_only = false;
+	const char *dirs[8] = {"/dev/shm", "/tmp"};
+	int dir_count = 0;
+	uint8_t *data;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "estpd:")) != -1) {
+		switch (opt) {
+		case 'e':
+			end_to_end = true;
+			break;
+		case 's':
+			sinks_only = true;
+			break;
+		case 't':
+			tty_only = true;
+			break;
+		case 'p':
+			pool_only = true;
+			break;
+		case 'd':
+			if (dir_count < (int)(sizeof(dirs) / sizeof(dirs[0]))) {
+				dirs[dir_count++] = optarg;
+				break;
+			}
+			// fall through
+		default:
+			fprintf(stderr, "Usage: %s [-e] [-s] [-t] [-p] [-d DIR]... [SIZE]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (dir_count == 0)
+		dir_count = 2;
+	if (optind < argc)
+		data_size = parse_size(argv[optind]);
+	if (end_to_end)
+		return bench_end_to_end(data_size);
+
+	data = malloc(data_size);
+	if (!data)
+		return EXIT_FAILURE;
+	for (size_t i = 0; i < data_size; i++)
+		data[i] = rand();
+	if (sinks_only || tty_only || pool_only) {
+		int ret = sinks_only ? bench_sinks(dirs, dir_count, data, data_size) :
+			tty_only ? bench_tty(data, data_size) : bench_pool(data, data_size);
+
+		free(data);
+		return ret;
+	}
+
+	report("loopback client->server (128B)", data_size, bench_loopback(128, 0, data, data_size));
+	report("loopback client->server (1kB)", data_size, bench_loopback(1024, 0, data, data_size));
+	report("loopback client->server (1kB, G)", data_size, bench_loopback(1024, XMODEM_FLAG_STREAMING, data, data_size));
+
+	// 50ms round trip, as seen on serial-over-network links
+	for (int i = 0; i < 2; i++) {
+		const int bauds[] = {115200, 1000000};
+		const size_t sim_size = data_size < 256 * 1024 ? data_size : 256 * 1024;
+		char name[60];
+
+		for (int slots = 0; slots <= 16; slots += slots ? 12 : 4) {
+			struct sim_config config = {.packet_size = 1024, .window_slots = slots, .baud = bauds[i], .rtt_ms = 50};
+
+			if (slots)
+				snprintf(name, sizeof(name), "%d baud, 50ms RTT, window %d", bauds[i], slots);
+			else
+				snprintf(name, sizeof(name), "%d baud, 50ms RTT, XMODEM-1K", bauds[i]);
+			report_sim(name, sim_size, bench_sim(&config, data, sim_size));
+		}
+	}
+
+	// Time taken to notice & recover from a lost byte, with a fixed or adaptive timeout
+	for (int i = 0; i < 3; i++) {
+		const int bauds[] = {9600, 115200, 1000000};
+		const size_t sim_size = 64 * 1024;
+		const uint64_t drop_interval = 16 * 1024 + 17;
+
+		for (int adaptive = 0; adaptive < 2; adaptive++) {
+			// A 1kB block takes over a second at 9600 baud, so use 128B there
+			struct sim_config config = {.packet_size = bauds[i] < 100000 ? 128 : 1024, .baud = bauds[i],
+				.rtt_ms = 10, .flags = adaptive ? XMODEM_FLAG_ADAPTIVE : 0};
+			char name[60];
+			double clean, lossy;
+
+			snprintf(name, sizeof(name), "%d baud, 1 loss/16kB, %s timeout", bauds[i], adaptive ? "adaptive" : "fixed");
+			if (data_size < sim_size) {
+				report_recovery(name, -1, 0);
+				continue;
+			}
+			clean = bench_sim(&config, data, sim_size);
+			config.drop_interval = drop_interval;
+			lossy = bench_sim(&config, data, sim_size);
+			report_recovery(name, clean < 0 ? clean : lossy - clean, sim_size / drop_interval);
+		}
+	}
+
+	if (have_program("rz") && have_program("sz")) {
+		report("sz->rz (128B)", data_size, bench_to_rz(false, 128, data, data_size));
+		report("xmodem_client->rz (128B)", data_size, bench_to_rz(true, 128, data, data_size));
+		report("sz->rz (1kB)", data_size, bench_to_rz(false, 1024, data, data_size));
+		report("xmodem_client->rz (1kB)", data_size, bench_to_rz(true, 1024, data, data_size));
+		report("sz->xmodem_server (1kB)", data_size, bench_from_sz(false, data, data_size));
+		report("sz->zmodem_server", data_size, bench_from_sz(true, data, data_size));
+	} else {
+		printf("lrzsz not found, skipping rz benchmarks\n");
+	}
+	bench_sinks(dirs, dir_count, data, data_size);
+	bench_tty(data, data_size);
+	bench_pool(data, data_size);
+
+	free(data);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,405 @@
+#include <string.h>
+
+#include "xmodem_client.h"
+
+/* XMODEM protocol constants */
+#define XMODEM_SOH 0x01
+#define XMODEM_STX 0x02
+#define XMODEM_EOT 0x04
+#define XMODEM_ACK 0x06
+#define XMODEM_NACK 0x15
+#define XMODEM_CAN 0x18
+#define XMODEM_CPMEOF 0x1a
+
+// How long do we wait for the receiver to start the transfer
+#define XMODEM_CLIENT_START_TIMEOUT 60000
+
+// How many milliseconds do we wait for a packet to be acknowledged before
+// sending it again
+#define XMODEM_CLIENT_ACK_TIMEOUT 10000
+
+// How many times in a row can a packet fail before we give up
+#define XMODEM_CLIENT_MAX_ERRORS 10
+
+static const char *state_name(xmodem_client_state state) {
+	#define XDMSTAT(a) case XMODEM_CLIENT_STATE_ ##a: return #a
+	switch(state) {
+		XDMSTAT(START);
+		XDMSTAT(SEND);
+		XDMSTAT(WAIT_ACK);
+		XDMSTAT(EOT);
+		XDMSTAT(SUCCESSFUL);
+		XDMSTAT(FAILURE);
+		default: return "UNKNOWN";
+	}
+	#undef XDMSTAT
+}
+
+static int client_read(struct xmodem_client *xdm, uint64_t offset, uint8_t *data, int len)
+{
+	if (xdm->read)
+		return xdm->read(xdm, offset, data, len, xdm->cb_data);
+	if (offset >= xdm->mem_len)
+		return 0;
+	if ((uint64_t)len > xdm->mem_len - offset)
+		len = xdm->mem_len - offset;
+	memcpy(data, &xdm->mem[offset], len);
+	return len;
+}
+
+static void fail(struct xmodem_client *xdm)
+{
+	xdm->state = XMODEM_CLIENT_STATE_FAILURE;
+	xdm->ctrl[0] = XMODEM_CAN;
+	xdm->ctrl[1] = XMODEM_CAN;
+	xdm->ctrl_len = 2;
+}
+
+static void send_eot(struct xmodem_client *xdm)
+{
+	xdm->state = XMODEM_CLIENT_STATE_EOT;
+	xdm->ctrl[0] = XMODEM_EOT;
+	xdm->ctrl_len = 1;
+	xdm->last_event_time = 0;
+}
+
+/**
+ * Read the data for a block, and build the complete frame for it
+ * @return Number of bytes of source data in the frame, 0 at the end of the data, < 0 on error
+ */
+static int build_frame(struct xmodem_client *xdm, int idx, uint32_t block, uint64_t offset)
+{
+	uint8_t *frame = xdm->frame[idx];
+	int len = client_read(xdm, offset, &frame[3], xdm->packet_size);
+
+	xdm->frame_len[idx] = 0;
+	if (len <= 0) {
+		xdm->eof = true;
+		return len;
+	}
+	if (len < xdm->packet_size) {
+		memset(&frame[3 + len], XMODEM_CPMEOF, xdm->packet_size - len);
+		xdm->eof = true;
+	}
+
+	frame[0] = xdm->packet_size == 1024 ? XMODEM_STX : XMODEM_SOH;
+	frame[1] = (block + 1) & 0xff;
+	frame[2] = ~frame[1];
+	if (xdm->use_crc) {
+		uint16_t crc = xmodem_server_crc_buf(0, &frame[3], xdm->packet_size);
+		frame[3 + xdm->packet_size] = crc >> 8;
+		frame[4 + xdm->packet_size] = crc & 0xff;
+		xdm->frame_len[idx] = xdm->packet_size + 5;
+	} else {
+		uint8_t sum = 0;
+		for (int i = 0; i < xdm->packet_size; i++)
+			sum += frame[3 + i];
+		frame[3 + xdm->packet_size] = sum;
+		xdm->frame_len[idx] = xdm->packet_size + 4;
+	}
+	xdm->frame_data_len[idx] = len;
+	return len;
+}
+
+/**
+ * Window mode: Send whichever block is needed next, or wait for the
+ * receiver if the window is full
+ */
+static void window_next(struct xmodem_client *xdm)
+{
+	uint32_t block;
+	int len;
+
+	if (xdm->resend_pending && xdm->resend_block < xdm->base)
+		xdm->resend_pending = false;
+	if (xdm->base >= xdm->end_block) {
+		send_eot(xdm);
+		return;
+	}
+	if (xdm->resend_pending) {
+		block = xdm->resend_block;
+		xdm->resend_pending = false;
+	} else if (xdm->send_block < xdm->end_block && xdm->send_block < xdm->base + xdm->window) {
+		block = xdm->send_block++;
+	} else {
+		xdm->state = XMODEM_CLIENT_STATE_WAIT_ACK;
+		xdm->last_event_time = 0;
+		return;
+	}
+
+	len = build_frame(xdm, xdm->cur, block, (uint64_t)block * xdm->packet_size);
+	if (len < 0) {
+		fail(xdm);
+		return;
+	}
+	if (len < xdm->packet_size)
+		xdm->end_block = len == 0 ? block : block + 1;
+	if (len == 0) {
+		xdm->send_block = block;
+		window_next(xdm);
+		return;
+	}
+	xdm->block_num = block;
+	xdm->tx_pos = 0;
+	xdm->state = XMODEM_CLIENT_STATE_SEND;
+}
+
+/**
+ * Window mode: Handle ACK/NAK and the block number that follows it
+ */
+static void window_response(struct xmodem_client *xdm, uint8_t ctrl, uint8_t block_byte)
+{
+	uint32_t block = xdm->base + ((block_byte - (xdm->base + 1)) & 0xff);
+
+	if (xdm->state == XMODEM_CLIENT_STATE_EOT) {
+		// The EOT takes the block number after the last block
+		if (ctrl == XMODEM_ACK && block_byte == ((xdm->end_block + 1) & 0xff))
+			xdm->state = XMODEM_CLIENT_STATE_SUCCESSFUL;
+		return;
+	}
+	if (block >= xdm->send_block)
+		return;
+	if (ctrl == XMODEM_ACK) {
+		xdm->base = block + 1;
+		xdm->error_count = 0;
+	} else if (++xdm->error_count >= XMODEM_CLIENT_MAX_ERRORS) {
+		fail(xdm);
+		return;
+	} else {
+		xdm->resend_block = block;
+		xdm->resend_pending = true;
+	}
+	if (xdm->state == XMODEM_CLIENT_STATE_WAIT_ACK)
+		window_next(xdm);
+}
+
+static void start_transfer(struct xmodem_client *xdm, bool use_crc, bool streaming)
+{
+	int len;
+
+	xdm->use_crc = use_crc;
+	xdm->streaming = streaming;
+	len = build_frame(xdm, xdm->cur, 0, 0);
+	if (len < 0) {
+		fail(xdm);
+	} else if (len == 0) {
+		send_eot(xdm);
+	} else {
+		xdm->tx_pos = 0;
+		xdm->state = XMODEM_CLIENT_STATE_SEND;
+	}
+}
+
+static void next_packet(struct xmodem_client *xdm)
+{
+	int next = !xdm->cur;
+
+	xdm->error_count = 0;
+	if (xdm->frame_len[next] == 0 && !xdm->eof &&
+		build_frame(xdm, next, xdm->block_num + 1, xdm->offset + xdm->packet_size) < 0) {
+		fail(xdm);
+		return;
+	}
+	xdm->frame_len[xdm->cur] = 0;
+	if (xdm->frame_len[next] == 0) {
+		send_eot(xdm);
+		return;
+	}
+	xdm->cur = next;
+	xdm->block_num++;
+	xdm->offset += xdm->packet_size;
+	xdm->tx_pos = 0;
+	xdm->state = XMODEM_CLIENT_STATE_SEND;
+}
+
+static void resend(struct xmodem_client *xdm)
+{
+	xdm->error_count++;
+	if (xdm->error_count >= XMODEM_CLIENT_MAX_ERRORS) {
+		fail(xdm);
+	} else if (xdm->state == XMODEM_CLIENT_STATE_EOT) {
+		send_eot(xdm);
+	} else if (xdm->window) {
+		// Start again from the oldest block which hasn't been acknowledged
+		xdm->resend_block = xdm->base;
+		xdm->resend_pending = true;
+		window_next(xdm);
+	} else {
+		xdm->tx_pos = 0;
+		xdm->state = XMODEM_CLIENT_STATE_SEND;
+		xdm->last_event_time = 0;
+	}
+}
+
+void xmodem_client_rx_byte(struct xmodem_client *xdm, uint8_t byte)
+{
+	bool cancelled = byte == XMODEM_CAN && xdm->last_rx == XMODEM_CAN;
+	uint8_t ctrl = xdm->rx_ctrl;
+
+	xdm->last_rx = byte;
+	if (xmodem_client_is_done(xdm))
+		return;
+	if (ctrl) {
+		// This is the argument to the previous control byte
+		xdm->rx_ctrl = 0;
+		xdm->last_rx = 0;
+		if (ctrl == 'W' && byte > '0') {
+			xdm->window = byte - '0';
+			xdm->use_crc = true;
+			xdm->end_block = UINT32_MAX;
+			window_next(xdm);
+		} else if (ctrl != 'W' && xdm->window) {
+			window_response(xdm, ctrl, byte);
+		}
+		return;
+	}
+	if (cancelled) {
+		xdm->state = XMODEM_CLIENT_STATE_FAILURE;
+		return;
+	}
+	if ((xdm->window && (byte == XMODEM_ACK || byte == XMODEM_NACK)) ||
+		(xdm->state == XMODEM_CLIENT_STATE_START && byte == 'W')) {
+		xdm->rx_ctrl = byte;
+		return;
+	}
+
+	switch (xdm->state) {
+	case XMODEM_CLIENT_STATE_START:
+		if (byte == 'C')
+			start_transfer(xdm, true, false);
+		else if (byte == 'G')
+			start_transfer(xdm, true, true);
+		else if (byte == XMODEM_NACK)
+			start_transfer(xdm, false, false);
+		break;
+
+	case XMODEM_CLIENT_STATE_WAIT_ACK:
+		if (byte == XMODEM_ACK)
+			next_packet(xdm);
+		else if (byte == XMODEM_NACK)
+			resend(xdm);
+		break;
+
+	case XMODEM_CLIENT_STATE_EOT:
+		if (byte == XMODEM_ACK)
+			xdm->state = XMODEM_CLIENT_STATE_SUCCESSFUL;
+		else if (byte == XMODEM_NACK)
+			resend(xdm);
+		break;
+
+	default:
+		break;
+	}
+}
+
+const uint8_t *xmodem_client_pending_tx(const struct xmodem_client *xdm, size_t *len)
+{
+	if (xdm->ctrl_len > 0) {
+		*len = xdm->ctrl_len;
+		return xdm->ctrl;
+	}
+	if (xdm->state == XMODEM_CLIENT_STATE_SEND) {
+		*len = xdm->frame_len[xdm->cur] - xdm->tx_pos;
+		return &xdm->frame[xdm->cur][xdm->tx_pos];
+	}
+	*len = 0;
+	return xdm->ctrl;
+}
+
+void xmodem_client_tx_done(struct xmodem_client *xdm, size_t len)
+{
+	if (xdm->ctrl_len > 0) {
+		if (len >= (size_t)xdm->ctrl_len) {
+			xdm->ctrl_len = 0;
+		} else {
+			memmove(xdm->ctrl, &xdm->ctrl[len], xdm->ctrl_len - len);
+			xdm->ctrl_len -= len;
+		}
+		return;
+	}
+	if (xdm->state != XMODEM_CLIENT_STATE_SEND)
+		return;
+	xdm->tx_pos += len;
+	if (xdm->tx_pos >= xdm->frame_len[xdm->cur] && xdm->window) {
+		window_next(xdm);
+	} else if (xdm->tx_pos >= xdm->frame_len[xdm->cur] && xdm->streaming) {
+		// The receiver doesn't acknowledge blocks, just move on
+		next_packet(xdm);
+	} else if (xdm->tx_pos >= xdm->frame_len[xdm->cur]) {
+		xdm->state = XMODEM_CLIENT_STATE_WAIT_ACK;
+		xdm->last_event_time = 0;
+	}
+}
+
+void xmodem_client_process(struct xmodem_client *xdm, int64_t ms_time)
+{
+	if (xmodem_client_is_done(xdm))
+		return;
+	// Avoid confusion with 0 default value
+	if (ms_time == 0)
+		ms_time = 1;
+	// Initialise our timer
+	if (xdm->last_event_time == 0)
+		xdm->last_event_time = ms_time;
+
+	// Get the next packet (& its CRC) ready while this one is in flight
+	if (!xdm->window && (xdm->state == XMODEM_CLIENT_STATE_SEND || xdm->state == XMODEM_CLIENT_STATE_WAIT_ACK) &&
+		xdm->frame_len[!xdm->cur] == 0 && !xdm->eof &&
+		build_frame(xdm, !xdm->cur, xdm->block_num + 1, xdm->offset + xdm->packet_size) < 0) {
+		fail(xdm);
+		return;
+	}
+
+	switch (xdm->state) {
+	case XMODEM_CLIENT_STATE_START:
+		if (ms_time - xdm->last_event_time > XMODEM_CLIENT_START_TIMEOUT)
+			fail(xdm);
+		break;
+
+	case XMODEM_CLIENT_STATE_WAIT_ACK:
+	case XMODEM_CLIENT_STATE_EOT:
+		if (ms_time - xdm->last_event_time > XMODEM_CLIENT_ACK_TIMEOUT) {
+			resend(xdm);
+			xdm->last_event_time = ms_time;
+		}
+		break;
+
+	default:
+		break;
+	}
+}
+
+int xmodem_client_init(struct xmodem_client *xdm, int packet_size, xmodem_client_read read, void *cb_data)
+{
+	if (packet_size != 128 && (packet_size != 1024 || XMODEM_MAX_PACKET_SIZE < 1024))
+		return -1;
+	memset(xdm, 0, sizeof(*xdm));
+	xdm->packet_size = packet_size;
+	xdm->read = read;
+	xdm->cb_data = cb_data;
+	return 0;
+}
+
+int xmodem_client_init_mem(struct xmodem_client *xdm, int packet_size, const uint8_t *data, uint64_t len)
+{
+	if (xmodem_client_init(xdm, packet_size, NULL, NULL) < 0)
+		return -1;
+	xdm->mem = data;
+	xdm->mem_len = len;
+	return 0;
+}
+
+xmodem_client_state xmodem_client_get_state(const struct xmodem_client *xdm)
+{
+	return xdm->state;
+}
+
+const char *xmodem_client_state_name(const struct xmodem_client *xdm)
+{
+	return state_name(xdm->state);
+}
+
+bool xmodem_client_is_done(const struct xmodem_client *xdm)
+{
+	return xdm->state == XMODEM_CLIENT_STATE_SUCCESSFUL || xdm->state == XMODEM_CLIENT_STATE_FAILURE;
+}
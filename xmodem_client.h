@@ -0,0 +1,162 @@
+/**
+ * Implementation of the transmitter side of the XModem data transfer protocol
+ * This mirrors xmodem_server - it is asynchronous, so there are no blocking
+ * calls, and it does not allocate any dynamic memory.
+ * Packet data is pulled from a read callback or a memory area, and the
+ * resulting frames are collected with xmodem_client_pending_tx so they can
+ * be written out in whole.
+ * If the receiver starts the transfer with 'G' the blocks are streamed back
+ * to back without waiting for each one to be acknowledged. If it starts with
+ * 'W' (see xmodem_server_init_window), several blocks are kept in flight,
+ * and any the receiver reports missing are rebuilt & resent
+ */
+#ifndef XMODEM_CLIENT_H
+#define XMODEM_CLIENT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "xmodem_server.h"
+
+/**
+ * The different states that the xmodem client state machine may be in
+ */
+typedef enum {
+	XMODEM_CLIENT_STATE_START, // Waiting for the receiver to ask for the transfer
+	XMODEM_CLIENT_STATE_SEND, // Sending a packet
+	XMODEM_CLIENT_STATE_WAIT_ACK, // Waiting for the receiver to acknowledge the packet
+	XMODEM_CLIENT_STATE_EOT, // Sending EOT & waiting for it to be acknowledged
+	XMODEM_CLIENT_STATE_SUCCESSFUL,
+	XMODEM_CLIENT_STATE_FAILURE,
+
+	XMODEM_CLIENT_STATE_COUNT,
+} xmodem_client_state;
+
+struct xmodem_client;
+
+/**
+ * Callback function to read data to be transmitted
+ * @param xdm xmodem client state
+ * @param offset Byte offset within the data to read from
+ * @param data Area to store the data
+ * @param len Number of bytes to read
+ * @param cb_data user-supplied pointer given to xmodem_client_init
+ * @return Number of bytes read. Less than len only at the end of the data, < 0 on error
+ */
+typedef int (*xmodem_client_read)(struct xmodem_client *xdm, uint64_t offset, uint8_t *data, int len, void *cb_data);
+
+/**
+ * This contains the state for the xmodem client.
+ * None of its contents should be accessed directly, this structure
+ * should be considered opaque
+ */
+struct xmodem_client {
+	xmodem_client_state state; // What state are we in?
+	uint8_t frame[2][3 + XMODEM_MAX_PACKET_SIZE + 2]; // Frame being sent, and the next one
+	int frame_len[2]; // Length of each frame (0 if not built)
+	int frame_data_len[2]; // How much source data is in each frame
+	int cur; // Which frame is being sent
+	int tx_pos; // How much of the current frame/control bytes have been sent
+	uint8_t ctrl[2]; // Control bytes (EOT/CAN) waiting to be sent
+	int ctrl_len;
+	uint16_t packet_size; // Are we sending 128B or 1K packets?
+	bool use_crc; // Did the receiver ask for CRC (rather than checksum) mode?
+	bool streaming; // Did the receiver ask for 'G' mode (no per-block ACKs)?
+	bool eof; // Has the source run out of data?
+	uint32_t block_num; // 0-based index of the block being sent
+	uint64_t offset; // Source offset of the block being sent
+	int64_t last_event_time; // When did we last do something interesting?
+	uint32_t error_count; // How many errors have we seen?
+	uint8_t last_rx; // Previously received byte, for spotting CAN CAN
+	uint8_t rx_ctrl; // Window mode: control byte waiting for its block number
+	uint8_t window; // Window mode: how many blocks may be outstanding (0 if not in window mode)
+	uint32_t base; // Window mode: oldest block not yet acknowledged
+	uint32_t send_block; // Window mode: next block not yet sent
+	uint32_t end_block; // Window mode: first block past the end of the data
+	uint32_t resend_block; // Window mode: block the receiver asked to be resent
+	bool resend_pending;
+	xmodem_client_read read;
+	const uint8_t *mem; // Source data when using xmodem_client_init_mem
+	uint64_t mem_len;
+	void *cb_data;
+};
+
+/**
+ * Initialise the xmodem client state
+ * @param xdm Xmodem client state area to initialise
+ * @param packet_size Size of packets to send, either 128 or 1024
+ * @param read callback to be called to get the data to send. In window mode
+ *   the same offset may be read more than once, to resend lost blocks
+ * @param cb_data user-supplied pointer to be supplied to the read function
+ * @return < 0 on failure, >= 0 on success
+ */
+int xmodem_client_init(struct xmodem_client *xdm, int packet_size, xmodem_client_read read, void *cb_data);
+
+/**
+ * Initialise the xmodem client state, sending data from memory
+ * @param xdm Xmodem client state area to initialise
+ * @param packet_size Size of packets to send, either 128 or 1024
+ * @param data Data to send. This must remain valid until the transfer is done
+ * @param len Number of bytes in data
+ * @return < 0 on failure, >= 0 on success
+ */
+int xmodem_client_init_mem(struct xmodem_client *xdm, int packet_size, const uint8_t *data, uint64_t len);
+
+/**
+ * Send a single byte received from the xmodem server to the state machine
+ */
+void xmodem_client_rx_byte(struct xmodem_client *xdm, uint8_t byte);
+
+/**
+ * Get the bytes waiting to be sent to the xmodem server. These should be
+ * checked after each call to xmodem_client_rx_byte/xmodem_client_process.
+ * A failed transfer leaves a CAN sequence here to be sent, so this should
+ * still be checked once xmodem_client_is_done returns true
+ * @param xdm xmodem client state
+ * @param len Area to store the number of bytes waiting
+ * @return Pointer to the waiting bytes. Valid until the next call to any other xmodem_client function
+ */
+const uint8_t *xmodem_client_pending_tx(const struct xmodem_client *xdm, size_t *len);
+
+/**
+ * Mark bytes from xmodem_client_pending_tx as sent
+ * @param xdm xmodem client state
+ * @param len Number of bytes that were sent
+ */
+void xmodem_client_tx_done(struct xmodem_client *xdm, size_t len);
+
+/**
+ * Process the internal state. This handles timeouts, and builds the next
+ * packet while waiting for the current one to be acknowledged.
+ * This function should be called periodically
+ * @param xdm xmodem client state
+ * @param ms_time Current time in milliseconds (used to determine timeouts)
+ */
+void xmodem_client_process(struct xmodem_client *xdm, int64_t ms_time);
+
+/**
+ * Determine the current state of the xmodem transfer
+ */
+xmodem_client_state xmodem_client_get_state(const struct xmodem_client *xdm);
+
+/**
+ * Returns a human readable version of the current state
+ */
+const char *xmodem_client_state_name(const struct xmodem_client *xdm);
+
+/**
+ * Determine if the transfer is complete (success or failure)
+ * @return true if the transfer has been finished, false otherwise
+ */
+bool xmodem_client_is_done(const struct xmodem_client *xdm);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
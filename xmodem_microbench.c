@@ -0,0 +1,417 @@
+/**
+ * Microbenchmarks for the receive hot path of xmodem_server. Each binary
+ * covers the CRC implementation it was built with (see XMODEM_CRC), so
+ * `make bench` builds & runs one per implementation.
+ * Results are printed as a single JSON object, so they can be kept and
+ * compared between releases
+ */
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+#include "xmodem_server.h"
+
+#define XMODEM_SOH 0x01
+#define XMODEM_STX 0x02
+
+// How much data each measurement pushes through
+#ifndef BENCH_BYTES
+#define BENCH_BYTES (64 * 1024 * 1024)
+#endif
+// How many frames in each pre-built stream. Block numbers wrap at 256, so
+// this lets the stream be replayed back to back
+#define STREAM_FRAMES 256
+// Error-heavy streams are cut short, so that a fresh server can take each
+// one without reaching XMODEM_MAX_ERRORS
+#define ERROR_STREAM_FRAMES 32
+
+static bool first_result = true;
+// Cost of a single timing measurement
+static uint64_t overhead_ns;
+static uint64_t overhead_ticks;
+static double ticks_per_ns;
+
+static uint64_t ns_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t tsc(void)
+{
+#ifdef HAVE_TSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+/**
+ * Work out the cost of reading both clocks, for measurements which are made
+ * in many small pieces, and how fast the TSC runs
+ */
+static void measure_overhead(void)
+{
+	const int reps = 100000;
+	uint64_t ns = 0, ticks = 0;
+	uint64_t start = ns_time(), t = tsc();
+
+	for (int i = 0; i < reps; i++) {
+		uint64_t s = ns_time(), tt = tsc();
+		ticks += tsc() - tt;
+		ns += ns_time() - s;
+	}
+	overhead_ns = ns / reps;
+	overhead_ticks = ticks / reps;
+	ticks_per_ns = (double)(tsc() - t) / (ns_time() - start);
+}
+
+/**
+ * Take the clock overhead off a measurement made in 'pieces' parts. Small
+ * pieces are close to the resolution of the monotonic clock, so the TSC is
+ * used instead where it is available
+ */
+static void remove_overhead(uint64_t *ns, uint64_t *ticks, uint64_t pieces)
+{
+	if (ticks_per_ns > 0) {
+		*ticks = *ticks > overhead_ticks * pieces ? *ticks - overhead_ticks * pieces : 0;
+		*ns = *ticks / ticks_per_ns;
+	} else {
+		*ns = *ns > overhead_ns * pieces ? *ns - overhead_ns * pieces : 0;
+	}
+}
+
+static const char *crc_name(void)
+{
+	switch (XMODEM_CRC) {
+	case XMODEM_CRC_BITWISE: return "BITWISE";
+	case XMODEM_CRC_TABLE: return "TABLE";
+	case XMODEM_CRC_SLICE4: return "SLICE4";
+	case XMODEM_CRC_SLICE8: return "SLICE8";
+	case XMODEM_CRC_CLMUL: return "CLMUL";
+	default: return "unknown";
+	}
+}
+
+/**
+ * Output one result. Everything is normalised per byte (or per frame), so
+ * results are comparable whatever BENCH_BYTES is
+ * @param name What was measured
+ * @param bytes How many bytes were processed
+ * @param units How many units (bytes/frames) the per-unit figures are for
+ * @param unit Name of the unit
+ * @param ns Elapsed time in nanoseconds
+ * @param ticks Elapsed TSC ticks (0 if unavailable)
+ */
+static void result(const char *name, uint64_t bytes, uint64_t units, const char *unit, uint64_t ns, uint64_t ticks)
+{
+	printf("%s\n    {\"name\": \"%s\", \"mb_per_s\": %.2f, \"ns_per_%s\": %.3f",
+		first_result ? "" : ",", name, ns ? bytes * 1e3 / ns : 0, unit, (double)ns / units);
+	if (ticks)
+		printf(", \"tsc_per_%s\": %.3f", unit, (double)ticks / units);
+	printf("}");
+	first_result = false;
+}
+
+static void fill_random(uint8_t *data, size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+		data[i] = rand();
+}
+
+static size_t build_frame(uint8_t *frame, const uint8_t *data, int data_len, uint8_t block)
+{
+	uint16_t crc = xmodem_server_crc_buf(0, data, data_len);
+	frame[0] = data_len == 1024 ? XMODEM_STX : XMODEM_SOH;
+	frame[1] = block;
+	frame[2] = block ^ 0xff;
+	memcpy(&frame[3], data, data_len);
+	frame[3 + data_len] = crc >> 8;
+	frame[4 + data_len] = crc & 0xff;
+	return data_len + 5;
+}
+
+/**
+ * Build consecutive frames, starting at block 1
+ * @param frames How many frames to build
+ * @param bad_every Corrupt every Nth frame & follow it with its resend (0 for none)
+ * @param noise Bytes of line noise to put in front of each corrupt frame
+ * @return Length of the stream
+ */
+static size_t build_stream(uint8_t *stream, int frames, int packet_size, int bad_every, int noise)
+{
+	uint8_t data[XMODEM_MAX_PACKET_SIZE];
+	size_t len = 0;
+
+	for (int i = 0; i < frames; i++) {
+		fill_random(data, packet_size);
+		if (bad_every && i % bad_every == 0) {
+			size_t start;
+			// Noise which can't be mistaken for a frame start or EOT
+			for (int j = 0; j < noise; j++)
+				stream[len++] = 0x20 + rand() % 0x60;
+			start = len;
+			len += build_frame(&stream[len], data, packet_size, i + 1);
+			stream[start + 3 + rand() % packet_size] ^= 0x55;
+		}
+		len += build_frame(&stream[len], data, packet_size, i + 1);
+	}
+	return len;
+}
+
+static void drain(struct xmodem_server *xdm)
+{
+	size_t len;
+	xmodem_server_pending_tx(xdm, &len);
+	xmodem_server_tx_done(xdm, len);
+}
+
+/**
+ * Get a server past its start phase, ready for block 1
+ */
+static void start_server(struct xmodem_server *xdm)
+{
+	xmodem_server_init(xdm, NULL, NULL);
+	xmodem_server_process(xdm, NULL, NULL, 1);
+	drain(xdm);
+}
+
+static void bench_crc(void)
+{
+	static uint8_t data[64 * 1024];
+	const size_t sizes[] = {128, 1024, sizeof(data)};
+	char name[60];
+	volatile uint16_t sink;
+
+	fill_random(data, sizeof(data));
+	for (int i = 0; i < 3; i++) {
+		uint64_t reps = BENCH_BYTES / sizes[i];
+		uint16_t crc = 0;
+		uint64_t start = ns_time(), ticks = tsc();
+
+		for (uint64_t r = 0; r < reps; r++)
+			crc = xmodem_server_crc_buf(crc, data, sizes[i]);
+		ticks = tsc() - ticks;
+		sink = crc;
+		snprintf(name, sizeof(name), "crc_buf/%zu", sizes[i]);
+		result(name, reps * sizes[i], reps * sizes[i], "byte", ns_time() - start, ticks);
+	}
+
+	// The per byte version, as used by xmodem_server_rx_byte
+	{
+		uint64_t reps = (BENCH_BYTES / 16 + sizeof(data) - 1) / sizeof(data);
+		uint16_t crc = 0;
+		uint64_t start = ns_time(), ticks = tsc();
+
+		for (uint64_t r = 0; r < reps; r++)
+			for (size_t i = 0; i < sizeof(data); i++)
+				crc = xmodem_server_crc(crc, data[i]);
+		ticks = tsc() - ticks;
+		sink = crc;
+		result("crc/byte", reps * sizeof(data), reps * sizeof(data), "byte", ns_time() - start, ticks);
+	}
+	(void)sink;
+}
+
+/**
+ * Cost of xmodem_server_rx_byte in each receive state. Every call is timed
+ * & charged to the state the server was in beforehand, so the per-frame
+ * states (block numbers & CRC bytes, where the packet is checked) are
+ * covered as well as packet data. Hunting for a frame start through line
+ * noise is measured separately, as that is where xmodem_server_rx_bytes
+ * can skip ahead
+ */
+static void bench_rx_states(void)
+{
+	static const char *state_names[XMODEM_STATE_COUNT] = {
+		[XMODEM_STATE_SOH] = "SOH",
+		[XMODEM_STATE_BLOCK_NUM] = "BLOCK_NUM",
+		[XMODEM_STATE_BLOCK_NEG] = "BLOCK_NEG",
+		[XMODEM_STATE_DATA] = "DATA",
+		[XMODEM_STATE_CRC0] = "CRC0",
+		[XMODEM_STATE_CRC1] = "CRC1",
+	};
+	static uint8_t stream[STREAM_FRAMES * (XMODEM_MAX_PACKET_SIZE + 5)];
+	static uint8_t noise[64 * 1024];
+	uint8_t packet[XMODEM_MAX_PACKET_SIZE];
+	uint32_t block_nr;
+	struct xmodem_server xdm;
+	uint64_t state_ns[XMODEM_STATE_COUNT] = {0};
+	uint64_t state_ticks[XMODEM_STATE_COUNT] = {0};
+	uint64_t state_bytes[XMODEM_STATE_COUNT] = {0};
+	uint64_t ns = 0, ticks = 0, bytes = 0;
+	size_t len = build_stream(stream, STREAM_FRAMES, 1024, 0, 0);
+	char name[60];
+
+	for (size_t i = 0; i < sizeof(noise); i++)
+		noise[i] = 0x20 + rand() % 0x60;
+	start_server(&xdm);
+	ns = ns_time();
+	ticks = tsc();
+	for (uint64_t total = 0; total < BENCH_BYTES; total += sizeof(noise))
+		for (size_t i = 0; i < sizeof(noise); i++)
+			xmodem_server_rx_byte(&xdm, noise[i]);
+	ticks = tsc() - ticks;
+	ns = ns_time() - ns;
+	result("rx_byte/noise", BENCH_BYTES, BENCH_BYTES, "byte", ns, ticks);
+
+	// The same through xmodem_server_rx_bytes, which skips noise in bulk
+	start_server(&xdm);
+	ns = ns_time();
+	ticks = tsc();
+	for (uint64_t total = 0; total < BENCH_BYTES; total += sizeof(noise))
+		xmodem_server_rx_bytes(&xdm, noise, sizeof(noise));
+	ticks = tsc() - ticks;
+	ns = ns_time() - ns;
+	result("rx_bytes/noise", BENCH_BYTES, BENCH_BYTES, "byte", ns, ticks);
+
+	// Valid frames, with each byte charged to the state it arrived in
+	start_server(&xdm);
+	while (bytes < BENCH_BYTES) {
+		for (size_t pos = 0; pos < len; pos++) {
+			xmodem_server_state state = xmodem_server_get_state(&xdm);
+			uint64_t start = ns_time(), t = tsc();
+			xmodem_server_rx_byte(&xdm, stream[pos]);
+			state_ticks[state] += tsc() - t;
+			state_ns[state] += ns_time() - start;
+			state_bytes[state]++;
+			if (xmodem_server_get_state(&xdm) == XMODEM_STATE_PROCESS_PACKET) {
+				xmodem_server_process(&xdm, packet, &block_nr, 1);
+				drain(&xdm);
+			}
+		}
+		bytes += len;
+	}
+	// The first byte is taken in XMODEM_STATE_START, which is a one-off
+	for (int s = 0; s < XMODEM_STATE_COUNT; s++) {
+		if (!state_names[s])
+			continue;
+		remove_overhead(&state_ns[s], &state_ticks[s], state_bytes[s]);
+		snprintf(name, sizeof(name), "rx_byte/%s", state_names[s]);
+		result(name, state_bytes[s], state_bytes[s], "byte", state_ns[s], state_ticks[s]);
+	}
+}
+
+/**
+ * Cost of xmodem_server_process_borrow/release for a waiting packet. This
+ * covers the YMODEM/windowing checks & sending the ACK, but not copying
+ */
+static void bench_process(void)
+{
+	static uint8_t stream[STREAM_FRAMES * (XMODEM_MAX_PACKET_SIZE + 5)];
+	struct xmodem_server xdm;
+	uint64_t ns = 0, ticks = 0, frames = 0;
+	size_t len = build_stream(stream, STREAM_FRAMES, 1024, 0, 0);
+
+	start_server(&xdm);
+	while (frames * 1024 < BENCH_BYTES) {
+		for (size_t pos = 0; pos < len; pos += 1029) {
+			const uint8_t *packet;
+			uint32_t block_nr;
+			uint64_t start, t;
+
+			xmodem_server_rx_bytes(&xdm, &stream[pos], 1029);
+			start = ns_time();
+			t = tsc();
+			if (xmodem_server_process_borrow(&xdm, &packet, &block_nr, 1) > 0)
+				xmodem_server_release_packet(&xdm);
+			ticks += tsc() - t;
+			ns += ns_time() - start;
+			drain(&xdm);
+			frames++;
+		}
+	}
+	remove_overhead(&ns, &ticks, frames);
+	result("process/1024", frames * 1024, frames, "frame", ns, ticks);
+}
+
+/**
+ * Push a whole stream through a server, a byte at a time or in bulk
+ * @return Number of packets received
+ */
+static uint64_t ingest(struct xmodem_server *xdm, const uint8_t *stream, size_t len, bool bulk)
+{
+	uint64_t packets = 0;
+	size_t pos = 0;
+
+	while (pos < len && !xmodem_server_is_done(xdm)) {
+		const uint8_t *packet;
+		uint32_t block_nr;
+
+		if (bulk) {
+			pos += xmodem_server_rx_bytes(xdm, &stream[pos], len - pos);
+		} else {
+			while (pos < len && !xmodem_server_rx_byte(xdm, stream[pos]))
+				pos++;
+			pos++;
+		}
+		if (xmodem_server_process_borrow(xdm, &packet, &block_nr, 1) > 0) {
+			xmodem_server_release_packet(xdm);
+			packets++;
+		}
+		drain(xdm);
+	}
+	return packets;
+}
+
+/**
+ * Full frame ingest, from raw bytes to released packets
+ * @param bad_every Corrupt every Nth frame (0 for none)
+ */
+static void bench_ingest(int packet_size, bool bulk, int bad_every, int noise)
+{
+	static uint8_t stream[STREAM_FRAMES * (2 * (XMODEM_MAX_PACKET_SIZE + 5) + 256) + ERROR_STREAM_FRAMES * 16384];
+	int frames = bad_every ? ERROR_STREAM_FRAMES : STREAM_FRAMES;
+	size_t len = build_stream(stream, frames, packet_size, bad_every, noise);
+	struct xmodem_server xdm;
+	uint64_t bytes = 0, packets = 0;
+	uint64_t start, ticks;
+	char name[60];
+
+	start = ns_time();
+	ticks = tsc();
+	while (bytes < BENCH_BYTES) {
+		// Error-heavy streams get a fresh server each time round, as
+		// every error counts towards XMODEM_MAX_ERRORS
+		if (bad_every || bytes == 0)
+			start_server(&xdm);
+		packets += ingest(&xdm, stream, len, bulk);
+		bytes += len;
+	}
+	ticks = tsc() - ticks;
+	if (packets != bytes / len * frames)
+		fprintf(stderr, "%d byte ingest lost packets: %llu\n", packet_size, (unsigned long long)packets);
+	if (bad_every)
+		snprintf(name, sizeof(name), "ingest/%s/%d/errors_1_in_%d/noise_%d", bulk ? "rx_bytes" : "rx_byte",
+			packet_size, bad_every, noise);
+	else
+		snprintf(name, sizeof(name), "ingest/%s/%d", bulk ? "rx_bytes" : "rx_byte", packet_size);
+	result(name, bytes, bytes, "byte", ns_time() - start, ticks);
+}
+
+int main(void)
+{
+	srand(1);
+	measure_overhead();
+	printf("{\n  \"crc\": \"%s\",\n  \"max_packet_size\": %d,\n  \"results\": [", crc_name(), XMODEM_MAX_PACKET_SIZE);
+	bench_crc();
+	bench_rx_states();
+	bench_process();
+	for (int bulk = 0; bulk < 2; bulk++) {
+		bench_ingest(128, bulk, 0, 0);
+		bench_ingest(1024, bulk, 0, 0);
+		bench_ingest(1024, bulk, 4, 200);
+		// Garbage-heavy: long bursts of line noise to resynchronise through
+		bench_ingest(1024, bulk, 4, 16384);
+	}
+	printf("\n  ]\n}\n");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,337 @@
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "xmodem_mux.h"
+
+#define XMODEM_CAN 0x18
+
+// How many events to collect from each epoll_wait
+#define MAX_EVENTS 64
+
+static int64_t mux_time(const struct xmodem_mux *mux)
+{
+	struct timespec ts;
+	clock_gettime(mux->clock_id, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int set_nonblock(int fd)
+{
+	int flags = fcntl(fd, F_GETFL);
+	if (flags < 0)
+		return -1;
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/**
+ * Change which events we are waiting for. EPOLLIN is waited for on rd_fd,
+ * and EPOLLOUT on wr_fd
+ */
+static int update_events(struct xmodem_mux_session *session, uint32_t events)
+{
+	struct epoll_event ev = {.data.ptr = session};
+	int epoll_fd = session->mux->epoll_fd;
+
+	if (events == session->events)
+		return 0;
+	if (session->rd_fd == session->wr_fd) {
+		int op = !session->events ? EPOLL_CTL_ADD : !events ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+
+		ev.events = events;
+		if (epoll_ctl(epoll_fd, op, session->rd_fd, &ev) < 0)
+			return -1;
+	} else {
+		if ((events ^ session->events) & EPOLLIN) {
+			ev.events = EPOLLIN;
+			if (epoll_ctl(epoll_fd, (events & EPOLLIN) ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, session->rd_fd, &ev) < 0)
+				return -1;
+		}
+		if ((events ^ session->events) & EPOLLOUT) {
+			ev.events = EPOLLOUT;
+			if (epoll_ctl(epoll_fd, (events & EPOLLOUT) ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, session->wr_fd, &ev) < 0)
+				return -1;
+		}
+	}
+	session->events = events;
+	return 0;
+}
+
+/**
+ * Remove a session from the mux. The owner isn't told until report_done, as
+ * there may still be events for it in the batch being handled
+ */
+static void finish(struct xmodem_mux_session *session, xmodem_server_state state)
+{
+	struct xmodem_mux *mux = session->mux;
+
+	update_events(session, 0);
+	xmodem_timer_del(&mux->timers, &session->timer);
+	if (session->prev)
+		session->prev->next = session->next;
+	else
+		mux->sessions = session->next;
+	if (session->next)
+		session->next->prev = session->prev;
+	session->mux = NULL;
+	session->result = state;
+	session->prev = NULL;
+	session->next = mux->finished;
+	mux->finished = session;
+}
+
+/**
+ * Call the done callback of each session which has finished. These may add
+ * sessions (even reusing the same storage), which may in turn finish
+ */
+static void report_done(struct xmodem_mux *mux)
+{
+	while (mux->finished) {
+		struct xmodem_mux_session *session = mux->finished;
+
+		mux->finished = session->next;
+		session->next = NULL;
+		mux->session_count--;
+		if (session->done)
+			session->done(session, session->result, session->cb_data);
+	}
+}
+
+/**
+ * Write as much of the queued response data as wr_fd will take
+ * @return true if everything has been written
+ */
+static bool flush_tx(struct xmodem_mux_session *session)
+{
+	size_t len;
+	const uint8_t *data = xmodem_server_pending_tx(&session->xdm, &len);
+
+	while (len > 0) {
+		ssize_t r = write(session->wr_fd, data, len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+			// Nobody to send to, so drop it
+			xmodem_server_tx_done(&session->xdm, len);
+			return true;
+		}
+		if (r <= 0)
+			return false;
+		xmodem_server_tx_done(&session->xdm, r);
+		data = xmodem_server_pending_tx(&session->xdm, &len);
+	}
+	return true;
+}
+
+/**
+ * Send any responses, then work out what to wait for next. Once the
+ * transfer is over, we only wait for the last response to be sent
+ */
+static void update_session(struct xmodem_mux_session *session)
+{
+	bool flushed = flush_tx(session);
+
+	if (!session->finishing && xmodem_server_is_done(&session->xdm)) {
+		session->finishing = true;
+		session->result = xmodem_server_get_state(&session->xdm);
+	}
+	if (session->finishing && flushed) {
+		finish(session, session->result);
+		return;
+	}
+	if (update_events(session, (session->finishing ? 0 : EPOLLIN) | (flushed ? 0 : EPOLLOUT)) < 0) {
+		finish(session, XMODEM_STATE_FAILURE);
+		return;
+	}
+	if (session->finishing)
+		xmodem_timer_del(&session->mux->timers, &session->timer);
+	else
+		xmodem_timer_add(&session->mux->timers, &session->timer, xmodem_server_next_deadline(&session->xdm));
+}
+
+/**
+ * Abort the transfer, as the sink has given up on it
+ */
+static void abort_session(struct xmodem_mux_session *session)
+{
+	static const uint8_t cancel[2] = {XMODEM_CAN, XMODEM_CAN};
+
+	// Best effort only, as there is no retrying once we've gone
+	if (write(session->wr_fd, cancel, sizeof(cancel)) < 0) {
+		// Nothing more we can do
+	}
+	finish(session, XMODEM_STATE_FAILURE);
+}
+
+/**
+ * Feed received data into the xmodem server, handing each packet to the
+ * sink as it completes. len may be 0 just to process timeouts
+ * @return false if the session has been aborted
+ */
+static bool session_rx(struct xmodem_mux_session *session, const uint8_t *data, size_t len, int64_t now)
+{
+	struct xmodem_server *xdm = &session->xdm;
+	size_t pos = 0;
+
+	do {
+		const uint8_t *packet;
+		uint32_t block_num;
+		int packet_len;
+
+		if (pos < len)
+			pos += xmodem_server_rx_bytes(xdm, &data[pos], len - pos);
+		packet_len = xmodem_server_process_borrow(xdm, &packet, &block_num, now);
+		if (packet_len > 0) {
+			if (session->packet(session, packet, packet_len, block_num, session->cb_data) < 0) {
+				abort_session(session);
+				return false;
+			}
+			xmodem_server_release_packet(xdm);
+		}
+		// Responses must be collected as we go, as they may not all fit in the queue
+		flush_tx(session);
+	} while ((pos < len || xmodem_server_get_state(xdm) == XMODEM_STATE_PROCESS_PACKET) &&
+			!xmodem_server_is_done(xdm));
+	return true;
+}
+
+static void session_event(struct xmodem_mux_session *session, uint32_t events, int64_t now)
+{
+	struct xmodem_mux *mux = session->mux;
+
+	if (!session->finishing && (events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+		ssize_t r = read(session->rd_fd, mux->buffer, sizeof(mux->buffer));
+
+		if (r == 0 || (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+			// The sender has gone away
+			finish(session, XMODEM_STATE_FAILURE);
+			return;
+		}
+		if (r > 0 && !session_rx(session, mux->buffer, r, now))
+			return;
+	}
+	update_session(session);
+}
+
+/**
+ * A session's timeout is due, so let the xmodem server deal with it
+ */
+static void session_timeout(struct xmodem_timer *timer, void *cb_data)
+{
+	struct xmodem_mux *mux = cb_data;
+	struct xmodem_mux_session *session = (struct xmodem_mux_session *)
+		((uint8_t *)timer - offsetof(struct xmodem_mux_session, timer));
+
+	if (session_rx(session, NULL, 0, mux->now))
+		update_session(session);
+}
+
+int xmodem_mux_init(struct xmodem_mux *mux)
+{
+	return xmodem_mux_init_clock(mux, CLOCK_MONOTONIC);
+}
+
+int xmodem_mux_init_clock(struct xmodem_mux *mux, int clock_id)
+{
+	struct timespec ts;
+
+	memset(mux, 0, sizeof(*mux));
+	if (clock_gettime(clock_id, &ts) < 0)
+		return -1;
+	mux->clock_id = clock_id;
+	xmodem_timer_wheel_init(&mux->timers, mux_time(mux));
+	mux->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (mux->epoll_fd < 0)
+		return -1;
+	return 0;
+}
+
+void xmodem_mux_close(struct xmodem_mux *mux)
+{
+	if (mux->epoll_fd >= 0)
+		close(mux->epoll_fd);
+	mux->epoll_fd = -1;
+	mux->sessions = NULL;
+	mux->finished = NULL;
+	mux->session_count = 0;
+}
+
+int xmodem_mux_add(struct xmodem_mux *mux, struct xmodem_mux_session *session, int rd_fd, int wr_fd, uint32_t flags,
+		xmodem_mux_packet packet, xmodem_mux_done done, void *cb_data)
+{
+	if (!packet || set_nonblock(rd_fd) < 0 || set_nonblock(wr_fd) < 0)
+		return -1;
+	memset(session, 0, sizeof(*session));
+	if (xmodem_server_init_flags(&session->xdm, NULL, cb_data, flags) < 0)
+		return -1;
+	session->mux = mux;
+	session->rd_fd = rd_fd;
+	session->wr_fd = wr_fd;
+	session->packet = packet;
+	session->done = done;
+	session->cb_data = cb_data;
+	xmodem_timer_init(&session->timer);
+	if (update_events(session, EPOLLIN) < 0)
+		return -1;
+
+	session->next = mux->sessions;
+	if (mux->sessions)
+		mux->sessions->prev = session;
+	mux->sessions = session;
+	mux->session_count++;
+
+	// Get the initial 'C' out straight away
+	update_session(session);
+	return 0;
+}
+
+struct xmodem_server *xmodem_mux_server(struct xmodem_mux_session *session)
+{
+	return &session->xdm;
+}
+
+int xmodem_mux_run(struct xmodem_mux *mux, int timeout_ms)
+{
+	struct epoll_event events[MAX_EVENTS];
+	int64_t next = xmodem_timer_next(&mux->timers);
+	int count;
+
+	// Anything which finished while being added
+	report_done(mux);
+	if (mux->session_count == 0)
+		return 0;
+
+	// Sleep until the next timeout, unless something happens first
+	mux->now = mux_time(mux);
+	if (next >= 0) {
+		int64_t until = next > mux->now ? next - mux->now : 0;
+		if (timeout_ms < 0 || until < timeout_ms)
+			timeout_ms = until;
+	}
+
+	count = epoll_wait(mux->epoll_fd, events, MAX_EVENTS, timeout_ms);
+	if (count < 0 && errno != EINTR)
+		return -1;
+	mux->now = mux_time(mux);
+	for (int i = 0; i < count; i++) {
+		struct xmodem_mux_session *session = events[i].data.ptr;
+		// May have finished while handling an earlier event. It stays
+		// valid until report_done, as the owner hasn't been told yet
+		if (session->mux == mux)
+			session_event(session, events[i].events, mux->now);
+	}
+	xmodem_timer_expire(&mux->timers, mux->now, session_timeout, mux);
+	report_done(mux);
+
+	return mux->session_count;
+}
+
+int xmodem_mux_active(const struct xmodem_mux *mux)
+{
+	return mux->session_count;
+}
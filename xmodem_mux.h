@@ -0,0 +1,160 @@
+/**
+ * Multi-session receive engine for Linux. A single thread & a single epoll
+ * set drive many xmodem_server instances, each talking over its own
+ * non-blocking file descriptors (ttys, ptys, pipes or sockets).
+ * Incoming data is read in bulk and fed to xmodem_server_rx_bytes, and each
+ * packet is handed to a per-session sink callback. Each session's next
+ * protocol timeout is kept in a timer wheel, so sessions are only touched
+ * when their fds are ready or a timeout is actually due.
+ * Like xmodem_server, no dynamic memory is allocated - the caller provides
+ * the storage for each session
+ */
+#ifndef XMODEM_MUX_H
+#define XMODEM_MUX_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "xmodem_server.h"
+#include "xmodem_timer.h"
+
+/**
+ * Size of the buffer used for each read. This is shared between all
+ * sessions, so can be generous
+ */
+#ifndef XMODEM_MUX_READ_SIZE
+#define XMODEM_MUX_READ_SIZE 4096
+#endif
+
+struct xmodem_mux;
+struct xmodem_mux_session;
+
+/**
+ * Callback function to deliver a received packet
+ * @param session Session the packet arrived on
+ * @param data Packet data. Only valid for the duration of the callback
+ * @param len Number of bytes in data
+ * @param block_num 0-based index of the block
+ * @param cb_data user-supplied pointer given to xmodem_mux_add
+ * @return < 0 to abort the transfer, >= 0 to accept the packet
+ */
+typedef int (*xmodem_mux_packet)(struct xmodem_mux_session *session, const uint8_t *data, int len, uint32_t block_num, void *cb_data);
+
+/**
+ * Callback function to report that a session has finished. This is called
+ * from xmodem_mux_run once every event it collected has been handled, and
+ * the session has been removed from the mux, so its fds may be closed & its
+ * storage reused (including by adding it again)
+ * @param session Session which has finished
+ * @param state XMODEM_STATE_SUCCESSFUL or XMODEM_STATE_FAILURE
+ * @param cb_data user-supplied pointer given to xmodem_mux_add
+ */
+typedef void (*xmodem_mux_done)(struct xmodem_mux_session *session, xmodem_server_state state, void *cb_data);
+
+/**
+ * State for a single transfer within the mux.
+ * None of its contents should be accessed directly, this structure
+ * should be considered opaque
+ */
+struct xmodem_mux_session {
+	struct xmodem_server xdm;
+	struct xmodem_mux *mux;
+	int rd_fd;
+	int wr_fd;
+	uint32_t events; // Which epoll events are we waiting for?
+	bool finishing; // Is the transfer over, with the final response still to be sent?
+	xmodem_server_state result; // How did the transfer end?
+	struct xmodem_timer timer; // Fires when xmodem_server_process is next due
+	xmodem_mux_packet packet;
+	xmodem_mux_done done;
+	void *cb_data;
+	struct xmodem_mux_session *prev, *next; // Active sessions, or finished ones waiting for done
+};
+
+/**
+ * This contains the state for the mux.
+ * None of its contents should be accessed directly, this structure
+ * should be considered opaque
+ */
+struct xmodem_mux {
+	int epoll_fd;
+	int clock_id; // Which clock to use for timeouts
+	struct xmodem_mux_session *sessions; // List of active sessions
+	struct xmodem_mux_session *finished; // Sessions whose done callback is still to be called
+	int session_count; // Active sessions, plus finished ones not yet reported
+	int64_t now; // Time of the current xmodem_mux_run pass
+	struct xmodem_timer_wheel timers;
+	uint8_t buffer[XMODEM_MUX_READ_SIZE]; // Shared read buffer
+};
+
+/**
+ * Initialise the mux
+ * @param mux Mux state area to initialise
+ * @return < 0 on failure, >= 0 on success
+ */
+int xmodem_mux_init(struct xmodem_mux *mux);
+
+/**
+ * Initialise the mux, using a specific clock for timeouts. The default is
+ * CLOCK_MONOTONIC, but CLOCK_MONOTONIC_COARSE is cheaper to read and
+ * accurate enough for protocol timeouts
+ * @param mux Mux state area to initialise
+ * @param clock_id Clock to pass to clock_gettime. This must be monotonic
+ * @return < 0 on failure, >= 0 on success
+ */
+int xmodem_mux_init_clock(struct xmodem_mux *mux, int clock_id);
+
+/**
+ * Release the resources held by the mux. Any sessions still active (or
+ * finished, but not yet reported) are dropped without their done callback
+ * being called
+ */
+void xmodem_mux_close(struct xmodem_mux *mux);
+
+/**
+ * Start receiving a transfer
+ * @param mux Mux to add the session to
+ * @param session Storage for the session. This must remain valid until the done callback is called
+ * @param rd_fd File descriptor to read from. This must be pollable (not a
+ *   regular file), and is made non-blocking
+ * @param wr_fd File descriptor to write responses to. This may be the same as
+ *   rd_fd. Writing to a pipe or socket with no reader raises SIGPIPE, so the
+ *   caller may want to ignore that
+ * @param flags Bitmask of XMODEM_FLAG_xxx options, as for xmodem_server_init_flags
+ * @param packet Callback to deliver each packet
+ * @param done Callback to report the end of the transfer (may be NULL)
+ * @param cb_data user-supplied pointer to be supplied to the callback functions
+ * @return < 0 on failure, >= 0 on success
+ */
+int xmodem_mux_add(struct xmodem_mux *mux, struct xmodem_mux_session *session, int rd_fd, int wr_fd, uint32_t flags,
+		xmodem_mux_packet packet, xmodem_mux_done done, void *cb_data);
+
+/**
+ * Get the xmodem_server state for a session, eg: to set a YMODEM file
+ * callback. The callback is given the cb_data passed to xmodem_mux_add
+ */
+struct xmodem_server *xmodem_mux_server(struct xmodem_mux_session *session);
+
+/**
+ * Wait for activity on any session & process it
+ * @param mux Mux state
+ * @param timeout_ms Longest time to wait, in milliseconds. -1 to wait until something happens
+ * @return Number of sessions still active, or < 0 on error
+ */
+int xmodem_mux_run(struct xmodem_mux *mux, int timeout_ms);
+
+/**
+ * Get the number of sessions which have not yet finished
+ */
+int xmodem_mux_active(const struct xmodem_mux *mux);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
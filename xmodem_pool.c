@@ -0,0 +1,679 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "xmodem_pool.h"
+
+#define XMODEM_CAN 0x18
+
+// How many events to collect from each epoll_wait
+#define MAX_EVENTS 64
+
+// How many sessions to process before looking at our own fds again
+#define RUN_BATCH 16
+
+// Session run states. Only the home worker moves a session from idle to
+// queued, and only the worker which took it from a ready queue moves it on
+// from there
+enum {
+	RUN_IDLE, // Nothing to do
+	RUN_QUEUED, // On its home worker's ready queue
+	RUN_RUNNING, // Being processed
+	RUN_AGAIN, // Being processed, and more has happened since it started
+};
+
+static int64_t pool_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int set_nonblock(int fd)
+{
+	int flags = fcntl(fd, F_GETFL);
+	if (flags < 0)
+		return -1;
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void wake(struct xmodem_pool_worker *worker)
+{
+	uint64_t one = 1;
+
+	if (write(worker->wake_fd, &one, sizeof(one)) < 0) {
+		// Only fails if a wakeup is already pending
+	}
+}
+
+/**
+ * Get an idle worker (other than this one) out of epoll_wait, so it can
+ * steal from us
+ */
+static void wake_idle(struct xmodem_pool_worker *worker)
+{
+	struct xmodem_pool *pool = worker->pool;
+
+	for (int i = 1; i < pool->worker_count; i++) {
+		struct xmodem_pool_worker *other = &pool->workers[(worker->index + i) % pool->worker_count];
+
+		if (atomic_exchange(&other->idle, false)) {
+			wake(other);
+			return;
+		}
+	}
+}
+
+static void push_ready(struct xmodem_pool_worker *worker, struct xmodem_pool_session *session)
+{
+	int count;
+
+	pthread_mutex_lock(&worker->lock);
+	session->ready_next = NULL;
+	session->ready_prev = worker->ready_tail;
+	if (worker->ready_tail)
+		worker->ready_tail->ready_next = session;
+	else
+		worker->ready_head = session;
+	worker->ready_tail = session;
+	count = atomic_load(&worker->ready_count) + 1;
+	atomic_store(&worker->ready_count, count);
+	pthread_mutex_unlock(&worker->lock);
+
+	// We can only work on one at a time, so share the rest out
+	if (count > 1)
+		wake_idle(worker);
+}
+
+/**
+ * Take a session from a ready queue. The owner takes the oldest from the
+ * front, and thieves take the newest from the back, so they only contend
+ * when there is just one left
+ */
+static struct xmodem_pool_session *pop_ready(struct xmodem_pool_worker *worker, bool steal)
+{
+	struct xmodem_pool_session *session;
+
+	pthread_mutex_lock(&worker->lock);
+	session = steal ? worker->ready_tail : worker->ready_head;
+	if (session) {
+		if (session->ready_prev)
+			session->ready_prev->ready_next = session->ready_next;
+		else
+			worker->ready_head = session->ready_next;
+		if (session->ready_next)
+			session->ready_next->ready_prev = session->ready_prev;
+		else
+			worker->ready_tail = session->ready_prev;
+		atomic_store(&worker->ready_count, atomic_load(&worker->ready_count) - 1);
+	}
+	pthread_mutex_unlock(&worker->lock);
+	return session;
+}
+
+/**
+ * Get the next session to process: our own first, then the first one we
+ * can steal
+ */
+static struct xmodem_pool_session *take_work(struct xmodem_pool_worker *worker)
+{
+	struct xmodem_pool *pool = worker->pool;
+	struct xmodem_pool_session *session = pop_ready(worker, false);
+
+	if (session)
+		return session;
+	for (int i = 1; i < pool->worker_count; i++) {
+		struct xmodem_pool_worker *victim = &pool->workers[(worker->index + i) % pool->worker_count];
+
+		if (atomic_load(&victim->ready_count) > 0 && (session = pop_ready(victim, true)) != NULL) {
+			atomic_fetch_add_explicit(&worker->stolen, 1, memory_order_relaxed);
+			return session;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Home worker: make sure the session gets processed. If another worker is
+ * already processing it, that worker goes round again instead
+ */
+static void queue_session(struct xmodem_pool_session *session)
+{
+	int state = atomic_load(&session->run_state);
+
+	for (;;) {
+		if (state == RUN_IDLE) {
+			if (atomic_compare_exchange_weak(&session->run_state, &state, RUN_QUEUED)) {
+				push_ready(session->home, session);
+				return;
+			}
+		} else if (state == RUN_RUNNING) {
+			if (atomic_compare_exchange_weak(&session->run_state, &state, RUN_AGAIN))
+				return;
+		} else {
+			return;
+		}
+	}
+}
+
+/**
+ * Hand a session back to its home worker, with a new deadline or to be
+ * finished off. Once finished is set, the session must not be touched
+ */
+static void push_update(struct xmodem_pool_session *session, bool finished)
+{
+	struct xmodem_pool_worker *home = session->home;
+
+	pthread_mutex_lock(&home->lock);
+	if (finished)
+		session->finished = true;
+	if (!session->updating) {
+		session->updating = true;
+		session->update_next = home->updates;
+		home->updates = session;
+	}
+	pthread_mutex_unlock(&home->lock);
+	// It re-checks for updates after going idle, so this can't be missed
+	if (atomic_load(&home->idle))
+		wake(home);
+}
+
+static void unthrottle(struct xmodem_pool_session *session)
+{
+	struct epoll_event ev = {.events = EPOLLIN, .data.ptr = session};
+
+	if (epoll_ctl(session->home->epoll_fd, EPOLL_CTL_ADD, session->rd_fd, &ev) < 0) {
+		// Already gone, so there's nothing left to read anyway
+	}
+}
+
+/**
+ * Home worker: the ring is full, so stop reading rd_fd until a worker has
+ * drained it. The fd is taken out of epoll altogether, as EPOLLHUP would
+ * still be reported with no events selected
+ */
+static void throttle(struct xmodem_pool_session *session)
+{
+	uint8_t *span;
+
+	// Out of epoll before throttled is set, so an unthrottle can't be undone
+	epoll_ctl(session->home->epoll_fd, EPOLL_CTL_DEL, session->rd_fd, NULL);
+	atomic_store(&session->throttled, true);
+	// In case the worker made room before it could see throttled
+	if (xmodem_ring_put_span(&session->ring, &span) > 0 && atomic_exchange(&session->throttled, false))
+		unthrottle(session);
+}
+
+/**
+ * Write as much of the queued response data as wr_fd will take
+ * @return true if everything has been written
+ */
+static bool flush_tx(struct xmodem_pool_session *session)
+{
+	size_t len;
+	const uint8_t *data = xmodem_server_pending_tx(&session->xdm, &len);
+
+	while (len > 0) {
+		ssize_t r = write(session->wr_fd, data, len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+			// Nobody to send to, so drop it
+			xmodem_server_tx_done(&session->xdm, len);
+			return true;
+		}
+		if (r <= 0)
+			return false;
+		xmodem_server_tx_done(&session->xdm, r);
+		data = xmodem_server_pending_tx(&session->xdm, &len);
+	}
+	return true;
+}
+
+static bool ring_empty(struct xmodem_pool_session *session)
+{
+	const uint8_t *data;
+
+	return xmodem_ring_peek(&session->ring, &data) == 0;
+}
+
+/**
+ * Feed everything queued in the ring into the xmodem server, handing each
+ * packet to the sink as it completes, and send the responses. Also deals
+ * with timeouts, as the home worker queues the session when one is due
+ * @return true once the session is over & can be finished off
+ */
+static bool process_session(struct xmodem_pool_session *session)
+{
+	struct xmodem_server *xdm = &session->xdm;
+	// Read before draining the ring, so nothing sent before the hangup is lost
+	bool hung_up = atomic_load(&session->hung_up);
+	int64_t now = pool_time();
+	bool flushed;
+
+	if (!session->finishing) {
+		do {
+			const uint8_t *packet;
+			uint32_t block_num;
+			int packet_len;
+
+			xmodem_ring_feed(&session->ring, xdm);
+			packet_len = xmodem_server_process_borrow(xdm, &packet, &block_num, now);
+			if (packet_len > 0) {
+				if (session->packet(session, packet, packet_len, block_num, session->cb_data) < 0) {
+					static const uint8_t cancel[2] = {XMODEM_CAN, XMODEM_CAN};
+
+					// Best effort only, as there is no retrying once we've gone
+					if (write(session->wr_fd, cancel, sizeof(cancel)) < 0) {
+						// Nothing more we can do
+					}
+					session->result = XMODEM_STATE_FAILURE;
+					return true;
+				}
+				xmodem_server_release_packet(xdm);
+			}
+			// Responses must be collected as we go, as they may not all fit in the queue
+			flush_tx(session);
+		} while ((!ring_empty(session) || xmodem_server_get_state(xdm) == XMODEM_STATE_PROCESS_PACKET) &&
+				!xmodem_server_is_done(xdm));
+
+		if (atomic_exchange(&session->throttled, false))
+			unthrottle(session);
+		if (xmodem_server_is_done(xdm)) {
+			session->finishing = true;
+			session->result = xmodem_server_get_state(xdm);
+		} else if (hung_up) {
+			// The sender has gone away
+			session->result = XMODEM_STATE_FAILURE;
+			return true;
+		}
+	}
+
+	flushed = flush_tx(session);
+	if (session->finishing && flushed)
+		return true;
+	// Anything which didn't fit in wr_fd is retried shortly
+	atomic_store(&session->deadline, flushed ? xmodem_server_next_deadline(xdm) : now + 1);
+	return false;
+}
+
+/**
+ * Process a session taken from a ready queue, until nothing more has
+ * happened to it
+ */
+static void run_session(struct xmodem_pool_worker *worker, struct xmodem_pool_session *session)
+{
+	atomic_fetch_add_explicit(&worker->processed, 1, memory_order_relaxed);
+	atomic_store(&session->run_state, RUN_RUNNING);
+	for (;;) {
+		int state = RUN_RUNNING;
+
+		if (process_session(session)) {
+			// Left running, so the home worker won't queue it again
+			push_update(session, true);
+			return;
+		}
+		if (session->home == worker)
+			xmodem_timer_add(&worker->timers, &session->timer, atomic_load(&session->deadline));
+		else
+			push_update(session, false);
+		if (atomic_compare_exchange_strong(&session->run_state, &state, RUN_IDLE))
+			return;
+		atomic_store(&session->run_state, RUN_RUNNING);
+	}
+}
+
+/**
+ * Home worker: remove a finished session, and let the owner know
+ */
+static void finish(struct xmodem_pool_worker *worker, struct xmodem_pool_session *session)
+{
+	struct xmodem_pool *pool = worker->pool;
+
+	// May already be out of epoll, after a hangup or throttle
+	epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, session->rd_fd, NULL);
+	xmodem_timer_del(&worker->timers, &session->timer);
+	if (session->done)
+		session->done(session, session->result, session->cb_data);
+
+	pthread_mutex_lock(&pool->lock);
+	if (--pool->active == 0)
+		pthread_cond_broadcast(&pool->idle);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * Home worker: pick up sessions which have been added, or processed by
+ * another worker
+ */
+static void collect_updates(struct xmodem_pool_worker *worker)
+{
+	struct xmodem_pool_session *session, *next, *finished = NULL;
+
+	pthread_mutex_lock(&worker->lock);
+	for (session = worker->updates; session; session = next) {
+		next = session->update_next;
+		session->updating = false;
+		if (session->finished) {
+			// Nobody else will push it again, so the link can be reused
+			session->update_next = finished;
+			finished = session;
+		} else {
+			xmodem_timer_add(&worker->timers, &session->timer, atomic_load(&session->deadline));
+		}
+	}
+	worker->updates = NULL;
+	pthread_mutex_unlock(&worker->lock);
+
+	// Outside the lock, as done may add another session
+	for (session = finished; session; session = next) {
+		next = session->update_next;
+		finish(worker, session);
+	}
+}
+
+/**
+ * Home worker: read everything waiting into the session's ring, and queue
+ * it for processing
+ */
+static void session_readable(struct xmodem_pool_session *session)
+{
+	for (;;) {
+		uint8_t *span;
+		size_t space = xmodem_ring_put_span(&session->ring, &span);
+		ssize_t r;
+
+		if (space == 0) {
+			throttle(session);
+			break;
+		}
+		r = read(session->rd_fd, span, space);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r == 0 || (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+			// The sender has gone away, so leave it to the worker to fail the transfer
+			epoll_ctl(session->home->epoll_fd, EPOLL_CTL_DEL, session->rd_fd, NULL);
+			atomic_store(&session->hung_up, true);
+			break;
+		}
+		if (r < 0)
+			break;
+		xmodem_ring_put_commit(&session->ring, r);
+		// Otherwise the span stopped at the end of the buffer, so go round for the rest
+		if ((size_t)r < space)
+			break;
+	}
+	queue_session(session);
+}
+
+/**
+ * A session's timeout is due, so let the xmodem server deal with it
+ */
+static void session_timeout(struct xmodem_timer *timer, void *cb_data)
+{
+	struct xmodem_pool_session *session = (struct xmodem_pool_session *)
+		((uint8_t *)timer - offsetof(struct xmodem_pool_session, timer));
+
+	(void)cb_data;
+	queue_session(session);
+}
+
+/**
+ * Is there anything to do without waiting? Called after marking ourselves
+ * idle, so anything queued after this will wake us
+ */
+static bool have_work(struct xmodem_pool_worker *worker)
+{
+	struct xmodem_pool *pool = worker->pool;
+	bool updates;
+
+	pthread_mutex_lock(&worker->lock);
+	updates = worker->updates != NULL;
+	pthread_mutex_unlock(&worker->lock);
+	if (updates)
+		return true;
+	for (int i = 0; i < pool->worker_count; i++)
+		if (atomic_load(&pool->workers[i].ready_count) > 0)
+			return true;
+	return false;
+}
+
+/**
+ * Pin each worker to its own CPU, if there are enough of them
+ */
+static void pin_worker(struct xmodem_pool_worker *worker)
+{
+	cpu_set_t allowed, cpu;
+	int n = 0;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0 || CPU_COUNT(&allowed) < worker->pool->worker_count)
+		return;
+	for (int i = 0; i < CPU_SETSIZE; i++) {
+		if (CPU_ISSET(i, &allowed) && n++ == worker->index) {
+			CPU_ZERO(&cpu);
+			CPU_SET(i, &cpu);
+			pthread_setaffinity_np(pthread_self(), sizeof(cpu), &cpu);
+			return;
+		}
+	}
+}
+
+static void *worker_main(void *arg)
+{
+	struct xmodem_pool_worker *worker = arg;
+	struct xmodem_pool *pool = worker->pool;
+	struct epoll_event events[MAX_EVENTS];
+
+	pin_worker(worker);
+	while (!atomic_load(&pool->stopping)) {
+		struct xmodem_pool_session *session;
+		int64_t next, now;
+		int timeout = 0, ran = 0, count;
+
+		collect_updates(worker);
+		xmodem_timer_expire(&worker->timers, pool_time(), session_timeout, worker);
+		while (ran < RUN_BATCH && (session = take_work(worker)) != NULL) {
+			run_session(worker, session);
+			ran++;
+		}
+
+		// Just check our fds if there's still work to do, otherwise sleep
+		// until the next timeout
+		if (ran == 0) {
+			atomic_store(&worker->idle, true);
+			if (!have_work(worker)) {
+				now = pool_time();
+				next = xmodem_timer_next(&worker->timers);
+				timeout = next < 0 ? -1 : next > now ? next - now : 0;
+			}
+		}
+		count = epoll_wait(worker->epoll_fd, events, MAX_EVENTS, timeout);
+		atomic_store(&worker->idle, false);
+		for (int i = 0; i < count; i++) {
+			if (events[i].data.ptr) {
+				session_readable(events[i].data.ptr);
+			} else {
+				uint64_t value;
+
+				if (read(worker->wake_fd, &value, sizeof(value)) < 0) {
+					// Someone else's wakeup got there first
+				}
+			}
+		}
+	}
+	return NULL;
+}
+
+int xmodem_pool_init(struct xmodem_pool *pool, int workers)
+{
+	pthread_condattr_t attr;
+
+	if (workers < 1 || workers > XMODEM_POOL_MAX_WORKERS)
+		return -1;
+	memset(pool, 0, sizeof(*pool));
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&pool->idle, &attr);
+	pthread_condattr_destroy(&attr);
+
+	for (int i = 0; i < workers; i++) {
+		struct xmodem_pool_worker *worker = &pool->workers[i];
+		struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+
+		worker->pool = pool;
+		worker->index = i;
+		worker->wake_fd = -1;
+		pthread_mutex_init(&worker->lock, NULL);
+		xmodem_timer_wheel_init(&worker->timers, pool_time());
+		pool->worker_count++;
+		worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (worker->epoll_fd < 0)
+			goto fail;
+		worker->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (worker->wake_fd < 0 || epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->wake_fd, &ev) < 0)
+			goto fail;
+	}
+	for (int i = 0; i < workers; i++) {
+		struct xmodem_pool_worker *worker = &pool->workers[i];
+
+		if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0)
+			goto fail;
+		worker->running = true;
+	}
+	return 0;
+
+fail:
+	xmodem_pool_close(pool);
+	return -1;
+}
+
+void xmodem_pool_close(struct xmodem_pool *pool)
+{
+	atomic_store(&pool->stopping, true);
+	for (int i = 0; i < pool->worker_count; i++)
+		if (pool->workers[i].running)
+			wake(&pool->workers[i]);
+	for (int i = 0; i < pool->worker_count; i++) {
+		struct xmodem_pool_worker *worker = &pool->workers[i];
+
+		if (worker->running)
+			pthread_join(worker->thread, NULL);
+		worker->running = false;
+		if (worker->epoll_fd >= 0)
+			close(worker->epoll_fd);
+		if (worker->wake_fd >= 0)
+			close(worker->wake_fd);
+		worker->epoll_fd = -1;
+		worker->wake_fd = -1;
+		pthread_mutex_destroy(&worker->lock);
+	}
+	pool->worker_count = 0;
+	pthread_cond_destroy(&pool->idle);
+	pthread_mutex_destroy(&pool->lock);
+}
+
+int xmodem_pool_session_init(struct xmodem_pool_session *session, int rd_fd, int wr_fd, uint32_t flags,
+		xmodem_pool_packet packet, xmodem_pool_done done, void *cb_data)
+{
+	if (!packet || set_nonblock(rd_fd) < 0 || set_nonblock(wr_fd) < 0)
+		return -1;
+	memset(session, 0, sizeof(*session));
+	if (xmodem_server_init_flags(&session->xdm, NULL, cb_data, flags) < 0)
+		return -1;
+	if (xmodem_ring_init(&session->ring, session->ring_buffer, sizeof(session->ring_buffer)) < 0)
+		return -1;
+	session->rd_fd = rd_fd;
+	session->wr_fd = wr_fd;
+	session->packet = packet;
+	session->done = done;
+	session->cb_data = cb_data;
+	xmodem_timer_init(&session->timer);
+	atomic_init(&session->run_state, RUN_IDLE);
+	atomic_init(&session->throttled, false);
+	atomic_init(&session->hung_up, false);
+	atomic_init(&session->deadline, 0);
+	return 0;
+}
+
+struct xmodem_server *xmodem_pool_server(struct xmodem_pool_session *session)
+{
+	return &session->xdm;
+}
+
+int xmodem_pool_add(struct xmodem_pool *pool, struct xmodem_pool_session *session)
+{
+	struct epoll_event ev = {.events = EPOLLIN, .data.ptr = session};
+
+	if (pool->worker_count == 0)
+		return -1;
+	// Sessions stay on the worker for their fd, so its reads & timers stay on one CPU
+	session->home = &pool->workers[session->rd_fd % pool->worker_count];
+	pthread_mutex_lock(&pool->lock);
+	pool->active++;
+	pthread_mutex_unlock(&pool->lock);
+	if (epoll_ctl(session->home->epoll_fd, EPOLL_CTL_ADD, session->rd_fd, &ev) < 0) {
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->active == 0)
+			pthread_cond_broadcast(&pool->idle);
+		pthread_mutex_unlock(&pool->lock);
+		return -1;
+	}
+
+	// A deadline of 0 gets the initial 'C' out straight away
+	push_update(session, false);
+	wake(session->home);
+	return 0;
+}
+
+int xmodem_pool_wait(struct xmodem_pool *pool, int timeout_ms)
+{
+	struct timespec until;
+	int active;
+
+	clock_gettime(CLOCK_MONOTONIC, &until);
+	if (timeout_ms >= 0) {
+		until.tv_sec += timeout_ms / 1000;
+		until.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+		if (until.tv_nsec >= 1000000000) {
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000;
+		}
+	}
+	pthread_mutex_lock(&pool->lock);
+	while (pool->active > 0) {
+		if (timeout_ms < 0)
+			pthread_cond_wait(&pool->idle, &pool->lock);
+		else if (pthread_cond_timedwait(&pool->idle, &pool->lock, &until) == ETIMEDOUT)
+			break;
+	}
+	active = pool->active;
+	pthread_mutex_unlock(&pool->lock);
+	return active;
+}
+
+int xmodem_pool_active(struct xmodem_pool *pool)
+{
+	int active;
+
+	pthread_mutex_lock(&pool->lock);
+	active = pool->active;
+	pthread_mutex_unlock(&pool->lock);
+	return active;
+}
+
+uint64_t xmodem_pool_stolen(const struct xmodem_pool *pool)
+{
+	uint64_t stolen = 0;
+
+	for (int i = 0; i < pool->worker_count; i++)
+		stolen += atomic_load_explicit(&pool->workers[i].stolen, memory_order_relaxed);
+	return stolen;
+}
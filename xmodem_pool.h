@@ -0,0 +1,218 @@
+/**
+ * Multi-threaded receive engine for Linux, for when a single xmodem_mux
+ * thread can't keep up. A pool of worker threads (pinned one per CPU where
+ * possible) each has its own epoll set & timer wheel, and each session
+ * lives on one of them - its home worker, picked from the rd_fd - which is
+ * the only thread to read its fd & track its timeout. Received bytes are
+ * queued in a per-session xmodem_ring, and the session is put on its home
+ * worker's ready queue.
+ * The protocol work (CRC checks, packet delivery & responses) is done by
+ * whichever worker takes the session from a ready queue: the home worker
+ * takes from the front of its own queue, and an idle worker steals from
+ * the back of another's. A session is only ever on one ready queue, and an
+ * atomic run state hands it from thread to thread, so it is never processed
+ * by two threads at once.
+ * Like xmodem_mux, no dynamic memory is allocated - the caller provides the
+ * storage for the pool & each session
+ */
+#ifndef XMODEM_POOL_H
+#define XMODEM_POOL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "xmodem_server.h"
+#include "xmodem_timer.h"
+#include "xmodem_ring.h"
+
+/**
+ * Maximum number of worker threads
+ */
+#ifndef XMODEM_POOL_MAX_WORKERS
+#define XMODEM_POOL_MAX_WORKERS 64
+#endif
+
+/**
+ * Size of each session's receive ring. This must be a power of 2, and
+ * should hold a few frames, so the home worker can keep reading while
+ * another worker processes the session
+ */
+#ifndef XMODEM_POOL_RING_SIZE
+#define XMODEM_POOL_RING_SIZE 4096
+#endif
+
+struct xmodem_pool;
+struct xmodem_pool_worker;
+struct xmodem_pool_session;
+
+/**
+ * Callback function to deliver a received packet. This may be called from
+ * any worker thread, but never from two at once for the same session
+ * @param session Session the packet arrived on
+ * @param data Packet data. Only valid for the duration of the callback
+ * @param len Number of bytes in data
+ * @param block_num 0-based index of the block
+ * @param cb_data user-supplied pointer given to xmodem_pool_session_init
+ * @return < 0 to abort the transfer, >= 0 to accept the packet
+ */
+typedef int (*xmodem_pool_packet)(struct xmodem_pool_session *session, const uint8_t *data, int len, uint32_t block_num, void *cb_data);
+
+/**
+ * Callback function to report that a session has finished. This is called
+ * from the session's home worker, once no worker will touch the session
+ * again, so its fds may be closed & its storage reused
+ * @param session Session which has finished
+ * @param state XMODEM_STATE_SUCCESSFUL or XMODEM_STATE_FAILURE
+ * @param cb_data user-supplied pointer given to xmodem_pool_session_init
+ */
+typedef void (*xmodem_pool_done)(struct xmodem_pool_session *session, xmodem_server_state state, void *cb_data);
+
+/**
+ * State for a single transfer within the pool.
+ * None of its contents should be accessed directly, this structure
+ * should be considered opaque
+ */
+struct xmodem_pool_session {
+	struct xmodem_server xdm;
+	struct xmodem_pool_worker *home; // Worker which owns the fds & timer
+	int rd_fd;
+	int wr_fd;
+	xmodem_pool_packet packet;
+	xmodem_pool_done done;
+	void *cb_data;
+	// Used by whichever worker is processing the session
+	bool finishing; // Is the transfer over, with the final response still to be sent?
+	xmodem_server_state result; // How did the transfer end?
+	// Only used by the home worker
+	struct xmodem_timer timer; // Fires when xmodem_server_process is next due
+	// Shared between workers
+	atomic_int run_state; // Idle, queued, running, or running with more to do
+	atomic_bool throttled; // Has rd_fd been taken out of epoll, as the ring is full?
+	atomic_bool hung_up; // Has the sender gone away?
+	atomic_llong deadline; // When the home worker should next queue the session
+	bool finished; // Set under the home worker's lock, once the session can be dropped
+	bool updating; // On the home worker's update list?
+	struct xmodem_pool_session *ready_prev, *ready_next; // Ready queue
+	struct xmodem_pool_session *update_next; // Update list
+	struct xmodem_ring ring; // Received bytes, from the home worker
+	uint8_t ring_buffer[XMODEM_POOL_RING_SIZE];
+};
+
+/**
+ * State for one worker thread.
+ * None of its contents should be accessed directly, this structure
+ * should be considered opaque
+ */
+struct xmodem_pool_worker {
+	struct xmodem_pool *pool;
+	pthread_t thread;
+	int index;
+	int epoll_fd;
+	int wake_fd; // eventfd, to interrupt epoll_wait
+	bool running; // Has the thread been started?
+	atomic_bool idle; // Is the worker waiting in epoll_wait with nothing to do?
+	struct xmodem_timer_wheel timers; // Only used by this worker
+	pthread_mutex_t lock; // Protects the ready queue & update list
+	struct xmodem_pool_session *ready_head, *ready_tail;
+	atomic_int ready_count; // Only changed under lock, but peeked at by thieves
+	struct xmodem_pool_session *updates; // Processed elsewhere, with a new deadline or result
+	atomic_ullong processed; // Sessions run by this worker
+	atomic_ullong stolen; // ... of which were taken from another worker
+};
+
+/**
+ * This contains the state for the pool.
+ * None of its contents should be accessed directly, this structure
+ * should be considered opaque
+ */
+struct xmodem_pool {
+	int worker_count;
+	atomic_bool stopping;
+	pthread_mutex_t lock; // Protects active, for xmodem_pool_wait
+	pthread_cond_t idle;
+	int active; // Sessions which have not yet finished
+	struct xmodem_pool_worker workers[XMODEM_POOL_MAX_WORKERS];
+};
+
+/**
+ * Initialise the pool & start the worker threads
+ * @param pool Pool state area to initialise
+ * @param workers Number of worker threads, from 1 to
+ *   XMODEM_POOL_MAX_WORKERS. Each is pinned to a CPU, if there are enough
+ * @return < 0 on failure, >= 0 on success
+ */
+int xmodem_pool_init(struct xmodem_pool *pool, int workers);
+
+/**
+ * Stop the worker threads & release the resources held by the pool. Any
+ * sessions still active are dropped without their done callback being
+ * called
+ */
+void xmodem_pool_close(struct xmodem_pool *pool);
+
+/**
+ * Set up a session, ready to be added to a pool
+ * @param session Storage for the session. This must remain valid until the done callback is called
+ * @param rd_fd File descriptor to read from. This must be pollable (not a
+ *   regular file), and is made non-blocking. It also picks the session's
+ *   home worker
+ * @param wr_fd File descriptor to write responses to. This may be the same as
+ *   rd_fd. Writing to a pipe or socket with no reader raises SIGPIPE, so the
+ *   caller may want to ignore that
+ * @param flags Bitmask of XMODEM_FLAG_xxx options, as for xmodem_server_init_flags
+ * @param packet Callback to deliver each packet
+ * @param done Callback to report the end of the transfer (may be NULL)
+ * @param cb_data user-supplied pointer to be supplied to the callback functions
+ * @return < 0 on failure, >= 0 on success
+ */
+int xmodem_pool_session_init(struct xmodem_pool_session *session, int rd_fd, int wr_fd, uint32_t flags,
+		xmodem_pool_packet packet, xmodem_pool_done done, void *cb_data);
+
+/**
+ * Get the xmodem_server state for a session, eg: to set a YMODEM file
+ * callback. The callback is given the cb_data passed to
+ * xmodem_pool_session_init. Once the session has been added, this may only
+ * be used from the session's own callbacks
+ */
+struct xmodem_server *xmodem_pool_server(struct xmodem_pool_session *session);
+
+/**
+ * Start receiving a transfer. This may be called from any thread, including
+ * from a done callback
+ * @param pool Pool to add the session to
+ * @param session Session set up by xmodem_pool_session_init
+ * @return < 0 on failure, >= 0 on success
+ */
+int xmodem_pool_add(struct xmodem_pool *pool, struct xmodem_pool_session *session);
+
+/**
+ * Wait for every session to finish
+ * @param pool Pool state
+ * @param timeout_ms Longest time to wait, in milliseconds. -1 to wait until they have all finished
+ * @return Number of sessions still active
+ */
+int xmodem_pool_wait(struct xmodem_pool *pool, int timeout_ms);
+
+/**
+ * Get the number of sessions which have not yet finished
+ */
+int xmodem_pool_active(struct xmodem_pool *pool);
+
+/**
+ * Get the number of times a session was processed by a worker other than
+ * its home worker
+ */
+uint64_t xmodem_pool_stolen(const struct xmodem_pool *pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
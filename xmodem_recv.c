@@ -0,0 +1,279 @@
+/**
+ * Receive XMODEM transfers on many ports at once, using xmodem_mux
+ * Usage: xmodem_recv [-g] [-m|-u] [-s] [-y] DEVICE OUTPUT [DEVICE OUTPUT ...]
+ * Each DEVICE is a tty, pty, fifo or unix socket path, or '-' for
+ * stdin/stdout. OUTPUT is the file to write, or with -y the directory to
+ * write the YMODEM batch into. If a transfer fails, its flight recorder is
+ * saved as OUTPUT.trace, which can be decoded with xmodem_trace
+ */
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "xmodem_mux.h"
+#include "xmodem_sink.h"
+
+struct port {
+	struct xmodem_mux_session session;
+	const char *device;
+	const char *output;
+	int fd; // Device
+	struct xmodem_sink sink; // Output file
+	bool sink_open;
+	int64_t size; // Size of the output file, if the sender told us
+	bool failed;
+};
+
+static uint32_t sink_flags;
+
+/**
+ * Finish the current output file. YMODEM gives us the real size, otherwise
+ * the padding on the last block is stripped. With -s, a complete file is
+ * synced first, so it is on storage before it is reported as done
+ */
+static void close_output(struct port *port)
+{
+	if (!port->sink_open)
+		return;
+	port->sink_open = false;
+	// O_DSYNC alone neither waits for queued io_uring writes, nor covers the mmap window
+	if (!port->failed && (sink_flags & XMODEM_SINK_DSYNC) && xmodem_sink_sync(&port->sink) < 0) {
+		fprintf(stderr, "%s: Unable to sync output: %s\n", port->device, strerror(errno));
+		port->failed = true;
+	}
+	// Keep what we have of a failed transfer
+	if (xmodem_sink_close(&port->sink, port->failed ? -1 : port->size) < 0 && !port->failed) {
+		fprintf(stderr, "%s: Unable to finish output: %s\n", port->device, strerror(errno));
+		port->failed = true;
+	}
+}
+
+static int open_output(struct port *port, const char *name, int64_t size)
+{
+	close_output(port);
+	port->size = size;
+	if (xmodem_sink_open(&port->sink, name, sink_flags) < 0) {
+		fprintf(stderr, "%s: Unable to open %s: %s\n", port->device, name, strerror(errno));
+		return -1;
+	}
+	port->sink_open = true;
+	return 0;
+}
+
+static void file_info(struct xmodem_server *xdm, const char *name, int64_t size, void *cb_data)
+{
+	struct port *port = cb_data;
+	char path[PATH_MAX];
+	char base[PATH_MAX];
+
+	(void)xdm;
+	// Never let the sender pick a directory
+	snprintf(base, sizeof(base), "%s", name);
+	snprintf(path, sizeof(path), "%s/%s", port->output, basename(base));
+	if (open_output(port, path, size) < 0)
+		port->failed = true;
+}
+
+static int rx_packet(struct xmodem_mux_session *session, const uint8_t *data, int len, uint32_t block_num, void *cb_data)
+{
+	struct port *port = cb_data;
+
+	(void)block_num;
+	if (port->failed || !port->sink_open)
+		return -1;
+	// Not block_num * packet size, as 128B & 1K packets may be mixed
+	if (xmodem_sink_write(&port->sink, data, len, xmodem_server_packet_offset(xmodem_mux_server(session))) < 0) {
+		fprintf(stderr, "%s: Write failed: %s\n", port->device, strerror(errno));
+		port->failed = true;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Keep the flight recorder from a failed transfer in OUTPUT.trace, for
+ * decoding with xmodem_trace
+ */
+static void save_trace(struct port *port)
+{
+	uint8_t trace[XMODEM_TRACE_HEADER_LEN + XMODEM_TRACE_SIZE * XMODEM_TRACE_ENTRY_LEN];
+	char path[PATH_MAX];
+	int len = xmodem_server_trace_save(xmodem_mux_server(&port->session), trace, sizeof(trace));
+	int fd;
+
+	if (len < 0)
+		return;
+	snprintf(path, sizeof(path), "%s.trace", port->output);
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0 || write(fd, trace, len) != len)
+		fprintf(stderr, "%s: Unable to save trace to %s\n", port->device, path);
+	else
+		fprintf(stderr, "%s: Trace saved to %s\n", port->device, path);
+	if (fd >= 0)
+		close(fd);
+}
+
+static void rx_done(struct xmodem_mux_session *session, xmodem_server_state state, void *cb_data)
+{
+	struct port *port = cb_data;
+
+	(void)session;
+	if (state != XMODEM_STATE_SUCCESSFUL)
+		port->failed = true;
+	close_output(port);
+	if (port->failed)
+		save_trace(port);
+	fprintf(stderr, "%s: %s\n", port->device, port->failed ? "failed" : "done");
+	if (port->fd > STDOUT_FILENO)
+		close(port->fd);
+}
+
+/**
+ * Open a device, putting ttys into raw mode. Unix sockets are connected to
+ */
+static int open_device(const char *path)
+{
+	struct stat st;
+	int fd;
+
+	if (strcmp(path, "-") == 0)
+		return STDIN_FILENO;
+
+	if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+		if (strlen(path) >= sizeof(addr.sun_path))
+			return -1;
+		strcpy(addr.sun_path, path);
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0)
+			return -1;
+		if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+
+	fd = open(path, O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (fd >= 0 && isatty(fd)) {
+		struct termios tio;
+
+		if (tcgetattr(fd, &tio) == 0) {
+			cfmakeraw(&tio);
+			tcsetattr(fd, TCSANOW, &tio);
+		}
+	}
+	return fd;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-g] [-m|-u] [-s] [-y] DEVICE OUTPUT [DEVICE OUTPUT ...]\n", prog);
+	fprintf(stderr, "  -g  Use streaming (XMODEM-G/YMODEM-G) mode\n");
+	fprintf(stderr, "  -m  Write output files through mmap rather than pwrite\n");
+	fprintf(stderr, "  -u  Queue writes to io_uring, so ACKs don't wait for storage\n");
+	fprintf(stderr, "  -s  Don't report a file as done until it is on storage\n");
+	fprintf(stderr, "  -y  Receive a YMODEM batch, OUTPUT is a directory\n");
+	fprintf(stderr, "DEVICE may be '-' for stdin/stdout\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	static struct xmodem_mux mux;
+	struct port *ports;
+	uint32_t flags = 0;
+	int port_count;
+	int failures = 0;
+	int opt;
+
+	if (xmodem_server_size() != sizeof(struct xmodem_server)) {
+		fprintf(stderr, "%s: Built with different XMODEM_STATS/XMODEM_TRACE_SIZE to xmodem_server.c\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	while ((opt = getopt(argc, argv, "gmsuy")) != -1) {
+		switch (opt) {
+		case 'g':
+			flags |= XMODEM_FLAG_STREAMING;
+			break;
+		case 'm':
+			sink_flags |= XMODEM_SINK_MMAP;
+			break;
+		case 's':
+			sink_flags |= XMODEM_SINK_DSYNC;
+			break;
+		case 'u':
+			sink_flags |= XMODEM_SINK_URING;
+			break;
+		case 'y':
+			flags |= XMODEM_FLAG_YMODEM;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind >= argc || (argc - optind) % 2 != 0)
+		usage(argv[0]);
+
+	// A sender going away shouldn't take everyone else down with it
+	signal(SIGPIPE, SIG_IGN);
+
+	if (xmodem_mux_init(&mux) < 0) {
+		perror("epoll");
+		return EXIT_FAILURE;
+	}
+	port_count = (argc - optind) / 2;
+	ports = calloc(port_count, sizeof(*ports));
+	if (!ports)
+		return EXIT_FAILURE;
+
+	for (int i = 0; i < port_count; i++) {
+		struct port *port = &ports[i];
+		int wr_fd;
+
+		port->device = argv[optind + i * 2];
+		port->output = argv[optind + i * 2 + 1];
+		port->fd = open_device(port->device);
+		if (port->fd < 0) {
+			fprintf(stderr, "%s: Unable to open: %s\n", port->device, strerror(errno));
+			return EXIT_FAILURE;
+		}
+		if (!(flags & XMODEM_FLAG_YMODEM) && open_output(port, port->output, -1) < 0)
+			return EXIT_FAILURE;
+		wr_fd = port->fd == STDIN_FILENO ? STDOUT_FILENO : port->fd;
+		if (xmodem_mux_add(&mux, &port->session, port->fd, wr_fd, flags, rx_packet, rx_done, port) < 0) {
+			fprintf(stderr, "%s: Unable to start: %s\n", port->device, strerror(errno));
+			return EXIT_FAILURE;
+		}
+		if (flags & XMODEM_FLAG_YMODEM)
+			xmodem_server_set_file_callback(xmodem_mux_server(&port->session), file_info);
+	}
+
+	while (xmodem_mux_active(&mux) > 0) {
+		if (xmodem_mux_run(&mux, -1) < 0) {
+			perror("epoll_wait");
+			return EXIT_FAILURE;
+		}
+	}
+
+	for (int i = 0; i < port_count; i++)
+		if (ports[i].failed)
+			failures++;
+	xmodem_mux_close(&mux);
+	free(ports);
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,140 @@
+#include <string.h>
+
+#include "xmodem_ring.h"
+
+int xmodem_ring_init(struct xmodem_ring *ring, uint8_t *buffer, size_t size)
+{
+	if (!buffer || size == 0 || (size & (size - 1)) != 0)
+		return -1;
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	atomic_init(&ring->dropped, 0);
+	ring->tail_cache = 0;
+	ring->head_cache = 0;
+	ring->buffer = buffer;
+	ring->mask = size - 1;
+	return 0;
+}
+
+/**
+ * Producer: how much space is free? The consumer's tail is only re-read
+ * once the cached copy says there isn't enough
+ */
+static size_t put_space(struct xmodem_ring *ring, size_t head, size_t wanted)
+{
+	size_t size = ring->mask + 1;
+
+	if (size - (head - ring->tail_cache) < wanted)
+		ring->tail_cache = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	return size - (head - ring->tail_cache);
+}
+
+static void count_dropped(struct xmodem_ring *ring, size_t len)
+{
+	// Only the producer writes this, so there's no need for a locked add
+	size_t dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+
+	atomic_store_explicit(&ring->dropped, dropped + len, memory_order_relaxed);
+}
+
+size_t xmodem_ring_put(struct xmodem_ring *ring, const uint8_t *data, size_t len)
+{
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	size_t space = put_space(ring, head, len);
+	size_t pos = head & ring->mask;
+	size_t first;
+
+	if (len > space) {
+		count_dropped(ring, len - space);
+		len = space;
+	}
+	// Copy in up to two pieces, as the free space may wrap
+	first = ring->mask + 1 - pos;
+	if (first > len)
+		first = len;
+	memcpy(&ring->buffer[pos], data, first);
+	memcpy(ring->buffer, &data[first], len - first);
+	atomic_store_explicit(&ring->head, head + len, memory_order_release);
+	return len;
+}
+
+bool xmodem_ring_put_byte(struct xmodem_ring *ring, uint8_t byte)
+{
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+	if (put_space(ring, head, 1) == 0) {
+		count_dropped(ring, 1);
+		return false;
+	}
+	ring->buffer[head & ring->mask] = byte;
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+	return true;
+}
+
+size_t xmodem_ring_put_span(struct xmodem_ring *ring, uint8_t **span)
+{
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	size_t pos = head & ring->mask;
+	size_t space = put_space(ring, head, ring->mask + 1 - pos);
+
+	*span = &ring->buffer[pos];
+	return space < ring->mask + 1 - pos ? space : ring->mask + 1 - pos;
+}
+
+void xmodem_ring_put_commit(struct xmodem_ring *ring, size_t len)
+{
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+	atomic_store_explicit(&ring->head, head + len, memory_order_release);
+}
+
+void xmodem_ring_put_dropped(struct xmodem_ring *ring, size_t len)
+{
+	count_dropped(ring, len);
+}
+
+size_t xmodem_ring_peek(struct xmodem_ring *ring, const uint8_t **data)
+{
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	size_t pos = tail & ring->mask;
+	size_t avail;
+
+	// The producer's head is only re-read once we've caught up with it
+	if (ring->head_cache == tail)
+		ring->head_cache = atomic_load_explicit(&ring->head, memory_order_acquire);
+	avail = ring->head_cache - tail;
+	*data = &ring->buffer[pos];
+	return avail < ring->mask + 1 - pos ? avail : ring->mask + 1 - pos;
+}
+
+void xmodem_ring_consume(struct xmodem_ring *ring, size_t len)
+{
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+	atomic_store_explicit(&ring->tail, tail + len, memory_order_release);
+}
+
+size_t xmodem_ring_feed(struct xmodem_ring *ring, struct xmodem_server *xdm)
+{
+	size_t total = 0;
+	const uint8_t *data;
+	size_t len;
+
+	// Two runs cover everything queued on entry, even if it wraps around the
+	// end of the buffer. Stopping there keeps a producer which never lets up
+	// from holding us here
+	for (int pass = 0; pass < 2 && (len = xmodem_ring_peek(ring, &data)) > 0; pass++) {
+		size_t used = xmodem_server_rx_bytes(xdm, data, len);
+
+		xmodem_ring_consume(ring, used);
+		total += used;
+		if (used < len)
+			break;
+	}
+	return total;
+}
+
+size_t xmodem_ring_dropped(const struct xmodem_ring *ring)
+{
+	return atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+}
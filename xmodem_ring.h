@@ -0,0 +1,140 @@
+/**
+ * Lock-free single-producer/single-consumer byte ring, to split receiving
+ * from the protocol. The producer (a UART ISR, DMA completion handler or
+ * reader thread) only queues raw bytes, and the consumer (the thread which
+ * owns the xmodem_server) drains them in bulk with xmodem_ring_feed, so
+ * the CRC & packet handling stay out of interrupt context and no locks
+ * are needed. Both sides are wait-free: a full ring drops the excess,
+ * which is counted, and the protocol recovers it as a bad packet.
+ * The head & tail are kept on separate cache lines, and each side keeps a
+ * cached copy of the other's index, so the line only bounces between CPUs
+ * when the cached copy runs out.
+ * Needs C11 atomics, which must be lock-free for use from an ISR. As with
+ * the rest of the library, the caller provides the storage
+ */
+#ifndef XMODEM_RING_H
+#define XMODEM_RING_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "xmodem_server.h"
+
+/**
+ * Size of a cache line, to keep the producer & consumer apart
+ */
+#ifndef XMODEM_RING_CACHE_LINE
+#define XMODEM_RING_CACHE_LINE 64
+#endif
+
+/**
+ * This contains the state for the ring.
+ * None of its contents should be accessed directly, this structure
+ * should be considered opaque
+ */
+struct xmodem_ring {
+	// Written by the producer
+	_Alignas(XMODEM_RING_CACHE_LINE) atomic_size_t head; // Total bytes ever queued
+	size_t tail_cache; // Last tail seen by the producer
+	atomic_size_t dropped; // Bytes thrown away because the ring was full
+	// Written by the consumer
+	_Alignas(XMODEM_RING_CACHE_LINE) atomic_size_t tail; // Total bytes ever consumed
+	size_t head_cache; // Last head seen by the consumer
+	// Fixed after xmodem_ring_init
+	_Alignas(XMODEM_RING_CACHE_LINE) uint8_t *buffer;
+	size_t mask;
+};
+
+/**
+ * Initialise the ring
+ * @param ring Ring state area to initialise
+ * @param buffer Storage for queued bytes
+ * @param size Number of bytes in buffer. This must be a power of 2
+ * @return < 0 on failure, >= 0 on success
+ */
+int xmodem_ring_init(struct xmodem_ring *ring, uint8_t *buffer, size_t size);
+
+/**
+ * Producer: queue received bytes. Anything which doesn't fit is dropped &
+ * counted
+ * @param ring Ring state
+ * @param data Bytes to queue
+ * @param len Number of bytes in data
+ * @return Number of bytes queued
+ */
+size_t xmodem_ring_put(struct xmodem_ring *ring, const uint8_t *data, size_t len);
+
+/**
+ * Producer: queue a single received byte, eg: from a UART RX interrupt
+ * @return true if it was queued, false if it was dropped
+ */
+bool xmodem_ring_put_byte(struct xmodem_ring *ring, uint8_t byte);
+
+/**
+ * Producer: get the free space in the ring which can be written to
+ * directly, eg: as the next DMA target. This may be less than the total
+ * free space, when the space wraps around the end of the buffer
+ * @param ring Ring state
+ * @param span Set to the start of the free space
+ * @return Number of bytes which may be written at span
+ */
+size_t xmodem_ring_put_span(struct xmodem_ring *ring, uint8_t **span);
+
+/**
+ * Producer: queue bytes written directly into the span from
+ * xmodem_ring_put_span
+ * @param ring Ring state
+ * @param len Number of bytes written. This must be no more than the span
+ */
+void xmodem_ring_put_commit(struct xmodem_ring *ring, size_t len);
+
+/**
+ * Producer: count bytes which were lost before reaching the ring, eg: a
+ * UART overrun, so that they show up in xmodem_ring_dropped
+ */
+void xmodem_ring_put_dropped(struct xmodem_ring *ring, size_t len);
+
+/**
+ * Consumer: get the queued bytes which can be read directly. This may be
+ * less than the total queued, when they wrap around the end of the buffer
+ * @param ring Ring state
+ * @param data Set to the start of the queued bytes
+ * @return Number of bytes which may be read at data
+ */
+size_t xmodem_ring_peek(struct xmodem_ring *ring, const uint8_t **data);
+
+/**
+ * Consumer: release bytes which have been read from xmodem_ring_peek
+ * @param ring Ring state
+ * @param len Number of bytes to release
+ */
+void xmodem_ring_consume(struct xmodem_ring *ring, size_t len);
+
+/**
+ * Consumer: pass queued bytes to xmodem_server_rx_bytes. This stops early
+ * when a packet is ready, in the same way, so xmodem_server_process should
+ * be called after each call. Bytes queued while this runs may be left for
+ * the next call
+ * @param ring Ring state
+ * @param xdm xmodem_server to feed
+ * @return Number of bytes consumed
+ */
+size_t xmodem_ring_feed(struct xmodem_ring *ring, struct xmodem_server *xdm);
+
+/**
+ * Get the number of bytes dropped since initialisation. This may be called
+ * from either side
+ */
+size_t xmodem_ring_dropped(const struct xmodem_ring *ring);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
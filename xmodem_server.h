@@ -2,8 +2,9 @@
  * Implementation of the receiver side of the XModem data transfer protocol
  * This implementation has been done as an asynchronous system, so there
  * are no blocking read calls.
- * It does not allocate any dynamic memory, using only ~160B of memory
- * while the transfer is in progress
+ * It does not allocate any dynamic memory, using only ~270B of memory
+ * (~1.2kB with 1K packets, plus any XMODEM_STATS & XMODEM_TRACE_SIZE
+ * additions) while the transfer is in progress
  */
 #ifndef XMODEM_SERVER_H
 #define XMODEM_SERVER_H
@@ -12,6 +13,7 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 
@@ -26,6 +28,144 @@ extern "C" {
 #define XMODEM_MAX_PACKET_SIZE 1024
 #endif
 
+/**
+ * When no tx_byte callback is supplied, response bytes are queued internally
+ * until collected with xmodem_server_pending_tx. Normally there is at most a
+ * CAN sequence or a NAK & 'C' outstanding, so this can be small. If it fills
+ * up, the oldest responses are dropped whole, so a window ACK/NAK is never
+ * separated from its block number. This must be no more than 255
+ */
+#ifndef XMODEM_TX_QUEUE_SIZE
+#define XMODEM_TX_QUEUE_SIZE 8
+#endif
+
+/**
+ * Upper limit on the number of out of order blocks buffered by
+ * xmodem_server_init_window
+ */
+#define XMODEM_MAX_WINDOW_SLOTS 31
+
+/**
+ * Flags for xmodem_server_init_flags
+ * XMODEM_FLAG_YMODEM - Receive a YMODEM batch. Each file starts with a header
+ *   block giving its name & size, which are reported via the
+ *   xmodem_server_set_file_callback callback. Packets returned from
+ *   xmodem_server_process are trimmed to the declared size, and block_num
+ *   restarts from 0 for each file
+ * XMODEM_FLAG_STREAMING - XMODEM-G/YMODEM-G streaming mode, for error-free
+ *   links. The client is started with 'G' instead of 'C', and sends blocks
+ *   back to back without waiting for them to be acknowledged. Any error
+ *   aborts the transfer. Incoming data must be supplied with
+ *   xmodem_server_rx_bytes, calling xmodem_server_process whenever it stops
+ *   at a packet boundary, so that no data is dropped
+ * XMODEM_FLAG_ADAPTIVE - Rather than waiting a fixed second for each packet,
+ *   estimate the time between packets & its variation from the transfer so
+ *   far (as TCP does for round trip times), and time out once a packet is
+ *   well overdue. The timeout is kept between XMODEM_ADAPTIVE_MIN_TIMEOUT &
+ *   XMODEM_ADAPTIVE_MAX_TIMEOUT, and doubles after each timeout in a row
+ */
+#define XMODEM_FLAG_YMODEM (1 << 0)
+#define XMODEM_FLAG_STREAMING (1 << 1)
+#define XMODEM_FLAG_ADAPTIVE (1 << 2)
+
+/**
+ * Bounds on the packet timeout in milliseconds with XMODEM_FLAG_ADAPTIVE.
+ * The minimum should allow for scheduling delays at both ends
+ */
+#ifndef XMODEM_ADAPTIVE_MIN_TIMEOUT
+#define XMODEM_ADAPTIVE_MIN_TIMEOUT 100
+#endif
+#ifndef XMODEM_ADAPTIVE_MAX_TIMEOUT
+#define XMODEM_ADAPTIVE_MAX_TIMEOUT 10000
+#endif
+
+/**
+ * Available CRC implementations. These trade code/table size against speed:
+ * XMODEM_CRC_BITWISE - no tables, 8 shifts per byte. Smallest code size
+ * XMODEM_CRC_TABLE - 512B lookup table, one lookup per byte
+ * XMODEM_CRC_SLICE4 - 2kB of tables, xmodem_server_crc_buf does 4 bytes per lookup round
+ * XMODEM_CRC_SLICE8 - 4kB of tables, xmodem_server_crc_buf does 8 bytes per lookup round
+ * XMODEM_CRC_CLMUL - As SLICE8, but xmodem_server_crc_buf uses carry-less multiply
+ *   instructions (x86-64 PCLMULQDQ or AArch64 PMULL) when the CPU supports them.
+ *   This is checked on the first call, falling back to SLICE8 if unavailable
+ * All tables are const, so they live in flash/rodata and need no initialisation
+ */
+#define XMODEM_CRC_BITWISE 0
+#define XMODEM_CRC_TABLE 1
+#define XMODEM_CRC_SLICE4 2
+#define XMODEM_CRC_SLICE8 3
+#define XMODEM_CRC_CLMUL 4
+
+#ifndef XMODEM_CRC
+#define XMODEM_CRC XMODEM_CRC_BITWISE
+#endif
+
+/**
+ * Set to 1 to keep per-transfer statistics, which can be read with
+ * xmodem_server_get_stats. When 0, nothing is counted and struct
+ * xmodem_server doesn't grow.
+ * This (like XMODEM_TRACE_SIZE) changes the layout of struct xmodem_server,
+ * so everything using it must be built with the same setting as
+ * xmodem_server.c - see xmodem_server_size
+ */
+#ifndef XMODEM_STATS
+#define XMODEM_STATS 0
+#endif
+
+/**
+ * Buckets in the block latency histogram. Bucket 0 counts gaps under 1ms,
+ * and bucket n counts gaps of 2^(n-1) to 2^n - 1 ms, with the last bucket
+ * taking everything longer
+ */
+#define XMODEM_STATS_LATENCY_BUCKETS 16
+
+/**
+ * Number of entries in the flight recorder, which keeps the most recent
+ * state changes, response bytes, timeouts & errors of each transfer for
+ * xmodem_server_trace_save. Each entry takes 4 bytes in struct
+ * xmodem_server, and recording one is a couple of stores, so where memory
+ * allows it can be left enabled (eg: 256). Must be 0 (disabled) or a power
+ * of 2
+ */
+#ifndef XMODEM_TRACE_SIZE
+#define XMODEM_TRACE_SIZE 0
+#endif
+
+/**
+ * Types of flight recorder entry, with what the entry's value holds
+ * XMODEM_TRACE_STATE - The state changed (value is the new xmodem_server_state)
+ * XMODEM_TRACE_TX - A response byte was sent (value is the byte)
+ * XMODEM_TRACE_TIMEOUT - A packet didn't arrive in time (value is the error count)
+ * XMODEM_TRACE_ERROR - Something went wrong (value is an XMODEM_TRACE_ERR_xxx)
+ * XMODEM_TRACE_BLOCK - A packet was delivered (value is the bottom 8 bits of block_num)
+ */
+#define XMODEM_TRACE_STATE 1
+#define XMODEM_TRACE_TX 2
+#define XMODEM_TRACE_TIMEOUT 3
+#define XMODEM_TRACE_ERROR 4
+#define XMODEM_TRACE_BLOCK 5
+
+#define XMODEM_TRACE_ERR_CRC 1 // Packet failed its CRC check
+#define XMODEM_TRACE_ERR_BLOCK_NUM 2 // Unexpected block number
+#define XMODEM_TRACE_ERR_BLOCK_NEG 3 // Block number complement didn't match
+#define XMODEM_TRACE_ERR_HEADER 4 // YMODEM header block was malformed
+#define XMODEM_TRACE_ERR_MAX_ERRORS 5 // Too many errors, so giving up
+
+/**
+ * Saved flight recorder layout, as written by xmodem_server_trace_save. All
+ * fields are little-endian, so it can be decoded on any host:
+ *   "XTRC", version (1 byte), 3 reserved bytes, entry count (4 bytes),
+ *   time of the last xmodem_server_process call in ms (8 bytes), then
+ *   the entries oldest first, each being the bottom 16 bits of the time in
+ *   ms (2 bytes), type (1 byte) & value (1 byte)
+ * Entries are timestamped with the time of the most recent call to
+ * xmodem_server_process, so the full times can be recovered by working
+ * back from the last one
+ */
+#define XMODEM_TRACE_VERSION 1
+#define XMODEM_TRACE_HEADER_LEN 20
+#define XMODEM_TRACE_ENTRY_LEN 4
+
 /**
  * The different states that the internal xmodem state machine may be in
  */
@@ -46,11 +186,64 @@ typedef enum {
 
 struct xmodem_server;
 
+/**
+ * Statistics for a transfer, from xmodem_server_get_stats.
+ * Times are in milliseconds, as given to xmodem_server_process, so are only
+ * as precise as the intervals between calls to it
+ */
+struct xmodem_server_stats {
+	uint64_t bytes_received; // Everything given to xmodem_server_rx_byte/rx_bytes
+	uint64_t bytes_accepted; // Packet data delivered by xmodem_server_process
+	uint64_t bytes_discarded; // Line noise skipped while waiting for SOH/STX/EOT
+	uint32_t blocks_accepted; // Packets delivered by xmodem_server_process
+	uint32_t duplicates; // Intact resends of a block we already had
+	uint32_t crc_errors; // Packets which failed their CRC check
+	uint32_t header_rejects; // Bad or unexpected block number/complement bytes
+	uint32_t timeouts; // Packets which didn't arrive in time
+	uint32_t acks_sent;
+	uint32_t naks_sent;
+	uint32_t cans_sent; // Each abort sends two
+	uint32_t tx_overflows; // Responses dropped whole as the tx queue was full
+	int64_t first_byte_time; // When data first arrived (0 if it hasn't)
+	int64_t eot_time; // When the last EOT arrived (0 if it hasn't)
+	int64_t transfer_time; // eot_time - first_byte_time (-1 until the EOT)
+	uint32_t block_latency[XMODEM_STATS_LATENCY_BUCKETS]; // Time between delivered blocks
+};
+
+/**
+ * A single flight recorder entry
+ */
+struct xmodem_trace_entry {
+	uint16_t time; // Bottom 16 bits of the time in ms
+	uint8_t type; // XMODEM_TRACE_xxx
+	uint8_t value;
+};
+
 /**
  * Callback function to transmit a byte to the xmodem client
  */
 typedef void (*xmodem_tx_byte)(struct xmodem_server *xdm, uint8_t byte, void *cb_data);
 
+/**
+ * Callback function to report the details of the next file in a YMODEM batch
+ * @param xdm xmodem server state
+ * @param name Name of the file. Only valid for the duration of the callback
+ * @param size Declared size of the file in bytes, or -1 if not given. This can
+ *   be used to preallocate storage before the data arrives
+ * @param cb_data user-supplied pointer given to xmodem_server_init
+ */
+typedef void (*xmodem_file_info)(struct xmodem_server *xdm, const char *name, int64_t size, void *cb_data);
+
+/**
+ * Callback function to read the current time, in place of the ms_time
+ * argument to xmodem_server_process
+ * @param xdm xmodem server state
+ * @param cb_data user-supplied pointer given to xmodem_server_init
+ * @return Current time in milliseconds. This must never go backwards, so
+ *   should come from a monotonic clock (eg: CLOCK_MONOTONIC_COARSE)
+ */
+typedef int64_t (*xmodem_clock)(struct xmodem_server *xdm, void *cb_data);
+
 /**
  * This contains the state for the xmodem server.
  * None of its contents should be accessed directly, this structure
@@ -60,31 +253,161 @@ struct xmodem_server {
 	xmodem_server_state state; // What state are we in?
 	uint8_t packet_data[XMODEM_MAX_PACKET_SIZE]; // Incoming packet data
 	int packet_pos; // Where are we up to in this packet
-	uint16_t crc; // Whatis the expected CRC of the incoming packet
+	uint16_t crc; // Running CRC of the incoming packet
 	uint16_t packet_size; // Are we receiving 128B or 1K packets?
 	bool repeating; // Are we receiving a packet that we've already processed?
+	bool borrowed; // Is the caller holding packet_data from xmodem_server_process_borrow?
 	int64_t last_event_time; // When did we last do something interesting?
 	uint32_t block_num; // What block are we up to?
 	uint32_t error_count; // How many errors have we seen?
 	xmodem_tx_byte tx_byte;
 	void *cb_data;
+	uint8_t tx_queue[XMODEM_TX_QUEUE_SIZE]; // Responses waiting to be sent if there is no tx_byte
+	uint8_t tx_queue_len;
+	uint8_t tx_queue_lens[XMODEM_TX_QUEUE_SIZE]; // Bytes left of each queued response, so they are only dropped whole
+	uint8_t tx_queue_count; // Number of responses in tx_queue
+	bool tx_queue_started; // Has part of the first response been collected?
+	uint32_t flags; // XMODEM_FLAG_xxx
+	bool need_header; // YMODEM: Are we waiting for a file header block?
+	int64_t file_size; // YMODEM: Declared size of the current file (-1 if unknown)
+	uint64_t file_offset; // Offset of the next packet within the file
+	uint64_t packet_offset; // Offset of the last packet delivered
+	xmodem_file_info file_info;
+	uint8_t rx_block; // Block number byte of the incoming packet
+	uint8_t *window; // Window mode: storage for blocks which arrive early
+	uint8_t window_slots; // Window mode: how many blocks fit in window (0 if not in window mode)
+	uint8_t window_pos; // Window mode: how far ahead of block_num is the incoming packet
+	uint32_t window_valid; // Window mode: bit n set if block_num + n is held in window
+	uint32_t window_1k; // Window mode: bit n set if that block is 1024 bytes
+	bool from_window; // Window mode: is the packet being processed held in window?
+	uint32_t nak_block; // Window mode: which block did we last ask to be resent
+	xmodem_clock clock; // If set, overrides the ms_time given to xmodem_server_process
+	int32_t srtt8; // Adaptive: smoothed time between packets, in 1/8 ms (0 until measured)
+	int32_t rttvar4; // Adaptive: variation in time between packets, in 1/4 ms
+	uint8_t backoff; // Adaptive: how many timeouts in a row
+	bool rtt_valid; // Adaptive: did the last event end a good packet, so the next one can be timed?
+#if XMODEM_STATS
+	struct xmodem_server_stats stats;
+	int64_t stats_last_block; // When the last block was delivered (0 if none yet)
+	bool stats_eot; // Has an EOT arrived which hasn't been timestamped yet?
+#endif
+#if XMODEM_TRACE_SIZE
+	struct xmodem_trace_entry trace[XMODEM_TRACE_SIZE]; // Flight recorder ring
+	uint32_t trace_pos; // Total entries ever recorded
+	int64_t trace_time; // Time of the last process call, for timestamping entries
+#endif
 };
 
 /**
  * Initialise the internal xmodem server state
  * @param xdm Xmodem server state area to initialise
- * @param tx_byte callback to be called for ACK/NACK bytes
+ * @param tx_byte callback to be called for ACK/NACK bytes. If NULL, responses
+ *   are queued and must be collected with xmodem_server_pending_tx
  * @param cb_data user-supplied pointer to be supplied to the tx_byte function
  * @return < 0 on failure, >= 0 on success
  */
 int xmodem_server_init(struct xmodem_server *xdm, xmodem_tx_byte tx_byte, void *cb_data);
 
+/**
+ * Initialise the internal xmodem server state, with extra options
+ * @param xdm Xmodem server state area to initialise
+ * @param tx_byte callback to be called for ACK/NACK bytes. If NULL, responses
+ *   are queued and must be collected with xmodem_server_pending_tx
+ * @param cb_data user-supplied pointer to be supplied to the callback functions
+ * @param flags Bitmask of XMODEM_FLAG_xxx options
+ * @return < 0 on failure, >= 0 on success
+ */
+int xmodem_server_init_flags(struct xmodem_server *xdm, xmodem_tx_byte tx_byte, void *cb_data, uint32_t flags);
+
+/**
+ * Initialise the internal xmodem server state for windowed (WXmodem style)
+ * receive, which hides the round trip time on high latency links.
+ * The client is started with 'W' followed by '0' + N, where N is the number
+ * of blocks it may send beyond the last one acknowledged. Acknowledgements
+ * are cumulative - ACK followed by a block number covers every block up to
+ * it. NAK followed by a block number asks for that block to be resent.
+ * Blocks which arrive out of order are held in 'window' until they can be
+ * delivered in order via xmodem_server_process.
+ * As with XMODEM_FLAG_STREAMING, incoming data must be supplied with
+ * xmodem_server_rx_bytes. Each response is two bytes, so when they are
+ * queued they should be collected after every xmodem_server_process call
+ * @param xdm Xmodem server state area to initialise
+ * @param tx_byte callback to be called for response bytes. If NULL, responses
+ *   are queued and must be collected with xmodem_server_pending_tx
+ * @param cb_data user-supplied pointer to be supplied to the callback functions
+ * @param window Storage for out of order blocks, XMODEM_MAX_PACKET_SIZE bytes per block.
+ *   This must remain valid for the duration of the transfer
+ * @param window_len Size of window in bytes. At most XMODEM_MAX_WINDOW_SLOTS blocks are used
+ * @return < 0 on failure, >= 0 on success
+ */
+int xmodem_server_init_window(struct xmodem_server *xdm, xmodem_tx_byte tx_byte, void *cb_data, uint8_t *window, size_t window_len);
+
+/**
+ * Set the callback used to report the name & size of each file in a YMODEM batch
+ */
+void xmodem_server_set_file_callback(struct xmodem_server *xdm, xmodem_file_info file_info);
+
+/**
+ * Set a callback to read the time from, rather than relying on the ms_time
+ * passed to xmodem_server_process/xmodem_server_process_borrow (which is
+ * then ignored). Combined with xmodem_server_next_deadline, this lets an
+ * event loop sleep until something is due without tracking time itself
+ */
+void xmodem_server_set_clock(struct xmodem_server *xdm, xmodem_clock clock);
+
+/**
+ * Get the declared size of the file currently being received in a YMODEM batch
+ * @return Size of the file in bytes, or -1 if unknown
+ */
+int64_t xmodem_server_file_size(const struct xmodem_server *xdm);
+
+/**
+ * Get the byte offset within the file of the packet most recently returned
+ * by xmodem_server_process/xmodem_server_process_borrow. Senders may mix
+ * 128B & 1K blocks (sz does near the end of a file), so this should be used
+ * to place the data, rather than block_num * packet size
+ */
+uint64_t xmodem_server_packet_offset(const struct xmodem_server *xdm);
+
 /**
  * Send a single byte to the xmodem state machine
  * @returns true if a packet is now available for processing, false if more data is needed
  */
 bool xmodem_server_rx_byte(struct xmodem_server *xdm, uint8_t byte);
 
+/**
+ * Send a block of bytes to the xmodem state machine. This is equivalent to
+ * calling xmodem_server_rx_byte for each byte, but packet data is copied &
+ * CRC'd in bulk, and line noise while waiting for the next packet is
+ * skipped with a vectorised (SSE2/NEON) scan.
+ * Bytes are only consumed up to the end of the next complete packet (or the
+ * end of the transfer). Once xmodem_server_process has collected that packet,
+ * the remaining bytes should be supplied again
+ * @param xdm xmodem_server state
+ * @param data Incoming bytes
+ * @param len Number of bytes in data
+ * @return Number of bytes consumed from data
+ */
+size_t xmodem_server_rx_bytes(struct xmodem_server *xdm, const uint8_t *data, size_t len);
+
+/**
+ * Get the response bytes waiting to be sent, when no tx_byte callback was
+ * given to xmodem_server_init. These should be checked after each call to
+ * xmodem_server_rx_byte/xmodem_server_rx_bytes/xmodem_server_process,
+ * and can be sent in a single write
+ * @param xdm xmodem_server state
+ * @param len Area to store the number of bytes waiting
+ * @return Pointer to the waiting bytes. Valid until the next call to any other xmodem_server function
+ */
+const uint8_t *xmodem_server_pending_tx(const struct xmodem_server *xdm, size_t *len);
+
+/**
+ * Remove bytes from the response queue once they have been sent
+ * @param xdm xmodem_server state
+ * @param len Number of bytes from the start of xmodem_server_pending_tx that were sent
+ */
+void xmodem_server_tx_done(struct xmodem_server *xdm, size_t len);
+
 /**
  * Determine the current state of the xmodem transfer
  */
@@ -103,23 +426,107 @@ const char *xmodem_server_state_name(const struct xmodem_server *xdm);
  */
 uint16_t xmodem_server_crc(uint16_t crc, uint8_t byte);
 
+/**
+ * Extend the XModem 16-bit CRC over a buffer. This gives the same result as
+ * calling xmodem_server_crc on each byte in turn, but uses the fastest
+ * available implementation (see XMODEM_CRC)
+ * @param crc CRC to extend (0 to start a new CRC)
+ * @param data Data to add to the CRC
+ * @param len Number of bytes in data
+ * @return Updated CRC
+ */
+uint16_t xmodem_server_crc_buf(uint16_t crc, const uint8_t *data, size_t len);
+
 /**
  * Process the internal state and determine if there is a full packet ready
  * This function should be called periodically to correctly process timeouts
  * @param xdm xmodem_server state
  * @param packet Area to store the next decoded packet. Must be at least XMODEM_MAX_PACKET_SIZE long. xdm->packet_size bytes will be copied in here
  * @param block_num Area to store the 0-based index of the extracted block
- * @param ms_time Current time in milliseconds (used to determine timeouts)
- * @return Number of bytes of data copied into 'packet' (either 128, or 1024), or 0 if no new packet is available
+ * @param ms_time Current time in milliseconds (used to determine timeouts). Ignored if xmodem_server_set_clock has been used
+ * @return Number of bytes of data copied into 'packet' (either 128, or 1024, or less at the end of a YMODEM file), or 0 if no new packet is available
  */
 int xmodem_server_process(struct xmodem_server *xdm, uint8_t *packet, uint32_t *block_num, int64_t ms_time);
 
+/**
+ * As for xmodem_server_process, but instead of copying the packet out, provides
+ * direct access to it.
+ * The packet is not acknowledged, and so remains valid, until
+ * xmodem_server_release_packet is called or xmodem_server_process/
+ * xmodem_server_process_borrow is next called. Any data received in the
+ * meantime is ignored
+ * @param xdm xmodem_server state
+ * @param packet Updated to point to the decoded packet
+ * @param block_num Area to store the 0-based index of the extracted block
+ * @param ms_time Current time in milliseconds (used to determine timeouts). Ignored if xmodem_server_set_clock has been used
+ * @return Number of bytes of data available at 'packet' (either 128, or 1024, or less at the end of a YMODEM file), or 0 if no new packet is available
+ */
+int xmodem_server_process_borrow(struct xmodem_server *xdm, const uint8_t **packet, uint32_t *block_num, int64_t ms_time);
+
+/**
+ * Determine when xmodem_server_process next needs to be called, if no more
+ * data arrives. This is when the start character is due to be resent, the
+ * packet timeout expires, or the transfer is due to fail.
+ * This changes whenever data is received or processed, so should be
+ * checked again after each call to xmodem_server_process
+ * @param xdm xmodem_server state
+ * @return Time in milliseconds (on the same clock as the ms_time given to
+ *   xmodem_server_process), 0 if it should be called straight away, or -1
+ *   if the transfer is done
+ */
+int64_t xmodem_server_next_deadline(const struct xmodem_server *xdm);
+
+/**
+ * Determine how many more bytes are needed to complete the frame being
+ * received, eg: to size a read, or to set VMIN on a tty. Between frames,
+ * this is a whole frame of the last packet size seen (128B to begin with)
+ * @param xdm xmodem_server state
+ * @return Number of bytes, or 0 if a packet is waiting for
+ *   xmodem_server_process or the transfer is done
+ */
+int xmodem_server_frame_remaining(const struct xmodem_server *xdm);
+
+/**
+ * Finish with a packet obtained from xmodem_server_process_borrow,
+ * acknowledging it so that the next one can be received
+ */
+void xmodem_server_release_packet(struct xmodem_server *xdm);
+
 /**
  * Determine if the transfer is complete (success or failure)
  * @return true if the transfer has been finished, false otherwise
  */
 bool xmodem_server_is_done(const struct xmodem_server *xdm);
 
+/**
+ * Get the size of struct xmodem_server as xmodem_server.c was built. If this
+ * differs from sizeof(struct xmodem_server), the caller was built with
+ * different XMODEM_STATS or XMODEM_TRACE_SIZE settings, and must not use
+ * the library
+ */
+size_t xmodem_server_size(void);
+
+/**
+ * Get a snapshot of the statistics for the transfer so far
+ * @param xdm xmodem_server state
+ * @param stats Area to store the statistics in
+ * @return < 0 if XMODEM_STATS is not enabled (stats is zeroed), >= 0 on success
+ */
+int xmodem_server_get_stats(const struct xmodem_server *xdm, struct xmodem_server_stats *stats);
+
+/**
+ * Save the flight recorder contents, in the layout described by
+ * XMODEM_TRACE_HEADER_LEN, for decoding with the xmodem_trace tool
+ * @param xdm xmodem_server state
+ * @param buffer Area to save into. At most XMODEM_TRACE_HEADER_LEN +
+ *   XMODEM_TRACE_SIZE * XMODEM_TRACE_ENTRY_LEN bytes are needed. If it is
+ *   smaller, only the most recent entries are kept
+ * @param len Size of buffer
+ * @return Number of bytes saved, or < 0 if XMODEM_TRACE_SIZE is 0 or buffer
+ *   is too small for the header
+ */
+int xmodem_server_trace_save(const struct xmodem_server *xdm, uint8_t *buffer, size_t len);
+
 #ifdef __cplusplus
 }
 #endif
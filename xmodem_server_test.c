@@ -1,12 +1,30 @@
 #define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 700
 
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/select.h>
+#include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
 #include "xmodem_server.h"
+#include "xmodem_client.h"
+#include "zmodem_server.h"
+#include "xmodem_mux.h"
+#include "xmodem_timer.h"
+#include "xmodem_sink.h"
+#include "xmodem_tty.h"
+#include "xmodem_ring.h"
+#include "xmodem_pool.h"
 #include "acutest.h"
 
 static void tx_byte(struct xmodem_server *xdm, uint8_t byte, void *cb_data)
@@ -41,11 +59,37 @@ static bool rx_packet(struct xmodem_server *xdm, const uint8_t *data, int data_l
 	return xmodem_server_rx_byte(xdm, crc & 0xff);
 }
 
+/* Reference bit-at-a-time CRC to check the optimised implementations against */
+static uint16_t crc_ref(uint16_t crc, uint8_t byte)
+{
+	crc ^= (uint16_t)byte << 8;
+	for (int i = 0; i < 8; i++)
+		crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+	return crc;
+}
+
 static int64_t ms_time(void)
 {
-	struct timeval  tv;
-	gettimeofday(&tv, NULL);
-	return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int64_t server_clock(struct xmodem_server *xdm, void *cb_data)
+{
+	(void)xdm;
+	(void)cb_data;
+	return ms_time();
+}
+
+/* How long can we sleep before the server next needs processing? */
+static struct timeval deadline_timeout(const struct xmodem_server *xdm)
+{
+	int64_t deadline = xmodem_server_next_deadline(xdm);
+	int64_t now = ms_time();
+	int64_t wait = deadline > now ? deadline - now : 0;
+	struct timeval tv = {.tv_sec = wait / 1000, .tv_usec = (wait % 1000) * 1000};
+	return tv;
 }
 
 static void test_simple(void) {
@@ -71,6 +115,872 @@ static void test_simple(void) {
 	TEST_ASSERT(xmodem_server_is_done(&xdm));
 }
 
+static void test_crc(void) {
+	uint8_t data[4096 + 16];
+	const uint8_t check[] = "123456789";
+
+	// Standard CRC-16/XMODEM check value
+	TEST_ASSERT(xmodem_server_crc_buf(0, check, 9) == 0x31c3);
+
+	for (int crc = 0; crc < 0x10000; crc += 0x101) {
+		for (int b = 0; b < 256; b++)
+			TEST_ASSERT_(xmodem_server_crc(crc, b) == crc_ref(crc, b), "crc 0x%x byte 0x%x", crc, b);
+	}
+
+	for (size_t i = 0; i < sizeof(data); i++)
+		data[i] = rand();
+	// Compare against the reference across lengths & alignments, so each of the
+	// bulk/tail code paths are covered
+	for (int i = 0; i < 2000; i++) {
+		size_t offset = rand() % 16;
+		size_t len = rand() % (sizeof(data) - offset);
+		uint16_t crc = rand();
+		uint16_t ref = crc;
+		for (size_t j = 0; j < len; j++)
+			ref = crc_ref(ref, data[offset + j]);
+		TEST_ASSERT_(xmodem_server_crc_buf(crc, &data[offset], len) == ref, "offset %zu len %zu", offset, len);
+	}
+}
+
+static uint64_t ns_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void test_rx_latency(void) {
+	struct xmodem_server xdm;
+	uint8_t tx_char = 0;
+	uint8_t frame[3 + 1024 + 2];
+	uint64_t min_cost[XMODEM_STATE_COUNT];
+	uint64_t worst = 0;
+
+	// Track the cheapest rx_byte call seen in each state. Taking the minimum
+	// over many packets filters out pre-emption & cache misses, leaving the
+	// real cost of the work done in that state
+	for (int i = 0; i < XMODEM_STATE_COUNT; i++)
+		min_cost[i] = UINT64_MAX;
+
+	TEST_ASSERT(xmodem_server_init(&xdm, tx_byte, &tx_char) >= 0);
+	for (uint32_t block = 0; block < 200; block++) {
+		uint16_t crc = 0;
+		uint8_t resp[1024];
+		uint32_t block_nr;
+		frame[0] = 0x02;
+		frame[1] = block + 1;
+		frame[2] = (block + 1) ^ 0xff;
+		for (int i = 0; i < 1024; i++) {
+			frame[3 + i] = rand();
+			crc = crc_ref(crc, frame[3 + i]);
+		}
+		frame[3 + 1024] = crc >> 8;
+		frame[3 + 1025] = crc & 0xff;
+		for (size_t i = 0; i < sizeof(frame); i++) {
+			xmodem_server_state state = xmodem_server_get_state(&xdm);
+			uint64_t start = ns_time();
+			xmodem_server_rx_byte(&xdm, frame[i]);
+			uint64_t cost = ns_time() - start;
+			// START is only seen once, on a cold cache, so skip it
+			if (state != XMODEM_STATE_START && cost < min_cost[state])
+				min_cost[state] = cost;
+		}
+		TEST_ASSERT(xmodem_server_process(&xdm, resp, &block_nr, ms_time()) == 1024);
+	}
+	for (int i = 0; i < XMODEM_STATE_COUNT; i++)
+		if (min_cost[i] != UINT64_MAX && min_cost[i] > worst)
+			worst = min_cost[i];
+	// No state should cost more than a handful of data bytes
+	TEST_ASSERT_(worst <= (min_cost[XMODEM_STATE_DATA] + 1) * 10,
+		"worst state %" PRIu64 "ns, data state %" PRIu64 "ns", worst, min_cost[XMODEM_STATE_DATA]);
+}
+
+/* Build a complete XModem frame for data, returning its length */
+static size_t build_frame(uint8_t *frame, const uint8_t *data, int data_len, uint8_t block)
+{
+	uint16_t crc = 0;
+	frame[0] = data_len == 1024 ? 0x02 : 0x01;
+	frame[1] = block;
+	frame[2] = block ^ 0xff;
+	memcpy(&frame[3], data, data_len);
+	for (int i = 0; i < data_len; i++)
+		crc = crc_ref(crc, data[i]);
+	frame[3 + data_len] = crc >> 8;
+	frame[4 + data_len] = crc & 0xff;
+	return data_len + 5;
+}
+
+static void test_rx_bytes(void) {
+	struct xmodem_server xdm;
+	uint8_t tx_char = 0;
+	uint8_t data[6][1024];
+	uint8_t stream[8 * (1024 + 5) + 64];
+	size_t stream_len = 0;
+	int expected = 0;
+	uint64_t offset = 0;
+
+	for (int i = 0; i < 6; i++)
+		for (int j = 0; j < 1024; j++)
+			data[i][j] = rand();
+	// Mix of 128B & 1K packets, with some line noise, a corrupt packet
+	// and a repeated packet
+	stream[stream_len++] = 0x55;
+	stream_len += build_frame(&stream[stream_len], data[0], 1024, 1);
+	stream_len += build_frame(&stream[stream_len], data[1], 128, 2);
+	stream_len += build_frame(&stream[stream_len], data[2], 1024, 3);
+	stream[stream_len - 10] ^= 0x40;
+	stream_len += build_frame(&stream[stream_len], data[2], 1024, 3);
+	stream_len += build_frame(&stream[stream_len], data[2], 1024, 3);
+	stream_len += build_frame(&stream[stream_len], data[3], 128, 4);
+	stream_len += build_frame(&stream[stream_len], data[4], 1024, 5);
+	stream[stream_len++] = 0x04;
+
+	TEST_ASSERT(xmodem_server_init(&xdm, tx_byte, &tx_char) >= 0);
+	for (size_t pos = 0; pos < stream_len && !xmodem_server_is_done(&xdm); ) {
+		uint8_t resp[1024];
+		uint32_t block_nr;
+		int data_len;
+		size_t len = 1 + rand() % 1500;
+		if (len > stream_len - pos)
+			len = stream_len - pos;
+		size_t used = xmodem_server_rx_bytes(&xdm, &stream[pos], len);
+		TEST_ASSERT(used <= len);
+		// We should only stop early at the end of a packet
+		if (used < len)
+			TEST_ASSERT(xmodem_server_get_state(&xdm) == XMODEM_STATE_PROCESS_PACKET);
+		pos += used;
+		data_len = xmodem_server_process(&xdm, resp, &block_nr, ms_time());
+		if (data_len > 0) {
+			TEST_ASSERT(block_nr == (uint32_t)expected);
+			TEST_ASSERT(data_len == ((expected == 1 || expected == 3) ? 128 : 1024));
+			TEST_ASSERT(memcmp(resp, data[expected], data_len) == 0);
+			TEST_ASSERT(xmodem_server_packet_offset(&xdm) == offset);
+			offset += data_len;
+			expected++;
+		}
+	}
+	TEST_ASSERT(expected == 5);
+	TEST_ASSERT(xdm.error_count == 1);
+	TEST_ASSERT(xmodem_server_get_state(&xdm) == XMODEM_STATE_SUCCESSFUL);
+}
+
+/* Line noise which can't be mistaken for SOH/STX/EOT */
+static uint8_t noise_byte(void)
+{
+	uint8_t b;
+	do {
+		b = rand();
+	} while (b == 0x01 || b == 0x02 || b == 0x04);
+	return b;
+}
+
+static void test_frame_remaining(void) {
+	struct xmodem_server xdm;
+	uint8_t data[1024] = {0};
+	uint8_t resp[XMODEM_MAX_PACKET_SIZE];
+	uint8_t frame[1024 + 5];
+	uint32_t block_nr;
+	size_t len;
+
+	// Until a frame turns up, expect a 128B one
+	TEST_ASSERT(xmodem_server_init(&xdm, NULL, NULL) >= 0);
+	TEST_ASSERT(xmodem_server_frame_remaining(&xdm) == 128 + 5);
+	// Line noise doesn't count
+	TEST_ASSERT(xmodem_server_rx_bytes(&xdm, (const uint8_t *)"\x55", 1) == 1);
+	TEST_ASSERT(xmodem_server_frame_remaining(&xdm) == 128 + 5);
+	// Then it counts down, a byte at a time, to the end of the frame
+	len = build_frame(frame, data, sizeof(data), 1);
+	for (size_t i = 0; i < len; i++) {
+		TEST_ASSERT(xmodem_server_rx_bytes(&xdm, &frame[i], 1) == 1);
+		TEST_ASSERT_(xmodem_server_frame_remaining(&xdm) == (int)(len - i - 1), "after %zu bytes: %d",
+			i + 1, xmodem_server_frame_remaining(&xdm));
+	}
+	TEST_ASSERT(xmodem_server_process(&xdm, resp, &block_nr, 1) == sizeof(data));
+	// The next frame is expected to be the same size
+	TEST_ASSERT(xmodem_server_frame_remaining(&xdm) == 1024 + 5);
+	// And an EOT ends the transfer
+	TEST_ASSERT(xmodem_server_rx_bytes(&xdm, (const uint8_t *)"\x04", 1) == 1);
+	xmodem_server_process(&xdm, resp, &block_nr, 1);
+	TEST_ASSERT(xmodem_server_is_done(&xdm));
+	TEST_ASSERT(xmodem_server_frame_remaining(&xdm) == 0);
+}
+
+static void test_rx_noise(void) {
+	static uint8_t stream[16 + 48 + 1024 + 5];
+	struct xmodem_server xdm;
+	uint8_t data[1024];
+	uint8_t resp[XMODEM_MAX_PACKET_SIZE];
+	uint32_t block_nr;
+	uint32_t block = 1;
+	uint64_t noise = 0;
+	size_t len;
+
+	// Noise longer than a vector, ending at every offset within one, with
+	// the stream at every alignment
+	TEST_ASSERT(xmodem_server_init(&xdm, NULL, NULL) >= 0);
+	for (size_t align = 0; align < 16; align++) {
+		for (size_t noise_len = 17; noise_len <= 48; noise_len++, block++) {
+			size_t data_len = block % 2 ? 128 : 1024;
+
+			for (size_t i = 0; i < data_len; i++)
+				data[i] = rand();
+			for (size_t i = 0; i < noise_len; i++)
+				stream[align + i] = noise_byte();
+			len = noise_len + build_frame(&stream[align + noise_len], data, data_len, block);
+			noise += noise_len;
+			TEST_ASSERT(xmodem_server_rx_bytes(&xdm, &stream[align], len) == len);
+			TEST_ASSERT(xmodem_server_process(&xdm, resp, &block_nr, 1) == (int)data_len);
+			TEST_ASSERT(block_nr == block - 1);
+			TEST_ASSERT(memcmp(resp, data, data_len) == 0);
+			xmodem_server_pending_tx(&xdm, &len);
+			xmodem_server_tx_done(&xdm, len);
+		}
+	}
+	// The EOT is found the same way
+	for (size_t i = 0; i < 37; i++)
+		stream[i] = noise_byte();
+	stream[37] = 0x04;
+	noise += 37;
+	TEST_ASSERT(xmodem_server_rx_bytes(&xdm, stream, 38) == 38);
+	xmodem_server_process(&xdm, resp, &block_nr, 1);
+	TEST_ASSERT(xmodem_server_get_state(&xdm) == XMODEM_STATE_SUCCESSFUL);
+#if XMODEM_STATS
+	{
+		struct xmodem_server_stats stats;
+		TEST_ASSERT(xmodem_server_get_stats(&xdm, &stats) >= 0);
+		TEST_CHECK(stats.bytes_discarded == noise);
+	}
+#else
+	(void)noise;
+#endif
+}
+
+static void test_rx_resync(void) {
+	static uint8_t stream[64 * (128 + 5 + 3) + 64 * 40 + 20000];
+	struct xmodem_server xdm;
+	uint8_t data[64][128];
+	size_t stream_len = 0;
+	uint64_t noise = 0;
+	int expected = 0;
+
+	// Noise of every length up to a few vectors, then a long burst, with
+	// some frames having their header rejected first
+	for (int i = 0; i < 64; i++) {
+		int noise_len = i < 40 ? i : 20000 / 24;
+
+		for (int j = 0; j < 128; j++)
+			data[i][j] = rand();
+		for (int j = 0; j < noise_len; j++)
+			stream[stream_len++] = noise_byte();
+		noise += noise_len;
+		if (i % 3 == 0) {
+			// A header with a bad complement
+			stream[stream_len++] = 0x01;
+			stream[stream_len++] = i + 1;
+			stream[stream_len++] = 0x55;
+		}
+		stream_len += build_frame(&stream[stream_len], data[i], 128, i + 1);
+	}
+	stream[stream_len++] = 0x04;
+	TEST_ASSERT(stream_len <= sizeof(stream));
+
+	TEST_ASSERT(xmodem_server_init(&xdm, NULL, NULL) >= 0);
+	for (size_t pos = 0; pos < stream_len && !xmodem_server_is_done(&xdm); ) {
+		uint8_t resp[XMODEM_MAX_PACKET_SIZE];
+		uint32_t block_nr;
+		size_t len = 1 + rand() % 300;
+		size_t tx_len;
+		int data_len;
+
+		if (len > stream_len - pos)
+			len = stream_len - pos;
+		pos += xmodem_server_rx_bytes(&xdm, &stream[pos], len);
+		data_len = xmodem_server_process(&xdm, resp, &block_nr, 1);
+		xmodem_server_pending_tx(&xdm, &tx_len);
+		xmodem_server_tx_done(&xdm, tx_len);
+		if (data_len > 0) {
+			TEST_ASSERT(block_nr == (uint32_t)expected);
+			TEST_ASSERT(memcmp(resp, data[expected], data_len) == 0);
+			expected++;
+		}
+	}
+	TEST_ASSERT(expected == 64);
+	TEST_ASSERT(xmodem_server_get_state(&xdm) == XMODEM_STATE_SUCCESSFUL);
+#if XMODEM_STATS
+	{
+		struct xmodem_server_stats stats;
+		TEST_ASSERT(xmodem_server_get_stats(&xdm, &stats) >= 0);
+		TEST_CHECK_(stats.bytes_discarded == noise, "discarded %" PRIu64 ", expected %" PRIu64,
+			stats.bytes_discarded, noise);
+		TEST_CHECK(stats.bytes_received == stream_len);
+		TEST_CHECK(stats.header_rejects == 22);
+	}
+#else
+	(void)noise;
+#endif
+}
+
+static void check_file(const char *name, const uint8_t *data, size_t len)
+{
+	uint8_t buffer[4096];
+	FILE *fp = fopen(name, "rb");
+
+	TEST_ASSERT(fp != NULL);
+	TEST_ASSERT(fread(buffer, 1, sizeof(buffer), fp) == len);
+	TEST_ASSERT(memcmp(buffer, data, len) == 0);
+	fclose(fp);
+}
+
+static void test_sink(void) {
+	uint8_t data[1024 + 1024 + 128 + 128];
+	// Real file content ends part way through the last block
+	size_t data_len = sizeof(data) - 40;
+	uint8_t stream[4 * (1024 + 5) + 1];
+	size_t stream_len = 0;
+	char name[] = "/tmp/xmodem_sink.XXXXXX";
+	int fd = mkstemp(name);
+
+	TEST_ASSERT(fd >= 0);
+	close(fd);
+	for (size_t i = 0; i < sizeof(data); i++)
+		data[i] = i < data_len ? noise_byte() : 0x1a;
+	// sz falls back to 128B packets for the tail of a file
+	stream_len += build_frame(&stream[stream_len], &data[0], 1024, 1);
+	stream_len += build_frame(&stream[stream_len], &data[1024], 1024, 2);
+	stream_len += build_frame(&stream[stream_len], &data[2048], 128, 3);
+	stream_len += build_frame(&stream[stream_len], &data[2176], 128, 4);
+	stream[stream_len++] = 0x04;
+
+	for (int mode = 0; mode < 4; mode++) {
+		const uint32_t flags[] = {0, XMODEM_SINK_MMAP, XMODEM_SINK_URING, XMODEM_SINK_URING | XMODEM_SINK_DSYNC};
+		static struct xmodem_sink sink;
+		struct xmodem_server xdm;
+		uint8_t tx_char;
+
+		TEST_CASE_("flags 0x%x", flags[mode]);
+		if (xmodem_sink_open(&sink, name, flags[mode]) < 0) {
+			// io_uring may be compiled out, or blocked by seccomp
+			TEST_ASSERT((flags[mode] & XMODEM_SINK_URING) && (errno == ENOTSUP || errno == ENOSYS || errno == EPERM));
+			continue;
+		}
+		TEST_ASSERT(xmodem_server_init(&xdm, tx_byte, &tx_char) >= 0);
+		for (size_t pos = 0; pos < stream_len && !xmodem_server_is_done(&xdm); ) {
+			const uint8_t *packet;
+			uint32_t block_nr;
+			int len;
+
+			pos += xmodem_server_rx_bytes(&xdm, &stream[pos], stream_len - pos);
+			len = xmodem_server_process_borrow(&xdm, &packet, &block_nr, ms_time());
+			if (len > 0) {
+				TEST_ASSERT(xmodem_sink_write(&sink, packet, len, xmodem_server_packet_offset(&xdm)) >= 0);
+				xmodem_server_release_packet(&xdm);
+			}
+		}
+		TEST_ASSERT(xmodem_server_get_state(&xdm) == XMODEM_STATE_SUCCESSFUL);
+		TEST_ASSERT(xmodem_sink_sync(&sink) >= 0);
+		TEST_ASSERT(xmodem_sink_close(&sink, -1) >= 0);
+		check_file(name, data, data_len);
+
+		// A known size (from YMODEM) is used as is
+		TEST_ASSERT(xmodem_sink_open(&sink, name, flags[mode]) >= 0);
+		TEST_ASSERT(xmodem_sink_write(&sink, &data[1024], 1024, 1024) >= 0);
+		TEST_ASSERT(xmodem_sink_write(&sink, &data[0], 1024, 0) >= 0);
+		TEST_ASSERT(xmodem_sink_close(&sink, 1500) >= 0);
+		check_file(name, data, 1500);
+	}
+	unlink(name);
+}
+
+/* Byte i of the stream pushed through the ring */
+static uint8_t ring_byte(size_t i)
+{
+	return i * 131 + (i >> 11);
+}
+
+struct ring_test {
+	struct xmodem_ring ring;
+	size_t total; // Bytes to send
+	bool lossy; // Drop what doesn't fit, rather than waiting
+	size_t queued; // How much the producer managed to queue
+	const uint8_t *stream; // Send this, rather than ring_byte
+	atomic_bool finished; // Has the producer queued everything?
+};
+
+/* Producer thread, queueing in a mix of bytes, copies & spans */
+static void *ring_producer(void *arg)
+{
+	struct ring_test *rt = arg;
+	uint8_t chunk[300];
+	unsigned int seed = 1;
+	size_t sent = 0;
+
+	while (sent < rt->total) {
+		size_t len = 1 + rand_r(&seed) % sizeof(chunk);
+		uint8_t *span;
+		size_t space;
+
+		if (len > rt->total - sent)
+			len = rt->total - sent;
+		if (rt->lossy) {
+			for (size_t i = 0; i < len; i++)
+				chunk[i] = ring_byte(sent + i);
+			rt->queued += xmodem_ring_put(&rt->ring, chunk, len);
+			sent += len;
+			continue;
+		}
+		// Only queue what fits, so nothing is lost
+		space = xmodem_ring_put_span(&rt->ring, &span);
+		if (space == 0) {
+			// Let the consumer in, on a single CPU
+			sched_yield();
+			continue;
+		}
+		if (len > space)
+			len = space;
+		switch (len % 3) {
+		case 0:
+			for (size_t i = 0; i < len; i++)
+				span[i] = rt->stream ? rt->stream[sent + i] : ring_byte(sent + i);
+			xmodem_ring_put_commit(&rt->ring, len);
+			break;
+		case 1:
+			len = 1;
+			xmodem_ring_put_byte(&rt->ring, rt->stream ? rt->stream[sent] : ring_byte(sent));
+			break;
+		default:
+			for (size_t i = 0; i < len; i++)
+				chunk[i] = rt->stream ? rt->stream[sent + i] : ring_byte(sent + i);
+			xmodem_ring_put(&rt->ring, chunk, len);
+		}
+		rt->queued += len;
+		sent += len;
+	}
+	atomic_store(&rt->finished, true);
+	return NULL;
+}
+
+static void test_ring(void) {
+	static struct ring_test rt;
+	static uint8_t buffer[256];
+	pthread_t producer;
+	size_t received = 0;
+	bool in_order = true;
+
+	TEST_ASSERT(xmodem_ring_init(&rt.ring, buffer, 100) < 0);
+
+	// Lossless, with the ring much smaller than the amount sent
+	TEST_ASSERT(xmodem_ring_init(&rt.ring, buffer, sizeof(buffer)) >= 0);
+	rt.total = 16 * 1024 * 1024;
+	TEST_ASSERT(pthread_create(&producer, NULL, ring_producer, &rt) == 0);
+	while (received < rt.total) {
+		const uint8_t *data;
+		size_t len = xmodem_ring_peek(&rt.ring, &data);
+
+		if (len == 0)
+			sched_yield();
+		for (size_t i = 0; i < len; i++)
+			if (data[i] != ring_byte(received + i))
+				in_order = false;
+		xmodem_ring_consume(&rt.ring, len);
+		received += len;
+	}
+	pthread_join(producer, NULL);
+	TEST_ASSERT(in_order);
+	TEST_ASSERT(rt.queued == rt.total);
+	TEST_ASSERT(xmodem_ring_dropped(&rt.ring) == 0);
+
+	// Overflowing, every byte is either received or counted as dropped
+	TEST_ASSERT(xmodem_ring_init(&rt.ring, buffer, sizeof(buffer)) >= 0);
+	rt.lossy = true;
+	rt.queued = 0;
+	atomic_store(&rt.finished, false);
+	received = 0;
+	TEST_ASSERT(pthread_create(&producer, NULL, ring_producer, &rt) == 0);
+	for (int done = 0; !done; ) {
+		const uint8_t *data;
+		size_t len;
+
+		// Check the producer has finished before the final drain
+		done = atomic_load(&rt.finished);
+		while ((len = xmodem_ring_peek(&rt.ring, &data)) > 0) {
+			xmodem_ring_consume(&rt.ring, len);
+			received += len;
+		}
+		sched_yield();
+	}
+	pthread_join(producer, NULL);
+	TEST_ASSERT(rt.queued == received);
+	TEST_ASSERT(received + xmodem_ring_dropped(&rt.ring) == rt.total);
+	TEST_ASSERT(xmodem_ring_dropped(&rt.ring) > 0);
+	xmodem_ring_put_dropped(&rt.ring, 3);
+	TEST_ASSERT(received + xmodem_ring_dropped(&rt.ring) == rt.total + 3);
+}
+
+static void test_ring_server(void) {
+	static struct ring_test rt;
+	static uint8_t buffer[512];
+	static uint8_t stream[40 * (1024 + 5) + 1];
+	static uint8_t data[40][1024];
+	struct xmodem_server xdm;
+	pthread_t producer;
+	uint8_t tx_char = 0;
+	size_t stream_len = 0;
+	uint32_t expected = 0;
+
+	// The protocol thread owns the server, and only sees the data through
+	// the ring, which is much smaller than a packet
+	for (int i = 0; i < 40; i++) {
+		for (int j = 0; j < 1024; j++)
+			data[i][j] = rand();
+		stream_len += build_frame(&stream[stream_len], data[i], i % 3 ? 1024 : 128, i + 1);
+	}
+	stream[stream_len++] = 0x04;
+	TEST_ASSERT(xmodem_ring_init(&rt.ring, buffer, sizeof(buffer)) >= 0);
+	rt.total = stream_len;
+	rt.stream = stream;
+	TEST_ASSERT(xmodem_server_init(&xdm, tx_byte, &tx_char) >= 0);
+	TEST_ASSERT(pthread_create(&producer, NULL, ring_producer, &rt) == 0);
+	while (!xmodem_server_is_done(&xdm)) {
+		uint8_t packet[1024];
+		uint32_t block_nr;
+		int len;
+
+		if (xmodem_ring_feed(&rt.ring, &xdm) == 0)
+			sched_yield();
+		len = xmodem_server_process(&xdm, packet, &block_nr, ms_time());
+		if (len > 0) {
+			TEST_ASSERT(block_nr == expected);
+			TEST_ASSERT(len == (expected % 3 ? 1024 : 128));
+			TEST_ASSERT(memcmp(packet, data[expected], len) == 0);
+			expected++;
+		}
+	}
+	pthread_join(producer, NULL);
+	TEST_ASSERT(xmodem_server_get_state(&xdm) == XMODEM_STATE_SUCCESSFUL);
+	TEST_ASSERT(expected == 40);
+	TEST_ASSERT(xmodem_ring_dropped(&rt.ring) == 0);
+}
+
+static void test_borrow(void) {
+	struct xmodem_server xdm;
+	uint8_t tx_char = 0;
+	uint8_t data[2][1024];
+	const uint8_t *packet;
+	uint32_t block_nr;
+
+	memset(data[0], 0x11, sizeof(data[0]));
+	memset(data[1], 0x22, sizeof(data[1]));
+	TEST_ASSERT(xmodem_server_init(&xdm, tx_byte, &tx_char) >= 0);
+
+	TEST_ASSERT(rx_packet(&xdm, data[0], sizeof(data[0]), 0, 0));
+	tx_char = 0;
+	TEST_ASSERT(xmodem_server_process_borrow(&xdm, &packet, &block_nr, ms_time()) == 1024);
+	TEST_ASSERT(packet != NULL && memcmp(packet, data[0], 1024) == 0);
+	TEST_ASSERT(block_nr == 0);
+	// Nothing is acknowledged until we're finished with it
+	TEST_ASSERT(tx_char == 0);
+	TEST_ASSERT(xmodem_server_process_borrow(&xdm, &packet, &block_nr, ms_time()) == 0);
+	TEST_ASSERT(tx_char == 0x06);
+
+	// Explicit release
+	TEST_ASSERT(rx_packet(&xdm, data[1], sizeof(data[1]), 1, 0));
+	tx_char = 0;
+	TEST_ASSERT(xmodem_server_process_borrow(&xdm, &packet, &block_nr, ms_time()) == 1024);
+	TEST_ASSERT(memcmp(packet, data[1], 1024) == 0);
+	TEST_ASSERT(block_nr == 1);
+	TEST_ASSERT(tx_char == 0);
+	xmodem_server_release_packet(&xdm);
+	TEST_ASSERT(tx_char == 0x06);
+	tx_char = 0;
+	// Releasing twice does nothing
+	xmodem_server_release_packet(&xdm);
+	TEST_ASSERT(tx_char == 0);
+
+	xmodem_server_rx_byte(&xdm, 0x04);
+	TEST_ASSERT(xmodem_server_get_state(&xdm) == XMODEM_STATE_SUCCESSFUL);
+}
+
+static void test_tx_queue(void) {
+	struct xmodem_server xdm;
+	uint8_t data[128] = {0};
+	const uint8_t *pending;
+	uint32_t block_nr;
+	size_t len;
+
+	TEST_ASSERT(xmodem_server_init(&xdm, NULL, NULL) >= 0);
+	pending = xmodem_server_pending_tx(&xdm, &len);
+	TEST_ASSERT(len == 1 && pending[0] == 'C');
+	xmodem_server_tx_done(&xdm, len);
+	xmodem_server_pending_tx(&xdm, &len);
+	TEST_ASSERT(len == 0);
+
+	TEST_ASSERT(rx_packet(&xdm, data, sizeof(data), 0, 0));
+	TEST_ASSERT(xmodem_server_process(&xdm, data, &block_nr, 1) == 128);
+	// Don't collect that ACK, and let the transfer time out so the
+	// responses build up
+	for (int64_t t = 2; !xmodem_server_is_done(&xdm); t += 100)
+		xmodem_server_process(&xdm, data, &block_nr, t);
+	pending = xmodem_server_pending_tx(&xdm, &len);
+	TEST_ASSERT(len == XMODEM_TX_QUEUE_SIZE);
+	// Newest responses are kept, and the CAN sequence is sent as a whole
+	TEST_ASSERT(pending[len - 1] == 0x18 && pending[len - 2] == 0x18);
+	TEST_ASSERT(pending[len - 3] == 0x15);
+	xmodem_server_tx_done(&xdm, 3);
+	pending = xmodem_server_pending_tx(&xdm, &len);
+	TEST_ASSERT(len == XMODEM_TX_QUEUE_SIZE - 3);
+	TEST_ASSERT(pending[len - 1] == 0x18);
+}
+
+/**
+ * Window ACKs are two bytes, so when the queue overflows they must be
+ * dropped whole, or a leftover block number could be read as ACK/NAK/CAN
+ */
+static void test_tx_queue_window(void) {
+	uint8_t window[4 * XMODEM_MAX_PACKET_SIZE];
+	uint8_t data[128];
+	uint8_t frame[3 + 128 + 2];
+	uint8_t packet[XMODEM_MAX_PACKET_SIZE];
+	struct xmodem_server xdm;
+	const uint8_t *pending;
+	uint32_t block_nr;
+	size_t len, pos;
+	uint32_t expected;
+
+	TEST_ASSERT(xmodem_server_init_window(&xdm, NULL, NULL, window, sizeof(window)) >= 0);
+	xmodem_server_pending_tx(&xdm, &len);
+	xmodem_server_tx_done(&xdm, len);
+
+	for (int b = 1; b <= 2 * XMODEM_TX_QUEUE_SIZE; b++) {
+		memset(data, b, sizeof(data));
+		TEST_ASSERT(xmodem_server_rx_bytes(&xdm, frame, build_frame(frame, data, sizeof(data), b)) == sizeof(frame));
+		TEST_ASSERT(xmodem_server_process(&xdm, packet, &block_nr, b) == 128);
+		// Only collect half of the first ACK, so it can't be dropped
+		if (b == 1) {
+			pending = xmodem_server_pending_tx(&xdm, &len);
+			TEST_ASSERT(len == 2 && pending[0] == 0x06 && pending[1] == 1);
+			xmodem_server_tx_done(&xdm, 1);
+		}
+	}
+
+	pending = xmodem_server_pending_tx(&xdm, &len);
+	TEST_ASSERT(len > 1);
+	// The rest of the first ACK, then whole ACKs for increasing blocks,
+	// ending with the latest
+	TEST_ASSERT(pending[0] == 1);
+	TEST_ASSERT((len - 1) % 2 == 0);
+	expected = 1;
+	for (pos = 1; pos < len; pos += 2) {
+		TEST_ASSERT(pending[pos] == 0x06);
+		TEST_ASSERT(pending[pos + 1] > expected);
+		expected = pending[pos + 1];
+	}
+	TEST_ASSERT(expected == 2 * XMODEM_TX_QUEUE_SIZE);
+	// Collecting part of a response keeps the rest of it, even when
+	// another overflow comes along
+	xmodem_server_tx_done(&xdm, 2);
+	pending = xmodem_server_pending_tx(&xdm, &len);
+	expected = pending[0];
+	xmodem_server_tx_done(&xdm, 0);
+	memset(data, 0, sizeof(data));
+	for (int b = 2 * XMODEM_TX_QUEUE_SIZE + 1; b <= 3 * XMODEM_TX_QUEUE_SIZE; b++) {
+		TEST_ASSERT(xmodem_server_rx_bytes(&xdm, frame, build_frame(frame, data, sizeof(data), b)) == sizeof(frame));
+		TEST_ASSERT(xmodem_server_process(&xdm, packet, &block_nr, b) == 128);
+	}
+	pending = xmodem_server_pending_tx(&xdm, &len);
+	TEST_ASSERT(len % 2 == 1 && pending[0] == expected);
+	for (pos = 1; pos < len; pos += 2)
+		TEST_ASSERT(pending[pos] == 0x06);
+	TEST_ASSERT(pending[len - 1] == 3 * XMODEM_TX_QUEUE_SIZE);
+#if XMODEM_STATS
+	{
+		struct xmodem_server_stats stats;
+
+		xmodem_server_get_stats(&xdm, &stats);
+		TEST_ASSERT(stats.tx_overflows > 0);
+	}
+#endif
+}
+
+struct ymodem_file {
+	char name[64];
+	int64_t size;
+	uint8_t *data;
+	size_t received;
+};
+
+struct ymodem_sink {
+	struct ymodem_file files[4];
+	int file_count;
+};
+
+static void ymodem_file_info(struct xmodem_server *xdm, const char *name, int64_t size, void *cb_data)
+{
+	struct ymodem_sink *sink = cb_data;
+	struct ymodem_file *file = &sink->files[sink->file_count++];
+	(void)xdm;
+	TEST_ASSERT(sink->file_count <= 4);
+	TEST_ASSERT(size >= 0);
+	snprintf(file->name, sizeof(file->name), "%s", name);
+	file->size = size;
+	// Declared size lets us allocate the full file up front
+	file->data = malloc(size + 1);
+	file->received = 0;
+}
+
+/**
+ * Feed data into the server, collecting any received YMODEM file data
+ */
+static void ymodem_rx(struct xmodem_server *xdm, struct ymodem_sink *sink, const uint8_t *data, size_t len, int64_t now)
+{
+	size_t pos = 0;
+	do {
+		const uint8_t *packet;
+		uint32_t block_nr;
+		int data_len;
+		if (pos < len)
+			pos += xmodem_server_rx_bytes(xdm, &data[pos], len - pos);
+		data_len = xmodem_server_process_borrow(xdm, &packet, &block_nr, now);
+		if (data_len > 0) {
+			struct ymodem_file *file = &sink->files[sink->file_count - 1];
+			TEST_ASSERT(sink->file_count > 0);
+			// Not block_nr * packet size, as 128B & 1K blocks may be mixed
+			TEST_ASSERT(file->received == xmodem_server_packet_offset(xdm));
+			TEST_ASSERT(file->received + data_len <= (size_t)file->size);
+			memcpy(&file->data[file->received], packet, data_len);
+			file->received += data_len;
+			xmodem_server_release_packet(xdm);
+		}
+	} while (pos < len);
+}
+
+static size_t build_header(uint8_t *frame, const char *name, int64_t size)
+{
+	uint8_t header[128] = {0};
+	if (name)
+		snprintf((char *)header, sizeof(header), "%s%c%" PRId64 " 14327315441 100644", name, 0, size);
+	return build_frame(frame, header, sizeof(header), 0);
+}
+
+static void test_ymodem(void) {
+	struct xmodem_server xdm;
+	struct ymodem_sink sink = {0};
+	uint8_t frame[1024 + 5];
+	uint8_t data[3000];
+	const size_t sizes[] = {3000, 100};
+	const uint8_t *pending;
+	size_t len;
+	int64_t now = 1;
+
+	for (size_t i = 0; i < sizeof(data); i++)
+		data[i] = rand();
+
+	TEST_ASSERT(xmodem_server_init_flags(&xdm, NULL, &sink, XMODEM_FLAG_YMODEM) >= 0);
+	xmodem_server_set_file_callback(&xdm, ymodem_file_info);
+	TEST_ASSERT(xmodem_server_file_size(&xdm) == -1);
+	for (int f = 0; f < 2; f++) {
+		char name[20];
+		sprintf(name, "file%d.bin", f);
+		ymodem_rx(&xdm, &sink, frame, build_header(frame, name, sizes[f]), now++);
+		TEST_ASSERT(sink.file_count == f + 1);
+		TEST_ASSERT(xmodem_server_file_size(&xdm) == (int64_t)sizes[f]);
+		// Header is acknowledged, then we ask for the data
+		pending = xmodem_server_pending_tx(&xdm, &len);
+		TEST_ASSERT(len >= 2 && pending[len - 2] == 0x06 && pending[len - 1] == 'C');
+		xmodem_server_tx_done(&xdm, len);
+		for (size_t pos = 0, block = 1; pos < sizes[f]; pos += 1024, block++) {
+			uint8_t packet[1024];
+			size_t chunk = sizes[f] - pos < 1024 ? sizes[f] - pos : 1024;
+			memset(packet, 0x1a, sizeof(packet));
+			memcpy(packet, &data[pos], chunk);
+			// Some senders use 128B blocks for short files
+			ymodem_rx(&xdm, &sink, frame, build_frame(frame, packet, chunk <= 128 ? 128 : 1024, block), now++);
+		}
+		frame[0] = 0x04;
+		ymodem_rx(&xdm, &sink, frame, 1, now++);
+		TEST_ASSERT(!xmodem_server_is_done(&xdm));
+		pending = xmodem_server_pending_tx(&xdm, &len);
+		TEST_ASSERT(len >= 2 && pending[len - 2] == 0x06 && pending[len - 1] == 'C');
+		xmodem_server_tx_done(&xdm, len);
+	}
+	// Empty header ends the batch
+	ymodem_rx(&xdm, &sink, frame, build_header(frame, NULL, 0), now++);
+	TEST_ASSERT(xmodem_server_get_state(&xdm) == XMODEM_STATE_SUCCESSFUL);
+	pending = xmodem_server_pending_tx(&xdm, &len);
+	TEST_ASSERT(len == 1 && pending[0] == 0x06);
+
+	TEST_ASSERT(sink.file_count == 2);
+	for (int f = 0; f < 2; f++) {
+		char name[20];
+		sprintf(name, "file%d.bin", f);
+		TEST_ASSERT(strcmp(sink.files[f].name, name) == 0);
+		TEST_ASSERT(sink.files[f].received == sizes[f]);
+		TEST_ASSERT(memcmp(sink.files[f].data, data, sizes[f]) == 0);
+		free(sink.files[f].data);
+	}
+}
+
+static void test_ymodem_adaptive(void) {
+	struct xmodem_server xdm;
+	struct ymodem_sink sink = {0};
+	uint8_t frame[1024 + 5];
+	uint8_t data[512];
+	const uint8_t *packet;
+	const uint8_t *pending;
+	uint32_t block_nr;
+	size_t len;
+	int64_t now = 1;
+
+	for (size_t i = 0; i < sizeof(data); i++)
+		data[i] = rand();
+
+	TEST_ASSERT(xmodem_server_init_flags(&xdm, NULL, &sink, XMODEM_FLAG_YMODEM | XMODEM_FLAG_ADAPTIVE) >= 0);
+	xmodem_server_set_file_callback(&xdm, ymodem_file_info);
+	// A quick first file, so the learned timeout is as short as it gets
+	ymodem_rx(&xdm, &sink, frame, build_header(frame, "file0.bin", sizeof(data)), now++);
+	xmodem_server_pending_tx(&xdm, &len);
+	xmodem_server_tx_done(&xdm, len);
+	for (uint32_t block = 1; block <= 4; block++) {
+		ymodem_rx(&xdm, &sink, frame, build_frame(frame, &data[(block - 1) * 128], 128, block), now++);
+		xmodem_server_pending_tx(&xdm, &len);
+		xmodem_server_tx_done(&xdm, len);
+	}
+	frame[0] = 0x04;
+	ymodem_rx(&xdm, &sink, frame, 1, now);
+	pending = xmodem_server_pending_tx(&xdm, &len);
+	TEST_ASSERT(len >= 2 && pending[len - 2] == 0x06 && pending[len - 1] == 'C');
+	xmodem_server_tx_done(&xdm, len);
+
+	// Waiting for the next file, the learned timeout doesn't apply: the 'C'
+	// is resent at the usual interval, rather than a NAK
+	TEST_ASSERT(xmodem_server_process_borrow(&xdm, &packet, &block_nr, now) == 0);
+	TEST_ASSERT(xmodem_server_next_deadline(&xdm) == now + 500 + 1);
+	TEST_ASSERT(xmodem_server_process_borrow(&xdm, &packet, &block_nr, now + 3 * XMODEM_ADAPTIVE_MIN_TIMEOUT) == 0);
+	xmodem_server_pending_tx(&xdm, &len);
+	TEST_ASSERT(len == 0);
+	TEST_ASSERT(xmodem_server_get_state(&xdm) == XMODEM_STATE_START);
+	now = xmodem_server_next_deadline(&xdm);
+	TEST_ASSERT(xmodem_server_process_borrow(&xdm, &packet, &block_nr, now) == 0);
+	pending = xmodem_server_pending_tx(&xdm, &len);
+	TEST_ASSERT(len == 1 && pending[0] == 'C');
+	xmodem_server_tx_done(&xdm, len);
+	TEST_ASSERT(xmodem_server_get_state(&xdm) == XMODEM_STATE_START);
+
+	// So the second file still arrives
+	ymodem_rx(&xdm, &sink, frame, build_header(frame, "file1.bin", 128), now++);
+	TEST_ASSERT(sink.file_count == 2);
+	ymodem_rx(&xdm, &sink, frame, build_frame(frame, data, 128, 1), now++);
+	frame[0] = 0x04;
+	ymodem_rx(&xdm, &sink, frame, 1, now++);
+	ymodem_rx(&xdm, &sink, frame, build_header(frame, NULL, 0), now++);
+	TEST_ASSERT(xmodem_server_get_state(&xdm) == XMODEM_STATE_SUCCESSFUL);
+	TEST_ASSERT(sink.files[0].received == sizeof(data));
+	TEST_ASSERT(memcmp(sink.files[0].data, data, sizeof(data)) == 0);
+	TEST_ASSERT(sink.files[1].received == 128);
+	TEST_ASSERT(memcmp(sink.files[1].data, data, 128) == 0);
+	for (int f = 0; f < 2; f++)
+		free(sink.files[f].data);
+}
+
 static void test_errors(void) {
 	struct xmodem_server xdm;
 	uint8_t tx_char = 0;
@@ -120,36 +1030,761 @@ static void test_timeout(void) {
 	TEST_ASSERT(xmodem_server_get_state(&xdm) == XMODEM_STATE_FAILURE);
 }
 
+static void test_deadline(void) {
+	struct xmodem_server xdm;
+	uint8_t tx_char = 0;
+	uint8_t resp[XMODEM_MAX_PACKET_SIZE];
+	uint32_t block_nr;
+	int calls = 0;
+	TEST_ASSERT(xmodem_server_init(&xdm, tx_byte, &tx_char) >= 0);
+
+	// Nothing has started the timer yet
+	TEST_ASSERT(xmodem_server_next_deadline(&xdm) == 0);
+	xmodem_server_process(&xdm, resp, &block_nr, 1000);
+	TEST_ASSERT(xmodem_server_next_deadline(&xdm) == 1501);
+	// Nothing happens before the deadline
+	tx_char = 0;
+	xmodem_server_process(&xdm, resp, &block_nr, 1500);
+	TEST_ASSERT(tx_char == 0);
+	xmodem_server_process(&xdm, resp, &block_nr, 1501);
+	TEST_ASSERT(tx_char == 'C');
+	TEST_ASSERT(xmodem_server_next_deadline(&xdm) == 2002);
+
+	// A waiting packet needs processing straight away
+	uint8_t data[XMODEM_MAX_PACKET_SIZE] = {0};
+	TEST_ASSERT(rx_packet(&xdm, data, sizeof(data), 0, 0));
+	TEST_ASSERT(xmodem_server_next_deadline(&xdm) == 0);
+	TEST_ASSERT(xmodem_server_process(&xdm, resp, &block_nr, 2100) == sizeof(data));
+	TEST_ASSERT(xmodem_server_next_deadline(&xdm) == 3101);
+
+	// Only calling at the deadlines should time out just as test_timeout does
+	while (!xmodem_server_is_done(&xdm)) {
+		int64_t deadline = xmodem_server_next_deadline(&xdm);
+		TEST_ASSERT(deadline > 0);
+		xmodem_server_process(&xdm, resp, &block_nr, deadline);
+		calls++;
+	}
+	TEST_ASSERT(calls <= XMODEM_TX_QUEUE_SIZE + 10);
+	TEST_ASSERT(xmodem_server_get_state(&xdm) == XMODEM_STATE_FAILURE);
+	TEST_ASSERT(xmodem_server_next_deadline(&xdm) == -1);
+}
+
 /**
- * Spawn a process using fork/exec and get back the file descriptos to
- * read/write from it
+ * Feed packets to a server every 'interval' ms, only calling
+ * xmodem_server_process when a packet arrives or a deadline is due
+ * @return How many errors (timeouts) the server saw
  */
-static pid_t spawn_process(char * const args[], int *rd_fd, int *wr_fd)
+static int adaptive_transfer(struct xmodem_server *xdm, int packets, int64_t interval, int64_t *now)
 {
-	pid_t pid;
-	int pipeto[2];
-	int pipefrom[2];
-
-	if (pipe(pipeto) < 0)
-		return -1;
+	uint8_t data[128] = {0};
+	uint8_t resp[XMODEM_MAX_PACKET_SIZE];
+	uint32_t block_nr;
+	uint32_t errors = xdm->error_count;
 
-	if (pipe(pipefrom) < 0) {
-		close(pipeto[0]);
-		close(pipeto[1]);
-		return -1;
+	for (int i = 0; i < packets && !xmodem_server_is_done(xdm); i++) {
+		int64_t arrival = *now + interval;
+		while (xmodem_server_next_deadline(xdm) <= arrival && !xmodem_server_is_done(xdm)) {
+			xmodem_server_process(xdm, resp, &block_nr, xmodem_server_next_deadline(xdm));
+		}
+		*now = arrival;
+		rx_packet(xdm, data, sizeof(data), i, 0);
+		xmodem_server_process(xdm, resp, &block_nr, *now);
 	}
+	return xdm->error_count - errors;
+}
 
-	pid = fork();
-	if  (pid < 0) {
-		close(pipeto[0]);
-		close(pipeto[1]);
-		close(pipefrom[0]);
-		close(pipefrom[1]);
-		return -1;
-	}
+static void test_adaptive(void) {
+	struct xmodem_server xdm;
+	uint8_t tx_char = 0;
+	uint8_t data[128] = {0};
+	uint8_t resp[XMODEM_MAX_PACKET_SIZE];
+	uint32_t block_nr;
+	int64_t now = 1000;
 
-	if (pid == 0) {
-		/* dup pipe read/write to stdin/stdout */
+	// A fixed timeout times out every packet on a slow link, and soon fails
+	TEST_ASSERT(xmodem_server_init(&xdm, tx_byte, &tx_char) >= 0);
+	xmodem_server_process(&xdm, resp, &block_nr, now);
+	TEST_ASSERT(adaptive_transfer(&xdm, 20, 1500, &now) >= 10);
+	TEST_ASSERT(xmodem_server_get_state(&xdm) == XMODEM_STATE_FAILURE);
+
+	// Whereas the adaptive one backs off, then learns the packet rate
+	now = 1000;
+	TEST_ASSERT(xmodem_server_init_flags(&xdm, tx_byte, &tx_char, XMODEM_FLAG_ADAPTIVE) >= 0);
+	xmodem_server_process(&xdm, resp, &block_nr, now);
+	TEST_ASSERT(adaptive_transfer(&xdm, 20, 1500, &now) == 1);
+	TEST_ASSERT(!xmodem_server_is_done(&xdm));
+	TEST_ASSERT(xmodem_server_next_deadline(&xdm) > now + 1500);
+
+	// On a fast link, a lost packet is noticed quickly
+	now = 1000;
+	TEST_ASSERT(xmodem_server_init_flags(&xdm, tx_byte, &tx_char, XMODEM_FLAG_ADAPTIVE) >= 0);
+	xmodem_server_process(&xdm, resp, &block_nr, now);
+	TEST_ASSERT(adaptive_transfer(&xdm, 10, 20, &now) == 0);
+	TEST_ASSERT(xmodem_server_next_deadline(&xdm) == now + XMODEM_ADAPTIVE_MIN_TIMEOUT + 1);
+	// Backing off each time it goes unanswered
+	tx_char = 0;
+	now = xmodem_server_next_deadline(&xdm);
+	xmodem_server_process(&xdm, resp, &block_nr, now);
+	TEST_ASSERT(tx_char == 0x15);
+	TEST_ASSERT(xmodem_server_next_deadline(&xdm) == now + 2 * XMODEM_ADAPTIVE_MIN_TIMEOUT + 1);
+	now = xmodem_server_next_deadline(&xdm);
+	xmodem_server_process(&xdm, resp, &block_nr, now);
+	TEST_ASSERT(xmodem_server_next_deadline(&xdm) == now + 4 * XMODEM_ADAPTIVE_MIN_TIMEOUT + 1);
+	// The resent packet isn't timed, so the backoff stays until the one after
+	now += 20;
+	TEST_ASSERT(rx_packet(&xdm, data, sizeof(data), 10, 0));
+	TEST_ASSERT(xmodem_server_process(&xdm, resp, &block_nr, now) == sizeof(data));
+	TEST_ASSERT(xmodem_server_next_deadline(&xdm) == now + 4 * XMODEM_ADAPTIVE_MIN_TIMEOUT + 1);
+	now += 20;
+	TEST_ASSERT(rx_packet(&xdm, data, sizeof(data), 11, 0));
+	TEST_ASSERT(xmodem_server_process(&xdm, resp, &block_nr, now) == sizeof(data));
+	TEST_ASSERT(xmodem_server_next_deadline(&xdm) == now + XMODEM_ADAPTIVE_MIN_TIMEOUT + 1);
+}
+
+static int64_t fake_time;
+
+static int64_t fake_clock(struct xmodem_server *xdm, void *cb_data)
+{
+	(void)xdm;
+	(void)cb_data;
+	return fake_time;
+}
+
+static void test_clock(void) {
+	struct xmodem_server xdm;
+	uint8_t tx_char = 0;
+	uint8_t resp[XMODEM_MAX_PACKET_SIZE];
+	uint32_t block_nr;
+	TEST_ASSERT(xmodem_server_init(&xdm, tx_byte, &tx_char) >= 0);
+	xmodem_server_set_clock(&xdm, fake_clock);
+
+	// The time given to process is ignored in favour of the clock
+	fake_time = 5000;
+	xmodem_server_process(&xdm, resp, &block_nr, 123456);
+	TEST_ASSERT(xmodem_server_next_deadline(&xdm) == 5501);
+	tx_char = 0;
+	xmodem_server_process(&xdm, resp, &block_nr, 123456);
+	TEST_ASSERT(tx_char == 0);
+	fake_time = xmodem_server_next_deadline(&xdm);
+	xmodem_server_process(&xdm, resp, &block_nr, 0);
+	TEST_ASSERT(tx_char == 'C');
+	TEST_ASSERT(xmodem_server_next_deadline(&xdm) == fake_time + 501);
+
+	// Once started, waking only at each deadline still times the transfer out
+	uint8_t data[XMODEM_MAX_PACKET_SIZE] = {0};
+	TEST_ASSERT(rx_packet(&xdm, data, sizeof(data), 0, 0));
+	TEST_ASSERT(xmodem_server_process(&xdm, resp, &block_nr, 0) == sizeof(data));
+	while (!xmodem_server_is_done(&xdm)) {
+		fake_time = xmodem_server_next_deadline(&xdm);
+		xmodem_server_process(&xdm, resp, &block_nr, 0);
+	}
+	TEST_ASSERT(xmodem_server_get_state(&xdm) == XMODEM_STATE_FAILURE);
+}
+
+struct timer_check {
+	struct xmodem_timer timer;
+	int64_t fired_at;
+	int fire_count;
+};
+
+static int64_t timer_now;
+
+static void timer_fired(struct xmodem_timer *timer, void *cb_data)
+{
+	struct timer_check *check = (struct timer_check *)timer;
+	(void)cb_data;
+	check->fired_at = timer_now;
+	check->fire_count++;
+}
+
+static void test_stats(void) {
+	struct xmodem_server xdm;
+	struct xmodem_server_stats stats;
+	uint8_t data[128];
+	uint8_t frame[133];
+	uint8_t resp[XMODEM_MAX_PACKET_SIZE];
+	const uint8_t noise[3] = {'x', 'y', 'z'};
+	const uint8_t bad_header[3] = {0x01, 2, 0x55};
+	const uint8_t eot = 0x04;
+	uint32_t block_nr;
+	uint64_t received = 0;
+	size_t len;
+
+	// Stats change the layout, so the library must agree with us about it
+	TEST_ASSERT(xmodem_server_size() == sizeof(xdm));
+	TEST_ASSERT(xmodem_server_init(&xdm, NULL, NULL) >= 0);
+#if XMODEM_STATS
+	xmodem_server_process(&xdm, resp, &block_nr, 1000);
+	TEST_ASSERT(xmodem_server_get_stats(&xdm, &stats) >= 0);
+	TEST_ASSERT(stats.first_byte_time == 0);
+	TEST_ASSERT(stats.transfer_time == -1);
+
+	// Line noise, then block 1
+	received += xmodem_server_rx_bytes(&xdm, noise, sizeof(noise));
+	memset(data, 1, sizeof(data));
+	len = build_frame(frame, data, sizeof(data), 1);
+	received += xmodem_server_rx_bytes(&xdm, frame, len);
+	TEST_ASSERT(xmodem_server_process(&xdm, resp, &block_nr, 1010) == 128);
+
+	// Block 2 corrupted, with a bad header, then intact
+	memset(data, 2, sizeof(data));
+	len = build_frame(frame, data, sizeof(data), 2);
+	frame[50] ^= 0xff;
+	received += xmodem_server_rx_bytes(&xdm, frame, len);
+	xmodem_server_process(&xdm, resp, &block_nr, 1015);
+	received += xmodem_server_rx_bytes(&xdm, bad_header, sizeof(bad_header));
+	frame[50] ^= 0xff;
+	received += xmodem_server_rx_bytes(&xdm, frame, len);
+	TEST_ASSERT(xmodem_server_process(&xdm, resp, &block_nr, 1030) == 128);
+
+	// Nothing for a while, then a repeat of block 2 & the end
+	xmodem_server_process(&xdm, resp, &block_nr, 2100);
+	received += xmodem_server_rx_bytes(&xdm, frame, len);
+	xmodem_server_process(&xdm, resp, &block_nr, 2105);
+	received += xmodem_server_rx_bytes(&xdm, &eot, 1);
+	xmodem_server_process(&xdm, resp, &block_nr, 2110);
+	TEST_ASSERT(xmodem_server_get_state(&xdm) == XMODEM_STATE_SUCCESSFUL);
+
+	TEST_ASSERT(xmodem_server_get_stats(&xdm, &stats) >= 0);
+	TEST_CHECK(stats.bytes_received == received);
+	TEST_CHECK(stats.bytes_accepted == 256);
+	TEST_CHECK(stats.bytes_discarded == sizeof(noise));
+	TEST_CHECK(stats.blocks_accepted == 2);
+	TEST_CHECK(stats.duplicates == 1);
+	TEST_CHECK(stats.crc_errors == 1);
+	TEST_CHECK(stats.header_rejects == 1);
+	TEST_CHECK(stats.timeouts == 1);
+	TEST_CHECK(stats.acks_sent == 3);
+	TEST_CHECK(stats.naks_sent == 2);
+	TEST_CHECK(stats.cans_sent == 0);
+	TEST_CHECK(stats.first_byte_time == 1010);
+	TEST_CHECK(stats.eot_time == 2110);
+	TEST_CHECK(stats.transfer_time == 1100);
+	// 20ms between the blocks
+	for (int i = 0; i < XMODEM_STATS_LATENCY_BUCKETS; i++)
+		TEST_CHECK_(stats.block_latency[i] == (i == 5 ? 1u : 0u), "bucket %d: %u", i, stats.block_latency[i]);
+#else
+	(void)data;
+	(void)frame;
+	(void)resp;
+	(void)noise;
+	(void)bad_header;
+	(void)eot;
+	(void)block_nr;
+	(void)received;
+	(void)len;
+	TEST_ASSERT(xmodem_server_get_stats(&xdm, &stats) < 0);
+	TEST_ASSERT(stats.blocks_accepted == 0);
+#endif
+}
+
+static void test_trace(void) {
+	struct xmodem_server xdm;
+	uint8_t data[128];
+	uint8_t frame[133];
+	uint8_t resp[XMODEM_MAX_PACKET_SIZE];
+	uint8_t trace[XMODEM_TRACE_HEADER_LEN + (XMODEM_TRACE_SIZE + 1) * XMODEM_TRACE_ENTRY_LEN];
+	uint32_t block_nr;
+	size_t len;
+	int saved;
+
+	TEST_ASSERT(xmodem_server_init(&xdm, NULL, NULL) >= 0);
+	xmodem_server_process(&xdm, resp, &block_nr, 0x12345);
+	memset(data, 1, sizeof(data));
+	len = build_frame(frame, data, sizeof(data), 1);
+	frame[10] ^= 1;
+	xmodem_server_rx_bytes(&xdm, frame, len);
+	xmodem_server_process(&xdm, resp, &block_nr, 0x12346);
+	frame[10] ^= 1;
+	xmodem_server_rx_bytes(&xdm, frame, len);
+	TEST_ASSERT(xmodem_server_process(&xdm, resp, &block_nr, 0x12350) == 128);
+
+	saved = xmodem_server_trace_save(&xdm, trace, sizeof(trace));
+#if XMODEM_TRACE_SIZE
+	{
+		// What should be at the end of the trace: the error, NAK, resend & ACK
+		static const uint8_t expected[][2] = {
+			{XMODEM_TRACE_ERROR, XMODEM_TRACE_ERR_CRC},
+			{XMODEM_TRACE_STATE, XMODEM_STATE_SOH},
+			{XMODEM_TRACE_TX, 0x15},
+			{XMODEM_TRACE_STATE, XMODEM_STATE_BLOCK_NUM},
+			{XMODEM_TRACE_STATE, XMODEM_STATE_BLOCK_NEG},
+			{XMODEM_TRACE_STATE, XMODEM_STATE_DATA},
+			{XMODEM_TRACE_STATE, XMODEM_STATE_PROCESS_PACKET},
+			{XMODEM_TRACE_BLOCK, 0},
+			{XMODEM_TRACE_STATE, XMODEM_STATE_SOH},
+			{XMODEM_TRACE_TX, 0x06},
+		};
+		const int count = sizeof(expected) / sizeof(expected[0]);
+		uint32_t entries;
+		const uint8_t *entry;
+
+		TEST_ASSERT(saved > XMODEM_TRACE_HEADER_LEN);
+		TEST_ASSERT(memcmp(trace, "XTRC", 4) == 0);
+		TEST_ASSERT(trace[4] == XMODEM_TRACE_VERSION);
+		entries = trace[8] | trace[9] << 8 | trace[10] << 16 | (uint32_t)trace[11] << 24;
+		TEST_ASSERT(saved == XMODEM_TRACE_HEADER_LEN + (int)entries * XMODEM_TRACE_ENTRY_LEN);
+		TEST_ASSERT(entries >= (uint32_t)count);
+		TEST_ASSERT(trace[12] == 0x50 && trace[13] == 0x23 && trace[14] == 0x01);
+		// The first entry is the initial 'C'
+		if (entries < XMODEM_TRACE_SIZE)
+			TEST_CHECK(trace[XMODEM_TRACE_HEADER_LEN + 2] == XMODEM_TRACE_TX && trace[XMODEM_TRACE_HEADER_LEN + 3] == 'C');
+		entry = &trace[saved - count * XMODEM_TRACE_ENTRY_LEN];
+		for (int i = 0; i < count; i++, entry += XMODEM_TRACE_ENTRY_LEN)
+			TEST_CHECK_(entry[2] == expected[i][0] && entry[3] == expected[i][1],
+				"entry %d: %d/%d", i, entry[2], entry[3]);
+		// The CRC error was noticed during the rx_bytes after the 0x12345 process call
+		entry = &trace[saved - count * XMODEM_TRACE_ENTRY_LEN];
+		TEST_CHECK((entry[0] | entry[1] << 8) == 0x2345);
+
+		// Only the most recent entries are kept if the buffer is small
+		saved = xmodem_server_trace_save(&xdm, trace, XMODEM_TRACE_HEADER_LEN + 2 * XMODEM_TRACE_ENTRY_LEN);
+		TEST_ASSERT(saved == XMODEM_TRACE_HEADER_LEN + 2 * XMODEM_TRACE_ENTRY_LEN);
+		TEST_CHECK(trace[XMODEM_TRACE_HEADER_LEN + 6] == XMODEM_TRACE_TX && trace[XMODEM_TRACE_HEADER_LEN + 7] == 0x06);
+		TEST_ASSERT(xmodem_server_trace_save(&xdm, trace, XMODEM_TRACE_HEADER_LEN - 1) < 0);
+	}
+#else
+	TEST_ASSERT(saved < 0);
+#endif
+}
+
+static void test_timer(void) {
+	enum { TIMERS = 2000 };
+	static struct xmodem_timer_wheel wheel;
+	static struct timer_check checks[TIMERS];
+	const int64_t start = 123456789;
+	int64_t prev = start - 1;
+	int expected = 0;
+	int fired = 0;
+
+	xmodem_timer_wheel_init(&wheel, start);
+	TEST_ASSERT(xmodem_timer_next(&wheel) == -1);
+	for (int i = 0; i < TIMERS; i++) {
+		// Mostly protocol sized timeouts, with some past the top of the wheel
+		int64_t range = i % 8 == 0 ? 20 * 3600 * 1000LL : 5000;
+		xmodem_timer_init(&checks[i].timer);
+		xmodem_timer_add(&wheel, &checks[i].timer, start + (int64_t)(rand() % 1000000) * range / 1000000);
+		// Moving a timer should only leave it pending once
+		if (i % 5 == 0)
+			xmodem_timer_add(&wheel, &checks[i].timer, start + rand() % range);
+	}
+	for (int i = 0; i < TIMERS; i += 7)
+		xmodem_timer_del(&wheel, &checks[i].timer);
+	for (int i = 0; i < TIMERS; i++)
+		if (xmodem_timer_pending(&checks[i].timer))
+			expected++;
+
+	// Jump about in steps, so the wheel has to skip & cascade
+	timer_now = start;
+	while (xmodem_timer_next(&wheel) >= 0) {
+		int64_t next = xmodem_timer_next(&wheel);
+		TEST_ASSERT(next >= prev + 1);
+		timer_now += 1 + (rand() % 3 ? rand() % 50 : rand() % 100000);
+		fired += xmodem_timer_expire(&wheel, timer_now, timer_fired, NULL);
+		for (int i = 0; i < TIMERS; i++) {
+			struct timer_check *check = &checks[i];
+			if (check->fire_count && check->fired_at == timer_now) {
+				// Fired at the first chance after it expired
+				TEST_ASSERT(check->timer.expires <= timer_now);
+				TEST_ASSERT(check->timer.expires > prev);
+			}
+		}
+		prev = timer_now;
+	}
+	TEST_ASSERT(fired == expected);
+	for (int i = 0; i < TIMERS; i++) {
+		TEST_ASSERT(checks[i].fire_count == (i % 7 == 0 ? 0 : 1));
+		TEST_ASSERT(!xmodem_timer_pending(&checks[i].timer));
+	}
+}
+
+/**
+ * Spawn a process using fork/exec and get back the file descriptos to
+ * read/write from it
+ */
+static void test_streaming(void) {
+	uint8_t input_data[10 * 1024];
+	uint8_t output_data[sizeof(input_data)];
+	struct xmodem_client client;
+	struct xmodem_server server;
+	const uint8_t *pending;
+	size_t len;
+	int acks = 0;
+
+	for (size_t i = 0; i < sizeof(input_data); i++)
+		input_data[i] = rand();
+	TEST_ASSERT(xmodem_client_init_mem(&client, 1024, input_data, sizeof(input_data)) >= 0);
+	TEST_ASSERT(xmodem_server_init_flags(&server, NULL, NULL, XMODEM_FLAG_STREAMING) >= 0);
+	pending = xmodem_server_pending_tx(&server, &len);
+	TEST_ASSERT(len == 1 && pending[0] == 'G');
+	xmodem_client_rx_byte(&client, 'G');
+	xmodem_server_tx_done(&server, len);
+
+	// The client should stream the whole file without hearing back from us
+	for (int64_t now = 1; !xmodem_server_is_done(&server); now++) {
+		const uint8_t *packet;
+		uint32_t block_nr;
+		int data_len;
+
+		TEST_ASSERT(now < 1000);
+		xmodem_client_process(&client, now);
+		pending = xmodem_client_pending_tx(&client, &len);
+		if (len > 0)
+			xmodem_client_tx_done(&client, xmodem_server_rx_bytes(&server, pending, len));
+		data_len = xmodem_server_process_borrow(&server, &packet, &block_nr, now);
+		if (data_len > 0) {
+			TEST_ASSERT(block_nr < sizeof(input_data) / 1024);
+			memcpy(&output_data[block_nr * 1024], packet, data_len);
+			xmodem_server_release_packet(&server);
+		}
+		pending = xmodem_server_pending_tx(&server, &len);
+		for (size_t i = 0; i < len; i++) {
+			acks += pending[i] == 0x06;
+			xmodem_client_rx_byte(&client, pending[i]);
+		}
+		xmodem_server_tx_done(&server, len);
+	}
+	// Only the EOT is acknowledged
+	TEST_ASSERT(acks == 1);
+	TEST_ASSERT(xmodem_client_get_state(&client) == XMODEM_CLIENT_STATE_SUCCESSFUL);
+	TEST_ASSERT(xmodem_server_get_state(&server) == XMODEM_STATE_SUCCESSFUL);
+	TEST_ASSERT(memcmp(input_data, output_data, sizeof(input_data)) == 0);
+
+	// A single corrupt block aborts the transfer, as nothing will be resent
+	uint8_t frame[3 + XMODEM_MAX_PACKET_SIZE + 2];
+	uint8_t resp[XMODEM_MAX_PACKET_SIZE];
+	uint32_t block_nr;
+	TEST_ASSERT(xmodem_server_init_flags(&server, NULL, NULL, XMODEM_FLAG_STREAMING) >= 0);
+	xmodem_server_tx_done(&server, 1);
+	len = build_frame(frame, input_data, 1024, 1);
+	TEST_ASSERT(xmodem_server_rx_bytes(&server, frame, len) == len);
+	TEST_ASSERT(xmodem_server_process(&server, resp, &block_nr, 1) == 1024);
+	len = build_frame(frame, &input_data[1024], 1024, 2);
+	frame[100] ^= 0x10;
+	TEST_ASSERT(xmodem_server_rx_bytes(&server, frame, len) == len);
+	TEST_ASSERT(xmodem_server_process(&server, resp, &block_nr, 2) == 0);
+	TEST_ASSERT(xmodem_server_get_state(&server) == XMODEM_STATE_FAILURE);
+	pending = xmodem_server_pending_tx(&server, &len);
+	TEST_ASSERT(len == 2 && pending[0] == 0x18 && pending[1] == 0x18);
+}
+
+static void zmodem_sink_file_info(struct zmodem_server *zdm, const char *name, int64_t size, void *cb_data)
+{
+	struct ymodem_sink *sink = cb_data;
+	struct ymodem_file *file = &sink->files[sink->file_count++];
+	(void)zdm;
+	TEST_ASSERT(sink->file_count <= 4);
+	TEST_ASSERT(size >= 0);
+	snprintf(file->name, sizeof(file->name), "%s", name);
+	file->size = size;
+	file->data = malloc(size + 1);
+	file->received = 0;
+}
+
+/**
+ * Feed data into the server, collecting any received ZMODEM file data
+ */
+static void zmodem_rx(struct zmodem_server *zdm, struct ymodem_sink *sink, const uint8_t *data, size_t len, int64_t now)
+{
+	size_t pos = 0;
+	do {
+		const uint8_t *packet;
+		uint64_t offset;
+		int data_len;
+		if (pos < len)
+			pos += zmodem_server_rx_bytes(zdm, &data[pos], len - pos);
+		data_len = zmodem_server_process_borrow(zdm, &packet, &offset, now);
+		if (data_len > 0) {
+			struct ymodem_file *file = &sink->files[sink->file_count - 1];
+			TEST_ASSERT(sink->file_count > 0);
+			TEST_ASSERT(offset == file->received);
+			TEST_ASSERT(offset + data_len <= (uint64_t)file->size);
+			memcpy(&file->data[offset], packet, data_len);
+			file->received += data_len;
+			zmodem_server_release_packet(zdm);
+		}
+	} while (pos < len && !zmodem_server_is_done(zdm));
+}
+
+/* Escape a byte the same way as lrzsz sz */
+static size_t zm_escape(uint8_t *out, uint8_t byte)
+{
+	switch (byte) {
+	case 0x10: case 0x11: case 0x13: case 0x18:
+	case 0x90: case 0x91: case 0x93:
+		out[0] = 0x18;
+		out[1] = byte ^ 0x40;
+		return 2;
+	}
+	out[0] = byte;
+	return 1;
+}
+
+static size_t zm_hex_header(uint8_t *frame, uint8_t type, uint32_t pos)
+{
+	uint8_t hdr[7] = {type, pos, pos >> 8, pos >> 16, pos >> 24};
+	uint16_t crc = 0;
+	for (int i = 0; i < 5; i++)
+		crc = crc_ref(crc, hdr[i]);
+	hdr[5] = crc >> 8;
+	hdr[6] = crc & 0xff;
+	sprintf((char *)frame, "**\x18" "B");
+	for (int i = 0; i < 7; i++)
+		sprintf((char *)&frame[4 + i * 2], "%02x", hdr[i]);
+	memcpy(&frame[18], "\r\x8a\x11", 3);
+	return 21;
+}
+
+static size_t zm_bin_header(uint8_t *frame, bool crc32, uint8_t type, uint32_t pos)
+{
+	uint8_t hdr[9] = {type, pos, pos >> 8, pos >> 16, pos >> 24};
+	size_t len = 0, hdr_len = 7;
+
+	frame[len++] = '*';
+	frame[len++] = 0x18;
+	frame[len++] = crc32 ? 'C' : 'A';
+	if (crc32) {
+		uint32_t crc = ~zmodem_server_crc32_buf(0xffffffff, hdr, 5);
+		for (int i = 0; i < 4; i++)
+			hdr[5 + i] = crc >> (i * 8);
+		hdr_len = 9;
+	} else {
+		uint16_t crc = 0;
+		for (int i = 0; i < 5; i++)
+			crc = crc_ref(crc, hdr[i]);
+		hdr[5] = crc >> 8;
+		hdr[6] = crc & 0xff;
+	}
+	for (size_t i = 0; i < hdr_len; i++)
+		len += zm_escape(&frame[len], hdr[i]);
+	return len;
+}
+
+static size_t zm_subpacket(uint8_t *frame, bool crc32, const uint8_t *data, size_t data_len, uint8_t end)
+{
+	size_t len = 0;
+
+	for (size_t i = 0; i < data_len; i++)
+		len += zm_escape(&frame[len], data[i]);
+	frame[len++] = 0x18;
+	frame[len++] = end;
+	if (crc32) {
+		uint32_t crc = zmodem_server_crc32_buf(0xffffffff, data, data_len);
+		crc = ~zmodem_server_crc32_buf(crc, &end, 1);
+		for (int i = 0; i < 4; i++)
+			len += zm_escape(&frame[len], crc >> (i * 8));
+	} else {
+		uint16_t crc = 0;
+		for (size_t i = 0; i < data_len; i++)
+			crc = crc_ref(crc, data[i]);
+		crc = crc_ref(crc, end);
+		len += zm_escape(&frame[len], crc >> 8);
+		len += zm_escape(&frame[len], crc & 0xff);
+	}
+	return len;
+}
+
+/**
+ * Pull the first hex header out of the server's responses
+ * @return Header type, or -1 if there isn't one
+ */
+static int zm_response(struct zmodem_server *zdm, uint32_t *pos)
+{
+	size_t len, i;
+	const uint8_t *data = zmodem_server_pending_tx(zdm, &len);
+	uint8_t hdr[7];
+	uint16_t crc = 0;
+
+	for (i = 0; i + 18 <= len; i++)
+		if (memcmp(&data[i], "**\x18" "B", 4) == 0)
+			break;
+	if (i + 18 > len)
+		return -1;
+	for (int j = 0; j < 7; j++) {
+		char hex[3] = {data[i + 4 + j * 2], data[i + 5 + j * 2], '\0'};
+		hdr[j] = strtoul(hex, NULL, 16);
+		crc = crc_ref(crc, hdr[j]);
+	}
+	TEST_ASSERT(crc == 0);
+	*pos = hdr[1] | hdr[2] << 8 | hdr[3] << 16 | (uint32_t)hdr[4] << 24;
+	// Skip the CR/LF & optional XON
+	i += 20;
+	if (i < len && data[i] == 0x11)
+		i++;
+	zmodem_server_tx_done(zdm, i);
+	return hdr[0];
+}
+
+static void test_zmodem(void) {
+	enum {ZRQINIT = 0, ZRINIT = 1, ZACK = 3, ZFILE = 4, ZFIN = 8, ZRPOS = 9, ZDATA = 10, ZEOF = 11};
+	static const char info[] = "test.bin\0" "3000 14000000000 100644";
+	uint8_t input_data[3000];
+	uint8_t frame[2 * 2048 + 64];
+	struct ymodem_sink sink = {0};
+	struct zmodem_server zdm;
+	uint32_t pos;
+	size_t len;
+
+	TEST_ASSERT(~zmodem_server_crc32_buf(0xffffffff, (const uint8_t *)"123456789", 9) == 0xcbf43926);
+	for (size_t i = 0; i < sizeof(input_data); i++)
+		input_data[i] = rand();
+	// Make sure the escaping gets a workout
+	memcpy(&input_data[10], "\x18\x11\x93*\x18" "C\x7f\xff", 8);
+
+	TEST_ASSERT(zmodem_server_init(&zdm, NULL, &sink) >= 0);
+	zmodem_server_set_file_callback(&zdm, zmodem_sink_file_info);
+	TEST_ASSERT(zm_response(&zdm, &pos) == ZRINIT);
+	// We should be asking for CRC-32
+	TEST_ASSERT((pos >> 24) & 0x20);
+
+	len = zm_hex_header(frame, ZRQINIT, 0);
+	zmodem_rx(&zdm, &sink, frame, len, 1);
+	TEST_ASSERT(zm_response(&zdm, &pos) == ZRINIT);
+
+	len = zm_bin_header(frame, true, ZFILE, 0);
+	len += zm_subpacket(&frame[len], true, (const uint8_t *)info, sizeof(info), 'k');
+	zmodem_rx(&zdm, &sink, frame, len, 2);
+	TEST_ASSERT(sink.file_count == 1);
+	TEST_ASSERT(strcmp(sink.files[0].name, "test.bin") == 0);
+	TEST_ASSERT(sink.files[0].size == sizeof(input_data));
+	TEST_ASSERT(zm_response(&zdm, &pos) == ZRPOS && pos == 0);
+
+	// Two streamed subpackets, the second asking for an ACK
+	len = zm_bin_header(frame, true, ZDATA, 0);
+	len += zm_subpacket(&frame[len], true, input_data, 1024, 'i');
+	len += zm_subpacket(&frame[len], true, &input_data[1024], 1024, 'j');
+	zmodem_rx(&zdm, &sink, frame, len, 3);
+	TEST_ASSERT(sink.files[0].received == 2048);
+	TEST_ASSERT(zm_response(&zdm, &pos) == ZACK && pos == 2048);
+	TEST_ASSERT(zm_response(&zdm, &pos) == -1);
+
+	// A corrupt subpacket makes us ask for a restart, ignoring everything
+	// up to the right ZDATA header
+	len = zm_subpacket(frame, true, &input_data[2048], 952, 'i');
+	frame[100] ^= 0x04;
+	len += zm_subpacket(&frame[len], true, &input_data[2048], 952, 'h');
+	zmodem_rx(&zdm, &sink, frame, len, 4);
+	TEST_ASSERT(zm_response(&zdm, &pos) == ZRPOS && pos == 2048);
+	TEST_ASSERT(zm_response(&zdm, &pos) == -1);
+	len = zm_bin_header(frame, true, ZDATA, 1024);
+	zmodem_rx(&zdm, &sink, frame, len, 5);
+	TEST_ASSERT(zm_response(&zdm, &pos) == ZRPOS && pos == 2048);
+	TEST_ASSERT(sink.files[0].received == 2048);
+
+	// The client can drop back to 16-bit CRCs
+	len = zm_bin_header(frame, false, ZDATA, 2048);
+	len += zm_subpacket(&frame[len], false, &input_data[2048], 952, 'k');
+	zmodem_rx(&zdm, &sink, frame, len, 6);
+	TEST_ASSERT(zm_response(&zdm, &pos) == ZACK && pos == sizeof(input_data));
+
+	len = zm_hex_header(frame, ZEOF, sizeof(input_data));
+	zmodem_rx(&zdm, &sink, frame, len, 7);
+	TEST_ASSERT(zm_response(&zdm, &pos) == ZRINIT);
+	len = zm_hex_header(frame, ZFIN, 0);
+	zmodem_rx(&zdm, &sink, frame, len, 8);
+	TEST_ASSERT(zm_response(&zdm, &pos) == ZFIN);
+	TEST_ASSERT(zmodem_server_get_state(&zdm) == ZMODEM_STATE_SUCCESSFUL);
+	TEST_ASSERT(sink.files[0].received == sizeof(input_data));
+	TEST_ASSERT(memcmp(sink.files[0].data, input_data, sizeof(input_data)) == 0);
+	free(sink.files[0].data);
+
+	// Five CANs abort the transfer
+	TEST_ASSERT(zmodem_server_init(&zdm, NULL, NULL) >= 0);
+	TEST_ASSERT(zmodem_server_rx_bytes(&zdm, (const uint8_t *)"\x18\x18\x18\x18\x18", 5) == 5);
+	TEST_ASSERT(zmodem_server_get_state(&zdm) == ZMODEM_STATE_FAILURE);
+}
+
+static void test_zmodem_timeout(void) {
+	enum {ZFILE = 4, ZACK = 3, ZRPOS = 9, ZDATA = 10};
+	static const char info[] = "test.bin\0" "1024 14000000000 100644";
+	uint8_t input_data[1024];
+	uint8_t frame[2 * 1024 + 64];
+	struct ymodem_sink sink = {0};
+	struct zmodem_server zdm;
+	const uint8_t *packet;
+	uint64_t offset;
+	uint32_t pos;
+	int64_t now = 1;
+	size_t len;
+
+	for (size_t i = 0; i < sizeof(input_data); i++)
+		input_data[i] = rand();
+
+	TEST_ASSERT(zmodem_server_init(&zdm, NULL, &sink) >= 0);
+	zmodem_server_set_file_callback(&zdm, zmodem_sink_file_info);
+	TEST_ASSERT(zm_response(&zdm, &pos) == 1);
+	len = zm_bin_header(frame, true, ZFILE, 0);
+	len += zm_subpacket(&frame[len], true, (const uint8_t *)info, sizeof(info), 'k');
+	zmodem_rx(&zdm, &sink, frame, len, now);
+	TEST_ASSERT(zm_response(&zdm, &pos) == ZRPOS && pos == 0);
+
+	// On a slow link, a subpacket takes far longer than the timeout to
+	// arrive, but each byte shows the client is still there
+	len = zm_bin_header(frame, true, ZDATA, 0);
+	len += zm_subpacket(&frame[len], true, input_data, sizeof(input_data), 'k');
+	for (size_t i = 0; i < len; i++) {
+		zmodem_rx(&zdm, &sink, &frame[i], 1, now);
+		now += 10;
+	}
+	TEST_ASSERT(sink.files[0].received == sizeof(input_data));
+	TEST_ASSERT(zm_response(&zdm, &pos) == ZACK && pos == sizeof(input_data));
+	TEST_ASSERT(zm_response(&zdm, &pos) == -1);
+
+	// A finished subpacket waits for as long as it takes to be collected
+	len = zm_bin_header(frame, true, ZDATA, sizeof(input_data));
+	len += zm_subpacket(&frame[len], true, input_data, sizeof(input_data), 'k');
+	TEST_ASSERT(zmodem_server_rx_bytes(&zdm, frame, len) == len);
+	now += 10000;
+	TEST_ASSERT(zmodem_server_process_borrow(&zdm, &packet, &offset, now) == sizeof(input_data));
+	TEST_ASSERT(offset == sizeof(input_data));
+	zmodem_server_release_packet(&zdm);
+	TEST_ASSERT(zm_response(&zdm, &pos) == ZACK && pos == 2 * sizeof(input_data));
+	TEST_ASSERT(zm_response(&zdm, &pos) == -1);
+
+	// Whereas silence does time out
+	now += 2001;
+	TEST_ASSERT(zmodem_server_process_borrow(&zdm, &packet, &offset, now) == 0);
+	TEST_ASSERT(zm_response(&zdm, &pos) == ZRPOS && pos == 2 * sizeof(input_data));
+
+	// Positions on the wire wrap past 4 GiB, while the offsets we report
+	// keep counting
+	zdm.file_offset = ((uint64_t)1 << 32) + 100;
+	len = zm_bin_header(frame, true, ZDATA, 100);
+	len += zm_subpacket(&frame[len], true, input_data, sizeof(input_data), 'k');
+	TEST_ASSERT(zmodem_server_rx_bytes(&zdm, frame, len) == len);
+	TEST_ASSERT(zmodem_server_process_borrow(&zdm, &packet, &offset, now) == sizeof(input_data));
+	TEST_ASSERT(offset == ((uint64_t)1 << 32) + 100);
+	zmodem_server_release_packet(&zdm);
+	TEST_ASSERT(zm_response(&zdm, &pos) == ZACK && pos == 100 + sizeof(input_data));
+	free(sink.files[0].data);
+}
+
+static pid_t start_process(char * const args[], int *rd_fd, int *wr_fd)
+{
+	pid_t pid;
+	int pipeto[2];
+	int pipefrom[2];
+
+	if (pipe(pipeto) < 0)
+		return -1;
+
+	if (pipe(pipefrom) < 0) {
+		close(pipeto[0]);
+		close(pipeto[1]);
+		return -1;
+	}
+
+	pid = fork();
+	if  (pid < 0) {
+		close(pipeto[0]);
+		close(pipeto[1]);
+		close(pipefrom[0]);
+		close(pipefrom[1]);
+		return -1;
+	}
+
+	if (pid == 0) {
+		/* dup pipe read/write to stdin/stdout */
 		dup2(pipeto[0], STDIN_FILENO);
 		dup2(pipefrom[1], STDOUT_FILENO);
 		/* close unnecessary pipe descriptors for a clean environment */
@@ -162,8 +1797,6 @@ static pid_t spawn_process(char * const args[], int *rd_fd, int *wr_fd)
 		return -1;
 	}
 
-	usleep(rand() % 1000000);
-
 	close(pipeto[0]);
 	close(pipefrom[1]);
 	*wr_fd = pipeto[1];
@@ -171,6 +1804,28 @@ static pid_t spawn_process(char * const args[], int *rd_fd, int *wr_fd)
 	return pid;
 }
 
+/* As for start_process, but give it a random head start */
+static pid_t spawn_process(char * const args[], int *rd_fd, int *wr_fd)
+{
+	pid_t pid = start_process(args, rd_fd, wr_fd);
+
+	if (pid > 0)
+		usleep(rand() % 1000000);
+	return pid;
+}
+
+/* Send as much of the queued response data as the fd will take */
+static void flush_tx(struct xmodem_server *xdm, int fd)
+{
+	size_t len;
+	const uint8_t *data = xmodem_server_pending_tx(xdm, &len);
+	if (len > 0) {
+		ssize_t r = write(fd, data, len);
+		if (r > 0)
+			xmodem_server_tx_done(xdm, r);
+	}
+}
+
 static void tx_byte_fd(struct xmodem_server *xdm, uint8_t byte, void *cb_data)
 {
 	int *fd = cb_data;
@@ -251,6 +1906,849 @@ static void test_sz(bool use_1k, size_t data_size) {
 	free(output_data);
 }
 
+/**
+ * As for test_sz, but through the bulk APIs: rx_bytes, borrowing packets,
+ * the tx queue & an injected clock, sleeping until the next deadline
+ */
+static void test_sz_bulk(bool use_1k, size_t data_size) {
+	uint8_t *input_data = malloc(data_size);
+	TEST_ASSERT(input_data != NULL);
+	uint8_t *output_data = malloc(data_size);
+	TEST_ASSERT(output_data != NULL);
+	for (size_t i = 0; i < data_size; i++) {
+		input_data[i] = rand();
+	}
+	char raw_data_name[20];
+	sprintf(raw_data_name, "/tmp/xmodem.XXXXXXX");
+	TEST_ASSERT(mkstemp(raw_data_name) >= 0);
+	FILE *fp = fopen(raw_data_name, "wb");
+	TEST_ASSERT(fwrite(input_data, data_size, 1, fp) == 1);
+	fclose(fp);
+	char * const args_1k[] = {"sz", "--xmodem", "--1k", "--quiet", raw_data_name, NULL};
+	char * const args_128[] = {"sz", "--xmodem", "--quiet", raw_data_name, NULL};
+	char * const *args = use_1k ? args_1k : args_128;
+	int wr_fd = -1, rd_fd = -1;
+	struct xmodem_server xdm;
+	pid_t pid = spawn_process(args, &rd_fd, &wr_fd);
+	uint32_t block_nr;
+	TEST_ASSERT(pid >= 0);
+	TEST_ASSERT(xmodem_server_init(&xdm, NULL, NULL) >= 0);
+	xmodem_server_set_clock(&xdm, server_clock);
+
+	while (!xmodem_server_is_done(&xdm)) {
+		fd_set rd_fds, wr_fds;
+		size_t pending;
+		FD_ZERO(&rd_fds);
+		FD_ZERO(&wr_fds);
+		FD_SET(rd_fd, &rd_fds);
+		xmodem_server_pending_tx(&xdm, &pending);
+		if (pending > 0)
+			FD_SET(wr_fd, &wr_fds);
+		// Sleep until there's something to do
+		struct timeval tv = deadline_timeout(&xdm);
+		int max_fd = rd_fd;
+		int data_len;
+		uint8_t buffer[32];
+
+		if (wr_fd > max_fd)
+			max_fd = wr_fd;
+
+		if (select(max_fd + 1, &rd_fds, &wr_fds, NULL, &tv) >= 0) {
+			const uint8_t *resp;
+			ssize_t count = 0;
+			ssize_t pos = 0;
+			if (FD_ISSET(wr_fd, &wr_fds))
+				flush_tx(&xdm, wr_fd);
+			if (FD_ISSET(rd_fd, &rd_fds))
+				count = read(rd_fd, buffer, sizeof(buffer));
+			do {
+				if (pos < count)
+					pos += xmodem_server_rx_bytes(&xdm, &buffer[pos], count - pos);
+				data_len = xmodem_server_process_borrow(&xdm, &resp, &block_nr, 0);
+				if (data_len > 0) {
+					TEST_ASSERT(xmodem_server_packet_offset(&xdm) + data_len <= data_size);
+					memcpy(&output_data[xmodem_server_packet_offset(&xdm)], resp, data_len);
+					xmodem_server_release_packet(&xdm);
+				}
+			} while (pos < count && !xmodem_server_is_done(&xdm));
+		}
+	}
+	// Send the final ACK
+	flush_tx(&xdm, wr_fd);
+	TEST_ASSERT(xdm.packet_size == (use_1k ? 1024 : 128));
+	TEST_ASSERT(xmodem_server_get_state(&xdm) == XMODEM_STATE_SUCCESSFUL);
+	TEST_ASSERT(block_nr + 1 == data_size / xdm.packet_size);
+	waitpid(pid, NULL, 0);
+	unlink(raw_data_name);
+	for (unsigned i = 0; i < data_size; i++) {
+		if (output_data[i] != input_data[i]) {
+			fprintf(stderr, "Diff at %u: 0x%x != 0x%x\n", i, output_data[i], input_data[i]);
+		}
+	}
+	TEST_ASSERT(memcmp(output_data, input_data, data_size) == 0);
+	close(rd_fd);
+	close(wr_fd);
+	free(input_data);
+	free(output_data);
+}
+
+/**
+ * Run an xmodem client & server against each other in memory, corrupting
+ * 1 in error_rate bytes sent by the client
+ */
+static void client_server_transfer(int packet_size, size_t data_size, int error_rate, int window_slots) {
+	uint8_t *input_data = malloc(data_size + 1);
+	uint8_t *output_data = malloc(data_size + 1024);
+	uint8_t *window = malloc(window_slots * XMODEM_MAX_PACKET_SIZE + 1);
+	struct xmodem_client client;
+	struct xmodem_server server;
+	size_t received = 0;
+
+	TEST_ASSERT(input_data != NULL && output_data != NULL && window != NULL);
+	for (size_t i = 0; i < data_size; i++)
+		input_data[i] = rand();
+	TEST_ASSERT(xmodem_client_init_mem(&client, packet_size, input_data, data_size) >= 0);
+	if (window_slots)
+		TEST_ASSERT(xmodem_server_init_window(&server, NULL, NULL, window, window_slots * XMODEM_MAX_PACKET_SIZE) >= 0);
+	else
+		TEST_ASSERT(xmodem_server_init(&server, NULL, NULL) >= 0);
+
+	for (int64_t now = 1; !xmodem_client_is_done(&client) || !xmodem_server_is_done(&server); now++) {
+		const uint8_t *pending;
+		const uint8_t *packet;
+		uint32_t block_nr;
+		size_t len;
+		int data_len;
+
+		TEST_ASSERT_(now < 1000000, "client %s server %s",
+			xmodem_client_state_name(&client), xmodem_server_state_name(&server));
+
+		xmodem_client_process(&client, now);
+		pending = xmodem_client_pending_tx(&client, &len);
+		if (len > 0) {
+			uint8_t buffer[64];
+			size_t used;
+			// Send it across in odd sized chunks
+			if (len > sizeof(buffer))
+				len = sizeof(buffer);
+			memcpy(buffer, pending, len);
+			for (size_t i = 0; i < len; i++)
+				if (error_rate && rand() % error_rate == 0)
+					buffer[i] ^= 1 << (rand() % 8);
+			used = xmodem_server_rx_bytes(&server, buffer, len);
+			xmodem_client_tx_done(&client, used);
+		}
+
+		data_len = xmodem_server_process_borrow(&server, &packet, &block_nr, now);
+		if (data_len > 0) {
+			TEST_ASSERT(block_nr * (size_t)packet_size < data_size);
+			memcpy(&output_data[block_nr * packet_size], packet, data_len);
+			received = (block_nr + 1) * packet_size;
+			xmodem_server_release_packet(&server);
+		}
+
+		pending = xmodem_server_pending_tx(&server, &len);
+		for (size_t i = 0; i < len; i++)
+			xmodem_client_rx_byte(&client, pending[i]);
+		xmodem_server_tx_done(&server, len);
+	}
+
+	TEST_ASSERT_(xmodem_client_get_state(&client) == XMODEM_CLIENT_STATE_SUCCESSFUL,
+		"client %s server %s", xmodem_client_state_name(&client), xmodem_server_state_name(&server));
+	TEST_ASSERT(xmodem_server_get_state(&server) == XMODEM_STATE_SUCCESSFUL);
+	TEST_ASSERT(received == (data_size + packet_size - 1) / packet_size * packet_size);
+	TEST_ASSERT(memcmp(input_data, output_data, data_size) == 0);
+	// The last packet is padded out with CPMEOF
+	for (size_t i = data_size; i < received; i++)
+		TEST_ASSERT(output_data[i] == 0x1a);
+	free(input_data);
+	free(output_data);
+	free(window);
+}
+
+static void test_client(void) {
+	const size_t sizes[] = {0, 1, 127, 128, 1000, 1024, 1025, 100 * 1024 + 17};
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		TEST_CASE_("%zu bytes", sizes[i]);
+		client_server_transfer(128, sizes[i], 0, 0);
+		client_server_transfer(1024, sizes[i], 0, 0);
+	}
+	// The server gives up after 10 errors in total, so keep it to a few
+	TEST_CASE("errors");
+	client_server_transfer(128, 16 * 1024, 5000, 0);
+	client_server_transfer(1024, 16 * 1024, 5000, 0);
+}
+
+static void test_window(void) {
+	const size_t sizes[] = {0, 1, 1024, 1025, 100 * 1024 + 17};
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		TEST_CASE_("%zu bytes", sizes[i]);
+		client_server_transfer(128, sizes[i], 0, 4);
+		client_server_transfer(1024, sizes[i], 0, 1);
+		client_server_transfer(1024, sizes[i], 0, XMODEM_MAX_WINDOW_SLOTS);
+	}
+	// As for test_client, the server only tolerates a few errors in total
+	TEST_CASE("errors");
+	client_server_transfer(128, 16 * 1024, 10000, 4);
+	client_server_transfer(1024, 16 * 1024, 10000, 8);
+
+	// A missing block is asked for straight away, and the ones after it are
+	// held until it turns up
+	uint8_t window[4 * XMODEM_MAX_PACKET_SIZE];
+	uint8_t data[3][128];
+	uint8_t frame[3][3 + 128 + 2];
+	size_t frame_len = 0;
+	struct xmodem_server xdm;
+	const uint8_t *pending;
+	uint8_t packet[XMODEM_MAX_PACKET_SIZE];
+	uint32_t block_nr;
+	size_t len;
+
+	for (int b = 0; b < 3; b++) {
+		memset(data[b], 'a' + b, sizeof(data[b]));
+		frame_len = build_frame(frame[b], data[b], 128, b + 1);
+	}
+	TEST_ASSERT(xmodem_server_init_window(&xdm, NULL, NULL, window, sizeof(window)) >= 0);
+	pending = xmodem_server_pending_tx(&xdm, &len);
+	TEST_ASSERT(len == 2 && pending[0] == 'W' && pending[1] == '0' + 5);
+	xmodem_server_tx_done(&xdm, len);
+
+	TEST_ASSERT(xmodem_server_rx_bytes(&xdm, frame[1], frame_len) == frame_len);
+	TEST_ASSERT(xmodem_server_rx_bytes(&xdm, frame[2], frame_len) == frame_len);
+	TEST_ASSERT(xmodem_server_process(&xdm, packet, &block_nr, 1) == 0);
+	pending = xmodem_server_pending_tx(&xdm, &len);
+	TEST_ASSERT(len == 2 && pending[0] == 0x15 && pending[1] == 1);
+	xmodem_server_tx_done(&xdm, len);
+
+	TEST_ASSERT(xmodem_server_rx_bytes(&xdm, frame[0], frame_len) == frame_len);
+	for (uint32_t b = 0; b < 3; b++) {
+		TEST_ASSERT(xmodem_server_process(&xdm, packet, &block_nr, 2) == 128);
+		TEST_ASSERT(block_nr == b);
+		TEST_ASSERT(memcmp(packet, data[b], 128) == 0);
+		// Nothing is acknowledged until all three have been delivered
+		xmodem_server_pending_tx(&xdm, &len);
+		TEST_ASSERT(len == (b == 2 ? 2 : 0));
+	}
+	pending = xmodem_server_pending_tx(&xdm, &len);
+	TEST_ASSERT(pending[0] == 0x06 && pending[1] == 3);
+	xmodem_server_tx_done(&xdm, len);
+
+	// A repeat of a delivered block is acknowledged again
+	TEST_ASSERT(xmodem_server_rx_bytes(&xdm, frame[1], frame_len) == frame_len);
+	TEST_ASSERT(xmodem_server_process(&xdm, packet, &block_nr, 3) == 0);
+	pending = xmodem_server_pending_tx(&xdm, &len);
+	TEST_ASSERT(len == 2 && pending[0] == 0x06 && pending[1] == 3);
+}
+
+static void test_rz(bool use_1k, size_t data_size) {
+	uint8_t *input_data = malloc(data_size);
+	TEST_ASSERT(input_data != NULL);
+	uint8_t *output_data = malloc(data_size);
+	TEST_ASSERT(output_data != NULL);
+	for (size_t i = 0; i < data_size; i++) {
+		input_data[i] = rand();
+	}
+	char raw_data_name[20];
+	sprintf(raw_data_name, "/tmp/xmodem.XXXXXXX");
+	int fd = mkstemp(raw_data_name);
+	TEST_ASSERT(fd >= 0);
+	close(fd);
+	// rz refuses absolute paths, so run it from /tmp
+	char command[100];
+	sprintf(command, "cd /tmp && exec rz --xmodem --with-crc --overwrite --quiet %s", &raw_data_name[5]);
+	char * const args[] = {"sh", "-c", command, NULL};
+	int wr_fd = -1, rd_fd = -1;
+	struct xmodem_client xdm;
+	pid_t pid = spawn_process(args, &rd_fd, &wr_fd);
+	TEST_ASSERT(pid >= 0);
+	TEST_ASSERT(xmodem_client_init_mem(&xdm, use_1k ? 1024 : 128, input_data, data_size) >= 0);
+
+	while (!xmodem_client_is_done(&xdm)) {
+		fd_set rd_fds, wr_fds;
+		const uint8_t *pending;
+		size_t len;
+		struct timeval tv;
+
+		FD_ZERO(&rd_fds);
+		FD_ZERO(&wr_fds);
+		FD_SET(rd_fd, &rd_fds);
+		pending = xmodem_client_pending_tx(&xdm, &len);
+		if (len > 0)
+			FD_SET(wr_fd, &wr_fds);
+		tv.tv_sec = 0;
+		tv.tv_usec = 1000;
+
+		if (select((rd_fd > wr_fd ? rd_fd : wr_fd) + 1, &rd_fds, &wr_fds, NULL, &tv) >= 0) {
+			if (FD_ISSET(wr_fd, &wr_fds)) {
+				ssize_t r = write(wr_fd, pending, len);
+				if (r > 0)
+					xmodem_client_tx_done(&xdm, r);
+			}
+			if (FD_ISSET(rd_fd, &rd_fds)) {
+				uint8_t buffer[32];
+				ssize_t count = read(rd_fd, buffer, sizeof(buffer));
+				for (ssize_t i = 0; i < count; i++)
+					xmodem_client_rx_byte(&xdm, buffer[i]);
+			}
+		}
+		xmodem_client_process(&xdm, ms_time());
+	}
+	TEST_ASSERT_(xmodem_client_get_state(&xdm) == XMODEM_CLIENT_STATE_SUCCESSFUL,
+		"state %s", xmodem_client_state_name(&xdm));
+	close(wr_fd);
+	close(rd_fd);
+	waitpid(pid, NULL, 0);
+	FILE *fp = fopen(raw_data_name, "rb");
+	TEST_ASSERT(fp != NULL);
+	TEST_ASSERT(fread(output_data, data_size, 1, fp) == 1);
+	fclose(fp);
+	unlink(raw_data_name);
+	TEST_ASSERT(memcmp(output_data, input_data, data_size) == 0);
+	free(input_data);
+	free(output_data);
+}
+
+static int tty_packet(struct xmodem_server *xdm, const uint8_t *data, int len, uint32_t block_num, void *cb_data)
+{
+	uint8_t *output_data = cb_data;
+
+	(void)block_num;
+	memcpy(&output_data[xmodem_server_packet_offset(xdm)], data, len);
+	return 0;
+}
+
+static void test_tty(void) {
+	const size_t data_size = 256 * 1024;
+	uint8_t *input_data = malloc(data_size);
+	uint8_t *output_data = calloc(1, data_size + 1024);
+	static struct xmodem_tty tty;
+	struct xmodem_server xdm;
+	int master, slave, status;
+	pid_t pid;
+	int r;
+
+	TEST_ASSERT(input_data != NULL && output_data != NULL);
+	for (size_t i = 0; i < data_size; i++)
+		input_data[i] = rand();
+	master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+	TEST_ASSERT(master >= 0);
+	TEST_ASSERT(grantpt(master) >= 0 && unlockpt(master) >= 0);
+	slave = open(ptsname(master), O_RDWR | O_NOCTTY | O_CLOEXEC);
+	TEST_ASSERT(slave >= 0);
+	TEST_ASSERT(xmodem_tty_init(&tty, slave) >= 0);
+
+	pid = fork();
+	TEST_ASSERT(pid >= 0);
+	if (pid == 0) {
+		// Send from the master side
+		struct xmodem_client client;
+
+		close(slave);
+		xmodem_client_init_mem(&client, 1024, input_data, data_size);
+		while (!xmodem_client_is_done(&client)) {
+			struct pollfd pfd = {.fd = master, .events = POLLIN};
+			size_t len;
+			const uint8_t *pending = xmodem_client_pending_tx(&client, &len);
+
+			if (len > 0)
+				pfd.events |= POLLOUT;
+			if (poll(&pfd, 1, 1) > 0) {
+				if (pfd.revents & POLLOUT) {
+					ssize_t w = write(master, pending, len);
+					if (w > 0)
+						xmodem_client_tx_done(&client, w);
+				}
+				if (pfd.revents & POLLIN) {
+					uint8_t buffer[32];
+					ssize_t count = read(master, buffer, sizeof(buffer));
+					for (ssize_t i = 0; i < count; i++)
+						xmodem_client_rx_byte(&client, buffer[i]);
+				}
+			}
+			xmodem_client_process(&client, ms_time());
+		}
+		_exit(xmodem_client_get_state(&client) == XMODEM_CLIENT_STATE_SUCCESSFUL ? 0 : 1);
+	}
+
+	TEST_ASSERT(xmodem_server_init(&xdm, NULL, NULL) >= 0);
+	while ((r = xmodem_tty_run(&tty, &xdm, tty_packet, output_data)) > 0)
+		;
+	TEST_ASSERT_(r == 0, "%s", strerror(errno));
+	TEST_ASSERT(xmodem_server_get_state(&xdm) == XMODEM_STATE_SUCCESSFUL);
+	TEST_ASSERT(memcmp(input_data, output_data, data_size) == 0);
+	TEST_ASSERT(waitpid(pid, &status, 0) == pid);
+	TEST_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	xmodem_tty_close(&tty);
+	close(slave);
+	close(master);
+	free(input_data);
+	free(output_data);
+}
+
+static void test_rz_128(void) {
+	test_rz(false, 2 * 1024 * 1024);
+}
+
+static void test_rz_1k(void) {
+	test_rz(true, 2 * 1024 * 1024);
+}
+
+static void sz_ymodem(uint32_t flags) {
+	const size_t sizes[] = {1024 * 1024 + 17, 3000};
+	char names[2][20];
+	uint8_t *input_data[2];
+	struct ymodem_sink sink = {0};
+	struct xmodem_server xdm;
+	int wr_fd = -1, rd_fd = -1;
+
+	for (int f = 0; f < 2; f++) {
+		input_data[f] = malloc(sizes[f]);
+		TEST_ASSERT(input_data[f] != NULL);
+		for (size_t i = 0; i < sizes[f]; i++)
+			input_data[f][i] = rand();
+		sprintf(names[f], "/tmp/ymodem.XXXXXX");
+		int fd = mkstemp(names[f]);
+		TEST_ASSERT(fd >= 0);
+		TEST_ASSERT(write(fd, input_data[f], sizes[f]) == (ssize_t)sizes[f]);
+		close(fd);
+	}
+	char * const args[] = {"sz", "--ymodem", "--1k", "--quiet", names[0], names[1], NULL};
+	pid_t pid = spawn_process(args, &rd_fd, &wr_fd);
+	TEST_ASSERT(pid >= 0);
+	TEST_ASSERT(xmodem_server_init_flags(&xdm, NULL, &sink, XMODEM_FLAG_YMODEM | flags) >= 0);
+	xmodem_server_set_file_callback(&xdm, ymodem_file_info);
+
+	while (!xmodem_server_is_done(&xdm)) {
+		fd_set rd_fds, wr_fds;
+		struct timeval tv = deadline_timeout(&xdm);
+		size_t pending;
+
+		FD_ZERO(&rd_fds);
+		FD_ZERO(&wr_fds);
+		FD_SET(rd_fd, &rd_fds);
+		xmodem_server_pending_tx(&xdm, &pending);
+		if (pending > 0)
+			FD_SET(wr_fd, &wr_fds);
+		if (select((rd_fd > wr_fd ? rd_fd : wr_fd) + 1, &rd_fds, &wr_fds, NULL, &tv) < 0)
+			continue;
+		if (FD_ISSET(wr_fd, &wr_fds))
+			flush_tx(&xdm, wr_fd);
+		if (FD_ISSET(rd_fd, &rd_fds)) {
+			uint8_t buffer[1024];
+			ssize_t count = read(rd_fd, buffer, sizeof(buffer));
+			if (count > 0)
+				ymodem_rx(&xdm, &sink, buffer, count, ms_time());
+		} else {
+			ymodem_rx(&xdm, &sink, NULL, 0, ms_time());
+		}
+	}
+	flush_tx(&xdm, wr_fd);
+	waitpid(pid, NULL, 0);
+	close(rd_fd);
+	close(wr_fd);
+	TEST_ASSERT(xmodem_server_get_state(&xdm) == XMODEM_STATE_SUCCESSFUL);
+	TEST_ASSERT(sink.file_count == 2);
+	for (int f = 0; f < 2; f++) {
+		// sz sends the base name only
+		TEST_ASSERT(strcmp(sink.files[f].name, &names[f][5]) == 0);
+		TEST_ASSERT(sink.files[f].size == (int64_t)sizes[f]);
+		TEST_ASSERT(sink.files[f].received == sizes[f]);
+		TEST_ASSERT(memcmp(sink.files[f].data, input_data[f], sizes[f]) == 0);
+		free(sink.files[f].data);
+		free(input_data[f]);
+		unlink(names[f]);
+	}
+}
+
+static void test_sz_ymodem(void) {
+	sz_ymodem(0);
+}
+
+static void test_sz_ymodem_g(void) {
+	sz_ymodem(XMODEM_FLAG_STREAMING);
+}
+
+static void zmodem_flush_tx(struct zmodem_server *zdm, int fd)
+{
+	size_t len;
+	const uint8_t *data = zmodem_server_pending_tx(zdm, &len);
+	if (len > 0) {
+		ssize_t r = write(fd, data, len);
+		if (r > 0)
+			zmodem_server_tx_done(zdm, r);
+	}
+}
+
+static void test_sz_zmodem(void) {
+	const size_t sizes[] = {1024 * 1024 + 17, 3000};
+	char names[2][20];
+	uint8_t *input_data[2];
+	struct ymodem_sink sink = {0};
+	struct zmodem_server zdm;
+	int wr_fd = -1, rd_fd = -1;
+
+	for (int f = 0; f < 2; f++) {
+		input_data[f] = malloc(sizes[f]);
+		TEST_ASSERT(input_data[f] != NULL);
+		for (size_t i = 0; i < sizes[f]; i++)
+			input_data[f][i] = rand();
+		sprintf(names[f], "/tmp/zmodem.XXXXXX");
+		int fd = mkstemp(names[f]);
+		TEST_ASSERT(fd >= 0);
+		TEST_ASSERT(write(fd, input_data[f], sizes[f]) == (ssize_t)sizes[f]);
+		close(fd);
+	}
+	char * const args[] = {"sz", "--zmodem", "--quiet", names[0], names[1], NULL};
+	pid_t pid = spawn_process(args, &rd_fd, &wr_fd);
+	TEST_ASSERT(pid >= 0);
+	TEST_ASSERT(zmodem_server_init(&zdm, NULL, &sink) >= 0);
+	zmodem_server_set_file_callback(&zdm, zmodem_sink_file_info);
+
+	while (!zmodem_server_is_done(&zdm)) {
+		fd_set rd_fds, wr_fds;
+		struct timeval tv = {.tv_sec = 0, .tv_usec = 1000};
+		size_t pending;
+
+		FD_ZERO(&rd_fds);
+		FD_ZERO(&wr_fds);
+		FD_SET(rd_fd, &rd_fds);
+		zmodem_server_pending_tx(&zdm, &pending);
+		if (pending > 0)
+			FD_SET(wr_fd, &wr_fds);
+		if (select((rd_fd > wr_fd ? rd_fd : wr_fd) + 1, &rd_fds, &wr_fds, NULL, &tv) < 0)
+			continue;
+		if (FD_ISSET(wr_fd, &wr_fds))
+			zmodem_flush_tx(&zdm, wr_fd);
+		if (FD_ISSET(rd_fd, &rd_fds)) {
+			uint8_t buffer[1024];
+			ssize_t count = read(rd_fd, buffer, sizeof(buffer));
+			if (count > 0)
+				zmodem_rx(&zdm, &sink, buffer, count, ms_time());
+		} else {
+			zmodem_rx(&zdm, &sink, NULL, 0, ms_time());
+		}
+	}
+	// sz waits for our ZFIN before finishing
+	zmodem_flush_tx(&zdm, wr_fd);
+	waitpid(pid, NULL, 0);
+	close(rd_fd);
+	close(wr_fd);
+	TEST_ASSERT(zmodem_server_get_state(&zdm) == ZMODEM_STATE_SUCCESSFUL);
+	TEST_ASSERT(sink.file_count == 2);
+	for (int f = 0; f < 2; f++) {
+		TEST_ASSERT(strcmp(sink.files[f].name, &names[f][5]) == 0);
+		TEST_ASSERT(sink.files[f].size == (int64_t)sizes[f]);
+		TEST_ASSERT(sink.files[f].received == sizes[f]);
+		TEST_ASSERT(memcmp(sink.files[f].data, input_data[f], sizes[f]) == 0);
+		free(sink.files[f].data);
+		free(input_data[f]);
+		unlink(names[f]);
+	}
+}
+
+struct mux_sink {
+	uint8_t *input;
+	uint8_t *output;
+	size_t size;
+	size_t received;
+	int done_count;
+	xmodem_server_state state;
+	pid_t pid;
+	int rd_fd, wr_fd;
+	char name[20];
+};
+
+static int mux_packet(struct xmodem_mux_session *session, const uint8_t *data, int len, uint32_t block_num, void *cb_data)
+{
+	struct mux_sink *sink = cb_data;
+
+	(void)session;
+	(void)block_num;
+	if (sink->received + len > sink->size)
+		return -1;
+	memcpy(&sink->output[sink->received], data, len);
+	sink->received += len;
+	return 0;
+}
+
+static void mux_done(struct xmodem_mux_session *session, xmodem_server_state state, void *cb_data)
+{
+	struct mux_sink *sink = cb_data;
+
+	(void)session;
+	sink->state = state;
+	sink->done_count++;
+}
+
+/**
+ * Receive from lots of sz processes at once, with one more sender which
+ * goes away without sending anything
+ */
+static void test_mux(void) {
+	enum { SENDERS = 32, SIZE = 64 * 1024 };
+	static struct xmodem_mux mux;
+	static struct xmodem_mux_session sessions[SENDERS + 1];
+	static struct mux_sink sinks[SENDERS + 1];
+	char * const args_quit[] = {"true", NULL};
+
+	TEST_ASSERT(xmodem_mux_init_clock(&mux, CLOCK_MONOTONIC_COARSE) >= 0);
+	for (int i = 0; i < SENDERS; i++) {
+		struct mux_sink *sink = &sinks[i];
+		sink->size = SIZE;
+		sink->input = malloc(SIZE);
+		sink->output = malloc(SIZE);
+		TEST_ASSERT(sink->input != NULL && sink->output != NULL);
+		for (size_t j = 0; j < SIZE; j++)
+			sink->input[j] = rand();
+		sprintf(sink->name, "/tmp/xmodem.XXXXXXX");
+		int fd = mkstemp(sink->name);
+		TEST_ASSERT(fd >= 0);
+		TEST_ASSERT(write(fd, sink->input, SIZE) == SIZE);
+		close(fd);
+
+		char * const args_1k[] = {"sz", "--xmodem", "--1k", "--quiet", sink->name, NULL};
+		char * const args_128[] = {"sz", "--xmodem", "--quiet", sink->name, NULL};
+		sink->pid = start_process(i % 2 ? args_1k : args_128, &sink->rd_fd, &sink->wr_fd);
+		TEST_ASSERT(sink->pid > 0);
+		TEST_ASSERT(xmodem_mux_add(&mux, &sessions[i], sink->rd_fd, sink->wr_fd, 0, mux_packet, mux_done, sink) >= 0);
+	}
+	sinks[SENDERS].pid = start_process(args_quit, &sinks[SENDERS].rd_fd, &sinks[SENDERS].wr_fd);
+	TEST_ASSERT(sinks[SENDERS].pid > 0);
+	TEST_ASSERT(xmodem_mux_add(&mux, &sessions[SENDERS], sinks[SENDERS].rd_fd, sinks[SENDERS].wr_fd, 0, mux_packet, mux_done, &sinks[SENDERS]) >= 0);
+	TEST_ASSERT(xmodem_mux_active(&mux) == SENDERS + 1);
+
+	while (xmodem_mux_active(&mux) > 0)
+		TEST_ASSERT(xmodem_mux_run(&mux, -1) >= 0);
+
+	for (int i = 0; i <= SENDERS; i++) {
+		struct mux_sink *sink = &sinks[i];
+		TEST_ASSERT(sink->done_count == 1);
+		waitpid(sink->pid, NULL, 0);
+		close(sink->rd_fd);
+		close(sink->wr_fd);
+		if (i == SENDERS) {
+			TEST_ASSERT(sink->state == XMODEM_STATE_FAILURE);
+			continue;
+		}
+		TEST_ASSERT(sink->state == XMODEM_STATE_SUCCESSFUL);
+		TEST_ASSERT(sink->received == SIZE);
+		TEST_ASSERT(memcmp(sink->input, sink->output, SIZE) == 0);
+		unlink(sink->name);
+		free(sink->input);
+		free(sink->output);
+	}
+	xmodem_mux_close(&mux);
+}
+
+static void mux_done_free(struct xmodem_mux_session *session, xmodem_server_state state, void *cb_data)
+{
+	mux_done(session, state, cb_data);
+	free(session);
+}
+
+/**
+ * The done callback may release the session's storage, even when both of
+ * its fds were ready in the same batch of events
+ */
+static void test_mux_done(void) {
+	static struct xmodem_mux mux;
+	struct xmodem_mux_session *session = malloc(sizeof(*session));
+	struct mux_sink sink = {0};
+	uint8_t buffer[4096];
+	int to_mux[2], from_mux[2];
+
+	TEST_ASSERT(session != NULL);
+	TEST_ASSERT(pipe(to_mux) >= 0 && pipe(from_mux) >= 0);
+	// Fill the response pipe, so the mux has to wait for it to drain
+	TEST_ASSERT(fcntl(from_mux[1], F_SETFL, O_NONBLOCK) >= 0);
+	while (write(from_mux[1], buffer, sizeof(buffer)) > 0)
+		;
+	TEST_ASSERT(xmodem_mux_init(&mux) >= 0);
+	TEST_ASSERT(xmodem_mux_add(&mux, session, to_mux[0], from_mux[1], 0, mux_packet, mux_done_free, &sink) >= 0);
+
+	// The sender goes away, then the response pipe drains, so both fds
+	// turn up in one epoll_wait, with the session finishing on the first
+	close(to_mux[1]);
+	TEST_ASSERT(fcntl(from_mux[0], F_SETFL, O_NONBLOCK) >= 0);
+	while (read(from_mux[0], buffer, sizeof(buffer)) > 0)
+		;
+	while (xmodem_mux_active(&mux) > 0)
+		TEST_ASSERT(xmodem_mux_run(&mux, 1000) >= 0);
+	TEST_ASSERT(sink.done_count == 1);
+	TEST_ASSERT(sink.state == XMODEM_STATE_FAILURE);
+	close(to_mux[0]);
+	close(from_mux[0]);
+	close(from_mux[1]);
+	xmodem_mux_close(&mux);
+}
+
+struct pool_sink {
+	uint8_t *output;
+	size_t size;
+	size_t received;
+	uint32_t next_block;
+	int abort_after; // Give up after this many packets, if > 0
+	atomic_int busy; // Set while a callback is running
+	bool overlap; // Were two callbacks ever running at once?
+	int done_count;
+	xmodem_server_state state;
+	int fd;
+};
+
+static int pool_packet(struct xmodem_pool_session *session, const uint8_t *data, int len, uint32_t block_num, void *cb_data)
+{
+	struct pool_sink *sink = cb_data;
+	int r = 0;
+
+	(void)session;
+	if (atomic_exchange(&sink->busy, 1))
+		sink->overlap = true;
+	// Packets must arrive in order, just once each, whichever worker runs them
+	if (block_num != sink->next_block++ || sink->received + len > sink->size ||
+			(sink->abort_after > 0 && (int)block_num + 1 >= sink->abort_after))
+		r = -1;
+	else
+		memcpy(&sink->output[sink->received], data, len);
+	sink->received += len;
+	atomic_store(&sink->busy, 0);
+	return r;
+}
+
+static void pool_done(struct xmodem_pool_session *session, xmodem_server_state state, void *cb_data)
+{
+	struct pool_sink *sink = cb_data;
+
+	(void)session;
+	sink->state = state;
+	sink->done_count++;
+}
+
+/**
+ * Send from every fd at once with xmodem_client, until they are all done
+ */
+static void pool_send(const int *fds, int count, const uint8_t *data, size_t size)
+{
+	struct xmodem_client *clients = calloc(count, sizeof(*clients));
+	struct pollfd *pfds = calloc(count, sizeof(*pfds));
+	int remaining = count;
+
+	if (!clients || !pfds)
+		_exit(1);
+	for (int i = 0; i < count; i++) {
+		xmodem_client_init_mem(&clients[i], i % 2 ? 1024 : 128, data, size);
+		pfds[i].fd = fds[i];
+	}
+	while (remaining > 0) {
+		for (int i = 0; i < count; i++) {
+			size_t len;
+
+			xmodem_client_pending_tx(&clients[i], &len);
+			pfds[i].events = pfds[i].fd < 0 ? 0 : len > 0 ? POLLIN | POLLOUT : POLLIN;
+		}
+		poll(pfds, count, 1);
+		for (int i = 0; i < count; i++) {
+			struct xmodem_client *client = &clients[i];
+
+			if (pfds[i].fd < 0)
+				continue;
+			if (pfds[i].revents & POLLOUT) {
+				size_t len;
+				const uint8_t *pending = xmodem_client_pending_tx(client, &len);
+				ssize_t w = write(pfds[i].fd, pending, len);
+				if (w > 0)
+					xmodem_client_tx_done(client, w);
+			}
+			if (pfds[i].revents & (POLLIN | POLLHUP)) {
+				uint8_t buffer[32];
+				ssize_t r = read(pfds[i].fd, buffer, sizeof(buffer));
+				for (ssize_t j = 0; j < r; j++)
+					xmodem_client_rx_byte(client, buffer[j]);
+			}
+			xmodem_client_process(client, ms_time());
+			if (xmodem_client_is_done(client)) {
+				close(pfds[i].fd);
+				pfds[i].fd = -1;
+				remaining--;
+			}
+		}
+	}
+	_exit(0);
+}
+
+/**
+ * Receive from lots of senders over a few workers, with one session which
+ * gives up part way through & one sender which goes away straight away
+ */
+static void test_pool(void) {
+	enum { SENDERS = 48, WORKERS = 4, SIZE = 32 * 1024 };
+	static struct xmodem_pool pool;
+	static struct xmodem_pool_session sessions[SENDERS + 1];
+	static struct pool_sink sinks[SENDERS + 1];
+	int child_fds[SENDERS];
+	uint8_t *input = malloc(SIZE);
+	pid_t pid;
+	int status;
+
+	TEST_ASSERT(input != NULL);
+	// Responses to the senders which have gone away
+	signal(SIGPIPE, SIG_IGN);
+	for (size_t i = 0; i < SIZE; i++)
+		input[i] = rand();
+	for (int i = 0; i <= SENDERS; i++) {
+		int fds[2];
+
+		TEST_ASSERT(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) >= 0);
+		sinks[i].fd = fds[0];
+		if (i < SENDERS)
+			child_fds[i] = fds[1];
+		else
+			close(fds[1]);
+		sinks[i].size = SIZE;
+		sinks[i].output = malloc(SIZE);
+		TEST_ASSERT(sinks[i].output != NULL);
+	}
+	sinks[0].abort_after = 5;
+
+	// Before the workers start, so the child only has one thread
+	pid = fork();
+	TEST_ASSERT(pid >= 0);
+	if (pid == 0) {
+		for (int i = 0; i <= SENDERS; i++)
+			close(sinks[i].fd);
+		pool_send(child_fds, SENDERS, input, SIZE);
+	}
+	for (int i = 0; i < SENDERS; i++)
+		close(child_fds[i]);
+
+	TEST_ASSERT(xmodem_pool_init(&pool, WORKERS) >= 0);
+	for (int i = 0; i <= SENDERS; i++) {
+		TEST_ASSERT(xmodem_pool_session_init(&sessions[i], sinks[i].fd, sinks[i].fd, 0, pool_packet, pool_done, &sinks[i]) >= 0);
+		TEST_ASSERT(xmodem_pool_add(&pool, &sessions[i]) >= 0);
+	}
+	TEST_ASSERT(xmodem_pool_wait(&pool, 60000) == 0);
+	TEST_ASSERT(xmodem_pool_active(&pool) == 0);
+	xmodem_pool_close(&pool);
+	TEST_ASSERT(waitpid(pid, &status, 0) == pid);
+	TEST_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	for (int i = 0; i <= SENDERS; i++) {
+		struct pool_sink *sink = &sinks[i];
+
+		TEST_ASSERT(sink->done_count == 1);
+		TEST_ASSERT(!sink->overlap);
+		if (i == 0 || i == SENDERS) {
+			TEST_ASSERT(sink->state == XMODEM_STATE_FAILURE);
+		} else {
+			TEST_ASSERT_(sink->state == XMODEM_STATE_SUCCESSFUL, "session %d", i);
+			TEST_ASSERT(sink->received == SIZE);
+			TEST_ASSERT(memcmp(input, sink->output, SIZE) == 0);
+		}
+		close(sink->fd);
+		free(sink->output);
+	}
+	free(input);
+}
+
 static void test_sz_128(void) {
 	test_sz(false, 2 * 1024 * 1024);
 }
@@ -259,11 +2757,55 @@ static void test_sz_1k(void) {
 	test_sz(true, 2 * 1024 * 1024);
 }
 
+static void test_sz_bulk_128(void) {
+	test_sz_bulk(false, 2 * 1024 * 1024);
+}
+
+static void test_sz_bulk_1k(void) {
+	test_sz_bulk(true, 2 * 1024 * 1024);
+}
+
 TEST_LIST = {
 	{"simple", test_simple},
+	{"crc", test_crc},
+	{"rx latency", test_rx_latency},
+	{"rx bytes", test_rx_bytes},
+	{"frame remaining", test_frame_remaining},
+	{"rx resync", test_rx_resync},
+	{"rx noise", test_rx_noise},
+	{"sink", test_sink},
+	{"ring", test_ring},
+	{"ring server", test_ring_server},
+	{"borrow", test_borrow},
+	{"tx queue", test_tx_queue},
+	{"tx queue window", test_tx_queue_window},
+	{"ymodem", test_ymodem},
+	{"ymodem adaptive", test_ymodem_adaptive},
 	{"errors", test_errors},
 	{"timeout", test_timeout},
+	{"deadline", test_deadline},
+	{"clock", test_clock},
+	{"adaptive", test_adaptive},
+	{"stats", test_stats},
+	{"trace", test_trace},
+	{"timer", test_timer},
+	{"streaming", test_streaming},
+	{"zmodem", test_zmodem},
+	{"zmodem timeout", test_zmodem_timeout},
 	{"sz (128B)", test_sz_128},
 	{"sz (1kB)", test_sz_1k},
+	{"sz bulk (128B)", test_sz_bulk_128},
+	{"sz bulk (1kB)", test_sz_bulk_1k},
+	{"sz (ymodem)", test_sz_ymodem},
+	{"sz (ymodem-g)", test_sz_ymodem_g},
+	{"sz (zmodem)", test_sz_zmodem},
+	{"mux", test_mux},
+	{"mux done", test_mux_done},
+	{"client", test_client},
+	{"window", test_window},
+	{"tty", test_tty},
+	{"pool", test_pool},
+	{"rz (128B)", test_rz_128},
+	{"rz (1kB)", test_rz_1k},
 	{NULL, NULL},
 };
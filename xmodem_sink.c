@@ -0,0 +1,374 @@
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "xmodem_sink.h"
+
+#if XMODEM_SINK_URING_DEPTH > 0
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+// XMODEM pads out the last block with this (CP/M end of file)
+#define XMODEM_PAD 0x1a
+
+static void unmap(struct xmodem_sink *sink)
+{
+	if (sink->map)
+		munmap(sink->map, XMODEM_SINK_MAP_SIZE);
+	sink->map = NULL;
+}
+
+/**
+ * Make sure the part of the file holding offset is mapped
+ */
+static int map_window(struct xmodem_sink *sink, uint64_t offset)
+{
+	uint64_t start = offset - offset % XMODEM_SINK_MAP_SIZE;
+	void *map;
+
+	if (sink->map && sink->map_offset == start)
+		return 0;
+	// Only one window is kept, so memory use doesn't grow with the file
+	unmap(sink);
+	// The file has to cover the whole mapping, or touching it would fault
+	if (sink->file_len < start + XMODEM_SINK_MAP_SIZE) {
+		if (ftruncate(sink->fd, start + XMODEM_SINK_MAP_SIZE) < 0)
+			return -1;
+		sink->file_len = start + XMODEM_SINK_MAP_SIZE;
+	}
+	map = mmap(NULL, XMODEM_SINK_MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, sink->fd, start);
+	if (map == MAP_FAILED)
+		return -1;
+	sink->map = map;
+	sink->map_offset = start;
+	return 0;
+}
+
+#if XMODEM_SINK_URING_DEPTH > 0
+/**
+ * There is no libc wrapper for io_uring, and liburing would be one more
+ * dependency for the handful of calls needed here
+ */
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	int r;
+
+	do {
+		r = syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+	} while (r < 0 && errno == EINTR);
+	return r;
+}
+
+static void *uring_map(int fd, size_t len, off_t offset)
+{
+	void *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+
+	return map == MAP_FAILED ? NULL : map;
+}
+
+static void uring_teardown(struct xmodem_sink *sink)
+{
+	if (sink->sqes)
+		munmap(sink->sqes, sink->sqes_len);
+	if (sink->cq_map && sink->cq_map != sink->sq_map)
+		munmap(sink->cq_map, sink->cq_map_len);
+	if (sink->sq_map)
+		munmap(sink->sq_map, sink->sq_map_len);
+	sink->sqes = sink->cq_map = sink->sq_map = NULL;
+	if (sink->ring_fd >= 0)
+		close(sink->ring_fd);
+	sink->ring_fd = -1;
+}
+
+static int uring_setup(struct xmodem_sink *sink)
+{
+	struct io_uring_params params;
+	struct iovec iov[XMODEM_SINK_URING_DEPTH];
+	uint8_t *sq, *cq;
+
+	memset(&params, 0, sizeof(params));
+	sink->ring_fd = syscall(__NR_io_uring_setup, XMODEM_SINK_URING_DEPTH, &params);
+	if (sink->ring_fd < 0)
+		return -1;
+	sink->sq_map_len = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+	sink->cq_map_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	sink->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+	// Newer kernels share a single mapping between both rings
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (sink->cq_map_len > sink->sq_map_len)
+			sink->sq_map_len = sink->cq_map_len;
+		sink->sq_map = sink->cq_map = uring_map(sink->ring_fd, sink->sq_map_len, IORING_OFF_SQ_RING);
+	} else {
+		sink->sq_map = uring_map(sink->ring_fd, sink->sq_map_len, IORING_OFF_SQ_RING);
+		sink->cq_map = uring_map(sink->ring_fd, sink->cq_map_len, IORING_OFF_CQ_RING);
+	}
+	sink->sqes = uring_map(sink->ring_fd, sink->sqes_len, IORING_OFF_SQES);
+	if (!sink->sq_map || !sink->cq_map || !sink->sqes)
+		goto fail;
+	sq = sink->sq_map;
+	cq = sink->cq_map;
+	sink->sq_tail = (uint32_t *)(sq + params.sq_off.tail);
+	sink->sq_mask = (uint32_t *)(sq + params.sq_off.ring_mask);
+	sink->sq_array = (uint32_t *)(sq + params.sq_off.array);
+	sink->cq_head = (uint32_t *)(cq + params.cq_off.head);
+	sink->cq_tail = (uint32_t *)(cq + params.cq_off.tail);
+	sink->cq_mask = (uint32_t *)(cq + params.cq_off.ring_mask);
+	sink->cqes = cq + params.cq_off.cqes;
+
+	// Registered buffers are pinned once, rather than mapped on every write
+	for (int i = 0; i < XMODEM_SINK_URING_DEPTH; i++) {
+		iov[i].iov_base = sink->bufs[i];
+		iov[i].iov_len = sizeof(sink->bufs[i]);
+		sink->free_bufs[i] = i;
+	}
+	sink->free_count = XMODEM_SINK_URING_DEPTH;
+	if (syscall(__NR_io_uring_register, sink->ring_fd, IORING_REGISTER_BUFFERS, iov, XMODEM_SINK_URING_DEPTH) < 0)
+		goto fail;
+	return 0;
+
+fail:
+	{
+		int err = errno;
+
+		uring_teardown(sink);
+		errno = err;
+	}
+	return -1;
+}
+
+/**
+ * Queue the rest of a buffer for writing
+ */
+static int uring_submit(struct xmodem_sink *sink, int buf)
+{
+	struct io_uring_sqe *sqes = sink->sqes;
+	// Only this thread touches the tail, the kernel consumes from the head
+	uint32_t tail = *sink->sq_tail;
+	uint32_t index = tail & *sink->sq_mask;
+	struct io_uring_sqe *sqe = &sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_WRITE_FIXED;
+	sqe->fd = sink->fd;
+	sqe->addr = (uintptr_t)&sink->bufs[buf][sink->buf_done[buf]];
+	sqe->len = sink->buf_len[buf] - sink->buf_done[buf];
+	sqe->off = sink->buf_offset[buf] + sink->buf_done[buf];
+	sqe->buf_index = buf;
+	sqe->user_data = buf;
+	sink->sq_array[index] = index;
+	__atomic_store_n(sink->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	if (uring_enter(sink->ring_fd, 1, 0, 0) < 0) {
+		if (!sink->error)
+			sink->error = errno;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Handle every completion which is ready, first waiting for at least
+ * wait of them
+ */
+static int uring_reap(struct xmodem_sink *sink, unsigned wait)
+{
+	struct io_uring_cqe *cqes = sink->cqes;
+	uint32_t head, tail;
+
+	if (wait && uring_enter(sink->ring_fd, 0, wait, IORING_ENTER_GETEVENTS) < 0)
+		return -1;
+	head = *sink->cq_head;
+	tail = __atomic_load_n(sink->cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+		const struct io_uring_cqe *cqe = &cqes[head & *sink->cq_mask];
+		int buf = cqe->user_data;
+
+		if (cqe->res < 0 && !sink->error)
+			sink->error = -cqe->res;
+		if (cqe->res > 0 && sink->buf_done[buf] + cqe->res < sink->buf_len[buf]) {
+			// Short write, send the rest
+			sink->buf_done[buf] += cqe->res;
+			if (uring_submit(sink, buf) == 0)
+				continue;
+		} else if (cqe->res == 0 && !sink->error) {
+			sink->error = EIO;
+		}
+		sink->free_bufs[sink->free_count++] = buf;
+	}
+	__atomic_store_n(sink->cq_head, head, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/**
+ * Wait for every queued write to finish
+ */
+static int uring_drain(struct xmodem_sink *sink)
+{
+	while (sink->free_count < XMODEM_SINK_URING_DEPTH)
+		if (uring_reap(sink, 1) < 0)
+			return -1;
+	if (sink->error) {
+		errno = sink->error;
+		return -1;
+	}
+	return 0;
+}
+
+static int uring_write(struct xmodem_sink *sink, const uint8_t *data, int len, uint64_t offset)
+{
+	int buf;
+
+	// Pick up whatever has finished without blocking, only waiting when
+	// every buffer is in use
+	if (uring_reap(sink, 0) < 0)
+		return -1;
+	while (sink->free_count == 0 && !sink->error)
+		if (uring_reap(sink, 1) < 0)
+			return -1;
+	if (sink->error) {
+		errno = sink->error;
+		return -1;
+	}
+	buf = sink->free_bufs[--sink->free_count];
+	memcpy(sink->bufs[buf], data, len);
+	sink->buf_offset[buf] = offset;
+	sink->buf_len[buf] = len;
+	sink->buf_done[buf] = 0;
+	if (uring_submit(sink, buf) < 0) {
+		sink->free_bufs[sink->free_count++] = buf;
+		return -1;
+	}
+	return 0;
+}
+#endif
+
+int xmodem_sink_open(struct xmodem_sink *sink, const char *path, uint32_t flags)
+{
+	int open_flags = O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC;
+
+	memset(sink, 0, sizeof(*sink));
+	sink->flags = flags;
+#if XMODEM_SINK_URING_DEPTH > 0
+	sink->ring_fd = -1;
+#else
+	if (flags & XMODEM_SINK_URING) {
+		errno = ENOTSUP;
+		return -1;
+	}
+#endif
+	if ((flags & XMODEM_SINK_MMAP) && (flags & XMODEM_SINK_URING)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (flags & XMODEM_SINK_DSYNC)
+		open_flags |= O_DSYNC;
+	// Mappings need read access too
+	sink->fd = open(path, open_flags, 0644);
+	if (sink->fd < 0)
+		return -1;
+#if XMODEM_SINK_URING_DEPTH > 0
+	if ((flags & XMODEM_SINK_URING) && uring_setup(sink) < 0) {
+		int err = errno;
+
+		close(sink->fd);
+		sink->fd = -1;
+		errno = err;
+		return -1;
+	}
+#endif
+	return 0;
+}
+
+int xmodem_sink_write(struct xmodem_sink *sink, const uint8_t *data, int len, uint64_t offset)
+{
+	int done = 0;
+
+	if (len < 0 || len > XMODEM_MAX_PACKET_SIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+#if XMODEM_SINK_URING_DEPTH > 0
+	if ((sink->flags & XMODEM_SINK_URING) && len > 0) {
+		if (uring_write(sink, data, len, offset) < 0)
+			return -1;
+		done = len;
+	}
+#endif
+	while (done < len) {
+		uint64_t pos = offset + done;
+
+		if (sink->flags & XMODEM_SINK_MMAP) {
+			// A packet may straddle two windows
+			size_t chunk;
+
+			if (map_window(sink, pos) < 0)
+				return -1;
+			chunk = sink->map_offset + XMODEM_SINK_MAP_SIZE - pos;
+			if (chunk > (size_t)(len - done))
+				chunk = len - done;
+			memcpy(&sink->map[pos - sink->map_offset], &data[done], chunk);
+			done += chunk;
+		} else {
+			ssize_t r = pwrite(sink->fd, &data[done], len - done, pos);
+
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r <= 0)
+				return -1;
+			done += r;
+		}
+	}
+	// Keep hold of the block at the end of the file, for its padding
+	if (len > 0 && offset + len >= sink->size) {
+		sink->size = offset + len;
+		memcpy(sink->last, data, len);
+		sink->last_offset = offset;
+		sink->last_len = len;
+	}
+	return 0;
+}
+
+int xmodem_sink_sync(struct xmodem_sink *sink)
+{
+#if XMODEM_SINK_URING_DEPTH > 0
+	if ((sink->flags & XMODEM_SINK_URING) && uring_drain(sink) < 0)
+		return -1;
+#endif
+	// This also covers anything written through the mapping
+	return fdatasync(sink->fd);
+}
+
+int xmodem_sink_close(struct xmodem_sink *sink, int64_t size)
+{
+	uint64_t final_size = size;
+	int ret = 0;
+
+#if XMODEM_SINK_URING_DEPTH > 0
+	if (sink->flags & XMODEM_SINK_URING) {
+		if (uring_drain(sink) < 0)
+			ret = -1;
+		uring_teardown(sink);
+	}
+#endif
+
+	if (size < 0) {
+		while (sink->last_len > 0 && sink->last[sink->last_len - 1] == XMODEM_PAD)
+			sink->last_len--;
+		final_size = sink->last_offset + sink->last_len;
+	}
+	unmap(sink);
+	if (ftruncate(sink->fd, final_size) < 0)
+		ret = -1;
+	// O_DSYNC doesn't cover the size change
+	if ((sink->flags & XMODEM_SINK_DSYNC) && fdatasync(sink->fd) < 0)
+		ret = -1;
+	if (close(sink->fd) < 0)
+		ret = -1;
+	sink->fd = -1;
+	return ret;
+}
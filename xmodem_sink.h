@@ -0,0 +1,137 @@
+/**
+ * File sink for received packets. Each packet is written straight into the
+ * output file at its byte offset (from xmodem_server_packet_offset), either
+ * with pwrite or through a sliding mmap window, so the caller needs no
+ * buffer of its own & files of any size take a constant amount of memory.
+ * On Linux, writes can instead be queued to io_uring, so the caller can ACK
+ * a block without waiting for storage.
+ * When the transfer is over, the file is cut down to its real size: the
+ * declared size for YMODEM, or otherwise with the 0x1A padding of the last
+ * block removed
+ */
+#ifndef XMODEM_SINK_H
+#define XMODEM_SINK_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "xmodem_server.h"
+
+/**
+ * Size of the region of the file which is mapped at once with
+ * XMODEM_SINK_MMAP. Must be a multiple of the page size
+ */
+#ifndef XMODEM_SINK_MAP_SIZE
+#define XMODEM_SINK_MAP_SIZE (16 * 1024 * 1024)
+#endif
+
+/**
+ * Number of writes which may be queued at once with XMODEM_SINK_URING. Each
+ * has its own registered buffer of XMODEM_MAX_PACKET_SIZE in the sink.
+ * Set to 0 to leave out io_uring support (eg: for non-Linux builds)
+ */
+#ifndef XMODEM_SINK_URING_DEPTH
+#define XMODEM_SINK_URING_DEPTH 32
+#endif
+
+/**
+ * Flags for xmodem_sink_open
+ * XMODEM_SINK_MMAP - Copy packets into a shared mapping of the file, rather
+ *   than writing them with pwrite. This saves a system call per packet
+ * XMODEM_SINK_URING - Copy packets into registered buffers & queue them as
+ *   io_uring writes, so xmodem_sink_write only waits for storage once
+ *   XMODEM_SINK_URING_DEPTH writes are outstanding. Errors from queued
+ *   writes are reported by a later write, sync or close. Linux only
+ * XMODEM_SINK_DSYNC - Open the file with O_DSYNC, so every write goes to
+ *   storage before it completes, and sync the final size on close
+ */
+#define XMODEM_SINK_MMAP (1 << 0)
+#define XMODEM_SINK_URING (1 << 1)
+#define XMODEM_SINK_DSYNC (1 << 2)
+
+/**
+ * This contains the state for the sink.
+ * None of its contents should be accessed directly, this structure
+ * should be considered opaque. With XMODEM_SINK_URING, the kernel holds
+ * pointers into it, so it must not be moved while open
+ */
+struct xmodem_sink {
+	int fd;
+	uint32_t flags; // XMODEM_SINK_xxx
+	uint64_t size; // End of the furthest data written
+	uint8_t *map; // MMAP: Currently mapped part of the file (NULL if none)
+	uint64_t map_offset; // MMAP: Where in the file map starts
+	uint64_t file_len; // MMAP: How far the file has been extended to back the mappings
+	uint8_t last[XMODEM_MAX_PACKET_SIZE]; // Copy of the last block, to find its padding
+	uint64_t last_offset; // Where the last block was written
+	int last_len; // Size of the last block
+#if XMODEM_SINK_URING_DEPTH > 0
+	int ring_fd; // URING: io_uring instance (-1 if none)
+	void *sq_map, *cq_map, *sqes; // URING: Rings shared with the kernel
+	size_t sq_map_len, cq_map_len, sqes_len;
+	uint32_t *sq_tail, *sq_mask, *sq_array;
+	uint32_t *cq_head, *cq_tail, *cq_mask;
+	void *cqes;
+	int error; // URING: errno from the first failed write, reported later
+	int free_count; // URING: Number of buffers not in flight
+	uint16_t free_bufs[XMODEM_SINK_URING_DEPTH];
+	uint64_t buf_offset[XMODEM_SINK_URING_DEPTH]; // Where each buffer goes in the file
+	int buf_len[XMODEM_SINK_URING_DEPTH];
+	int buf_done[XMODEM_SINK_URING_DEPTH]; // Bytes written so far, in case of short writes
+	uint8_t bufs[XMODEM_SINK_URING_DEPTH][XMODEM_MAX_PACKET_SIZE];
+#endif
+};
+
+/**
+ * Create (or truncate) an output file
+ * @param sink Sink state area to initialise
+ * @param path File to write
+ * @param flags XMODEM_SINK_xxx
+ * @return < 0 on failure (with errno set), >= 0 on success
+ */
+int xmodem_sink_open(struct xmodem_sink *sink, const char *path, uint32_t flags);
+
+/**
+ * Write a packet into the file
+ * @param sink Sink state
+ * @param data Packet data
+ * @param len Number of bytes in data
+ * @param offset Byte offset of the packet within the file, as given by
+ *   xmodem_server_packet_offset
+ * @return < 0 on failure (with errno set), >= 0 on success
+ */
+int xmodem_sink_write(struct xmodem_sink *sink, const uint8_t *data, int len, uint64_t offset);
+
+/**
+ * Storage barrier, eg: for EOT. Waits for any queued writes, then flushes
+ * the file to storage with fdatasync. XMODEM_SINK_DSYNC doesn't make this
+ * unnecessary, as it doesn't cover writes through the mapping.
+ * A file is only known to be on storage once this has succeeded, so call it
+ * when the transfer (or YMODEM file) is complete, before reporting it as
+ * done, then xmodem_sink_close
+ * @param sink Sink state
+ * @return < 0 on failure (with errno set), >= 0 on success
+ */
+int xmodem_sink_sync(struct xmodem_sink *sink);
+
+/**
+ * Finish the file, setting its final size. Queued writes are waited for,
+ * but the file is not synced to storage (see xmodem_sink_sync)
+ * @param sink Sink state
+ * @param size Size of the file if known (eg: from xmodem_server_file_size),
+ *   or -1 to strip any 0x1A padding from the end of the last block
+ * @return < 0 on failure (with errno set), >= 0 on success. The file is
+ *   closed either way
+ */
+int xmodem_sink_close(struct xmodem_sink *sink, int64_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,176 @@
+#include <string.h>
+
+#include "xmodem_timer.h"
+
+#define SLOT_MASK (XMODEM_TIMER_SLOTS - 1)
+// Timers further out than this are parked in the top level
+#define MAX_DELTA ((int64_t)1 << (XMODEM_TIMER_SLOT_BITS * XMODEM_TIMER_LEVELS))
+
+static int slot_index(int64_t time, int level)
+{
+	return ((uint64_t)time >> (XMODEM_TIMER_SLOT_BITS * level)) & SLOT_MASK;
+}
+
+static void link_timer(struct xmodem_timer **head, struct xmodem_timer *timer)
+{
+	timer->next = *head;
+	if (timer->next)
+		timer->next->pprev = &timer->next;
+	timer->pprev = head;
+	*head = timer;
+}
+
+static void unlink_timer(struct xmodem_timer *timer)
+{
+	*timer->pprev = timer->next;
+	if (timer->next)
+		timer->next->pprev = timer->pprev;
+	timer->next = NULL;
+	timer->pprev = NULL;
+}
+
+/**
+ * Put a timer in the right slot for its expiry time. The level is chosen by
+ * how far away that is, so each level only holds timers within its range
+ */
+static void insert(struct xmodem_timer_wheel *wheel, struct xmodem_timer *timer)
+{
+	int64_t when = timer->expires;
+	int64_t delta = when - wheel->now;
+	int level;
+
+	if (delta < 0) {
+		// Already due, so expire on the next tick
+		when = wheel->now;
+		delta = 0;
+	} else if (delta >= MAX_DELTA) {
+		when = wheel->now + MAX_DELTA - 1;
+		delta = MAX_DELTA - 1;
+	}
+	for (level = 0; level < XMODEM_TIMER_LEVELS - 1; level++)
+		if (delta < (int64_t)1 << (XMODEM_TIMER_SLOT_BITS * (level + 1)))
+			break;
+	link_timer(&wheel->slots[level][slot_index(when, level)], timer);
+}
+
+/**
+ * Move the timers from a slot down into the lower levels, now that they
+ * are within range
+ */
+static void cascade(struct xmodem_timer_wheel *wheel, int level, int index)
+{
+	struct xmodem_timer *list = wheel->slots[level][index];
+
+	wheel->slots[level][index] = NULL;
+	while (list) {
+		struct xmodem_timer *timer = list;
+		list = timer->next;
+		insert(wheel, timer);
+	}
+}
+
+void xmodem_timer_wheel_init(struct xmodem_timer_wheel *wheel, int64_t now)
+{
+	memset(wheel, 0, sizeof(*wheel));
+	wheel->now = now;
+}
+
+void xmodem_timer_init(struct xmodem_timer *timer)
+{
+	memset(timer, 0, sizeof(*timer));
+}
+
+void xmodem_timer_add(struct xmodem_timer_wheel *wheel, struct xmodem_timer *timer, int64_t expires)
+{
+	if (timer->pprev)
+		unlink_timer(timer);
+	else
+		wheel->count++;
+	timer->expires = expires;
+	insert(wheel, timer);
+}
+
+void xmodem_timer_del(struct xmodem_timer_wheel *wheel, struct xmodem_timer *timer)
+{
+	if (!timer->pprev)
+		return;
+	unlink_timer(timer);
+	wheel->count--;
+}
+
+bool xmodem_timer_pending(const struct xmodem_timer *timer)
+{
+	return timer->pprev != NULL;
+}
+
+int64_t xmodem_timer_next(const struct xmodem_timer_wheel *wheel)
+{
+	int64_t next = -1;
+
+	if (wheel->count == 0)
+		return -1;
+
+	// Everything in the bottom level is within the next rotation
+	for (int i = 0; i < XMODEM_TIMER_SLOTS; i++) {
+		if (wheel->slots[0][slot_index(wheel->now + i, 0)]) {
+			next = wheel->now + i;
+			break;
+		}
+	}
+
+	// Timers from the levels above may need moving down before then
+	for (int level = 1; level < XMODEM_TIMER_LEVELS; level++) {
+		int shift = XMODEM_TIMER_SLOT_BITS * level;
+		int64_t base = (uint64_t)wheel->now >> shift;
+		// The current slot hasn't been cascaded yet if we're right on its boundary
+		int first = (wheel->now & (((int64_t)1 << shift) - 1)) == 0 ? 0 : 1;
+
+		for (int k = first; k < first + XMODEM_TIMER_SLOTS; k++) {
+			if (wheel->slots[level][(base + k) & SLOT_MASK]) {
+				int64_t when = (base + k) << shift;
+				if (next < 0 || when < next)
+					next = when;
+				break;
+			}
+		}
+	}
+	return next;
+}
+
+int xmodem_timer_expire(struct xmodem_timer_wheel *wheel, int64_t now, xmodem_timer_expired expired, void *cb_data)
+{
+	int count = 0;
+
+	while (wheel->now <= now) {
+		struct xmodem_timer *list;
+		struct xmodem_timer *timer;
+		int64_t next = xmodem_timer_next(wheel);
+		int64_t tick;
+
+		// Skip over the ticks with nothing to expire or cascade
+		if (next < 0 || next > now) {
+			wheel->now = now + 1;
+			break;
+		}
+		tick = wheel->now = next;
+
+		// Each time a level wraps around, the next slot up comes into range
+		for (int level = 1; level < XMODEM_TIMER_LEVELS && slot_index(tick, level - 1) == 0; level++)
+			cascade(wheel, level, slot_index(tick, level));
+
+		// Take the whole slot first, so timers re-added by the callback
+		// land in a later one
+		list = wheel->slots[0][slot_index(tick, 0)];
+		wheel->slots[0][slot_index(tick, 0)] = NULL;
+		if (list)
+			list->pprev = &list;
+		wheel->now++;
+		while ((timer = list) != NULL) {
+			unlink_timer(timer);
+			wheel->count--;
+			count++;
+			expired(timer, cb_data);
+		}
+	}
+	return count;
+}
@@ -0,0 +1,107 @@
+/**
+ * Hierarchical timer wheel, for tracking the timeouts of many sessions at
+ * once. Adding & removing a timer is O(1), and advancing the wheel only
+ * visits the ticks where a timer expires or moves down a level, however
+ * many timers are pending. Timers are intrusive, so no memory is allocated.
+ * Time is in milliseconds, and can start from any non-negative value
+ */
+#ifndef XMODEM_TIMER_H
+#define XMODEM_TIMER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * Each level of the wheel has 64 slots, covering 64 times the range of the
+ * level below. 4 levels cover ~4.6 hours, and timers further out than that
+ * are parked in the top level until they come into range
+ */
+#define XMODEM_TIMER_LEVELS 4
+#define XMODEM_TIMER_SLOT_BITS 6
+#define XMODEM_TIMER_SLOTS (1 << XMODEM_TIMER_SLOT_BITS)
+
+/**
+ * A single timer. None of its contents should be accessed directly
+ */
+struct xmodem_timer {
+	struct xmodem_timer *next;
+	struct xmodem_timer **pprev; // Pointer to whatever points at us (NULL if not pending)
+	int64_t expires;
+};
+
+/**
+ * This contains the state for the timer wheel.
+ * None of its contents should be accessed directly, this structure
+ * should be considered opaque
+ */
+struct xmodem_timer_wheel {
+	int64_t now; // Next millisecond to be processed
+	int count; // How many timers are pending
+	struct xmodem_timer *slots[XMODEM_TIMER_LEVELS][XMODEM_TIMER_SLOTS];
+};
+
+/**
+ * Callback function for an expired timer. The timer is no longer pending,
+ * so may be added again
+ */
+typedef void (*xmodem_timer_expired)(struct xmodem_timer *timer, void *cb_data);
+
+/**
+ * Initialise the timer wheel
+ * @param wheel Timer wheel state area to initialise
+ * @param now Current time in milliseconds
+ */
+void xmodem_timer_wheel_init(struct xmodem_timer_wheel *wheel, int64_t now);
+
+/**
+ * Initialise a timer, so that it can be safely deleted before it is first added
+ */
+void xmodem_timer_init(struct xmodem_timer *timer);
+
+/**
+ * Start a timer, or move it if it is already pending
+ * @param wheel Timer wheel state
+ * @param timer Timer to add. This must remain valid until it expires or is deleted
+ * @param expires Time (in milliseconds) when the timer should expire. If
+ *   this has already passed, the timer expires on the next call to xmodem_timer_expire
+ */
+void xmodem_timer_add(struct xmodem_timer_wheel *wheel, struct xmodem_timer *timer, int64_t expires);
+
+/**
+ * Stop a timer. Does nothing if the timer is not pending
+ */
+void xmodem_timer_del(struct xmodem_timer_wheel *wheel, struct xmodem_timer *timer);
+
+/**
+ * Determine if a timer is waiting to expire
+ */
+bool xmodem_timer_pending(const struct xmodem_timer *timer);
+
+/**
+ * Advance the wheel, calling the callback for each timer which has expired
+ * @param wheel Timer wheel state
+ * @param now Current time in milliseconds
+ * @param expired Callback for each expired timer
+ * @param cb_data user-supplied pointer to be supplied to the callback
+ * @return Number of timers which expired
+ */
+int xmodem_timer_expire(struct xmodem_timer_wheel *wheel, int64_t now, xmodem_timer_expired expired, void *cb_data);
+
+/**
+ * Find out when xmodem_timer_expire next needs to be called. This may be
+ * earlier than the first timer expiry, when timers need to be moved
+ * between levels of the wheel
+ * @return Time in milliseconds, or -1 if no timers are pending
+ */
+int64_t xmodem_timer_next(const struct xmodem_timer_wheel *wheel);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,150 @@
+/**
+ * Decode a flight recorder dump saved with xmodem_server_trace_save
+ * Usage: xmodem_trace [FILE]
+ * Reads from stdin if no FILE is given. Each entry is printed with its time
+ * in ms, both absolute & relative to the first entry
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xmodem_server.h"
+
+static const char *state_names[XMODEM_STATE_COUNT] = {
+	[XMODEM_STATE_START] = "START",
+	[XMODEM_STATE_SOH] = "SOH",
+	[XMODEM_STATE_BLOCK_NUM] = "BLOCK_NUM",
+	[XMODEM_STATE_BLOCK_NEG] = "BLOCK_NEG",
+	[XMODEM_STATE_DATA] = "DATA",
+	[XMODEM_STATE_CRC0] = "CRC0",
+	[XMODEM_STATE_CRC1] = "CRC1",
+	[XMODEM_STATE_PROCESS_PACKET] = "PROCESS_PACKET",
+	[XMODEM_STATE_SUCCESSFUL] = "SUCCESSFUL",
+	[XMODEM_STATE_FAILURE] = "FAILURE",
+};
+
+static const char *error_names[] = {
+	[XMODEM_TRACE_ERR_CRC] = "bad CRC",
+	[XMODEM_TRACE_ERR_BLOCK_NUM] = "unexpected block number",
+	[XMODEM_TRACE_ERR_BLOCK_NEG] = "bad block number complement",
+	[XMODEM_TRACE_ERR_HEADER] = "bad YMODEM header",
+	[XMODEM_TRACE_ERR_MAX_ERRORS] = "too many errors",
+};
+
+static uint64_t get_le(const uint8_t *data, int len)
+{
+	uint64_t value = 0;
+
+	for (int i = len - 1; i >= 0; i--)
+		value = (value << 8) | data[i];
+	return value;
+}
+
+/**
+ * Describe a response byte, naming the protocol characters
+ */
+static void describe_tx(uint8_t byte, char *desc, size_t len)
+{
+	switch (byte) {
+	case 0x04: snprintf(desc, len, "EOT"); break;
+	case 0x06: snprintf(desc, len, "ACK"); break;
+	case 0x15: snprintf(desc, len, "NAK"); break;
+	case 0x18: snprintf(desc, len, "CAN"); break;
+	default:
+		if (byte >= 0x20 && byte < 0x7f)
+			snprintf(desc, len, "0x%02x '%c'", byte, byte);
+		else
+			snprintf(desc, len, "0x%02x", byte);
+	}
+}
+
+static void print_entry(int64_t time, int64_t start, uint8_t type, uint8_t value)
+{
+	char desc[40];
+
+	printf("%12lld %+9lld  ", (long long)time, (long long)(time - start));
+	switch (type) {
+	case XMODEM_TRACE_STATE:
+		printf("state    %s\n", value < XMODEM_STATE_COUNT ? state_names[value] : "UNKNOWN");
+		break;
+	case XMODEM_TRACE_TX:
+		describe_tx(value, desc, sizeof(desc));
+		printf("tx       %s\n", desc);
+		break;
+	case XMODEM_TRACE_TIMEOUT:
+		printf("timeout  (%d errors)\n", value);
+		break;
+	case XMODEM_TRACE_ERROR:
+		if (value < sizeof(error_names) / sizeof(error_names[0]) && error_names[value])
+			printf("error    %s\n", error_names[value]);
+		else
+			printf("error    %d\n", value);
+		break;
+	case XMODEM_TRACE_BLOCK:
+		printf("block    %d (mod 256)\n", value);
+		break;
+	default:
+		printf("unknown  type %d, value %d\n", type, value);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	static uint8_t data[XMODEM_TRACE_HEADER_LEN + 65536 * XMODEM_TRACE_ENTRY_LEN];
+	FILE *f = stdin;
+	size_t len;
+	uint32_t count;
+	int64_t time, start;
+
+	if (argc > 2) {
+		fprintf(stderr, "Usage: %s [FILE]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (argc == 2) {
+		f = fopen(argv[1], "rb");
+		if (!f) {
+			perror(argv[1]);
+			return EXIT_FAILURE;
+		}
+	}
+	len = fread(data, 1, sizeof(data), f);
+	if (f != stdin)
+		fclose(f);
+
+	if (len < XMODEM_TRACE_HEADER_LEN || memcmp(data, "XTRC", 4) != 0) {
+		fprintf(stderr, "Not an xmodem trace\n");
+		return EXIT_FAILURE;
+	}
+	if (data[4] != XMODEM_TRACE_VERSION) {
+		fprintf(stderr, "Unsupported trace version %d\n", data[4]);
+		return EXIT_FAILURE;
+	}
+	count = get_le(&data[8], 4);
+	if (count > (len - XMODEM_TRACE_HEADER_LEN) / XMODEM_TRACE_ENTRY_LEN) {
+		fprintf(stderr, "Trace truncated\n");
+		count = (len - XMODEM_TRACE_HEADER_LEN) / XMODEM_TRACE_ENTRY_LEN;
+	}
+	if (count == 0) {
+		printf("No entries\n");
+		return EXIT_SUCCESS;
+	}
+
+	// Entries only hold the bottom 16 bits of the time, so work back from
+	// the last process time to find where the first one was
+	time = get_le(&data[12], 8);
+	for (uint32_t i = count; i-- > 0; ) {
+		uint16_t low = get_le(&data[XMODEM_TRACE_HEADER_LEN + i * XMODEM_TRACE_ENTRY_LEN], 2);
+		time -= (uint16_t)(time - low);
+	}
+	start = time;
+
+	printf("%u entries\n%12s %9s  event\n", count, "time (ms)", "relative");
+	for (uint32_t i = 0; i < count; i++) {
+		const uint8_t *entry = &data[XMODEM_TRACE_HEADER_LEN + i * XMODEM_TRACE_ENTRY_LEN];
+		uint16_t low = get_le(entry, 2);
+
+		time += (uint16_t)(low - time);
+		print_entry(time, start, entry[2], entry[3]);
+	}
+	return EXIT_SUCCESS;
+}
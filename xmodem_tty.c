@@ -0,0 +1,206 @@
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/serial.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "xmodem_tty.h"
+
+#define XMODEM_CAN 0x18
+
+// VMIN can go up to 255, but recent Linux kernels only return 64 bytes
+// per read when it is above 64, however much is waiting. At 64 or below,
+// a read takes everything there
+#define MAX_VMIN 64
+
+// Inter-byte timeout once a read has started, in 1/10s. This is only hit
+// when fewer bytes than expected turn up, eg: for EOT
+#define READ_VTIME 1
+
+static int64_t tty_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Have reads wait for the rest of the frame. tcsetattr is only called when
+ * this changes, which is once or twice per frame at most
+ */
+static int set_vmin(struct xmodem_tty *tty, int vmin)
+{
+	if (vmin < 1)
+		vmin = 1;
+	if (vmin > MAX_VMIN)
+		vmin = MAX_VMIN;
+	if (tty->raw.c_cc[VMIN] == vmin)
+		return 0;
+	tty->raw.c_cc[VMIN] = vmin;
+	return tcsetattr(tty->fd, TCSANOW, &tty->raw);
+}
+
+/**
+ * Ask the driver not to hold on to received data. Most USB serial & pty
+ * drivers don't support this, which is fine
+ */
+static void set_low_latency(int fd)
+{
+	struct serial_struct serial;
+
+	if (ioctl(fd, TIOCGSERIAL, &serial) == 0 && !(serial.flags & ASYNC_LOW_LATENCY)) {
+		serial.flags |= ASYNC_LOW_LATENCY;
+		ioctl(fd, TIOCSSERIAL, &serial);
+	}
+}
+
+/**
+ * Write all queued responses. They are only ever a few bytes, so the fd
+ * being blocking doesn't matter
+ */
+static int flush_tx(struct xmodem_tty *tty, struct xmodem_server *xdm)
+{
+	size_t len;
+	const uint8_t *data = xmodem_server_pending_tx(xdm, &len);
+
+	while (len > 0) {
+		ssize_t r = write(tty->fd, data, len);
+
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			return -1;
+		xmodem_server_tx_done(xdm, r);
+		data = xmodem_server_pending_tx(xdm, &len);
+	}
+	return 0;
+}
+
+int xmodem_tty_open(struct xmodem_tty *tty, const char *path, speed_t speed)
+{
+	int fd = open(path, O_RDWR | O_NOCTTY | O_CLOEXEC);
+
+	if (fd < 0)
+		return -1;
+	if (xmodem_tty_init(tty, fd) < 0)
+		goto fail;
+	tty->close_fd = true;
+	if (speed != B0) {
+		if (cfsetspeed(&tty->raw, speed) < 0 || tcsetattr(fd, TCSANOW, &tty->raw) < 0) {
+			xmodem_tty_close(tty);
+			return -1;
+		}
+	}
+	return 0;
+
+fail:
+	{
+		int err = errno;
+
+		close(fd);
+		errno = err;
+	}
+	return -1;
+}
+
+int xmodem_tty_init(struct xmodem_tty *tty, int fd)
+{
+	int flags = fcntl(fd, F_GETFL);
+
+	memset(tty, 0, sizeof(*tty));
+	tty->fd = fd;
+	if (flags < 0 || tcgetattr(fd, &tty->saved) < 0)
+		return -1;
+	// VMIN/VTIME only apply to blocking reads
+	if ((flags & O_NONBLOCK) && fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) < 0)
+		return -1;
+	tty->raw = tty->saved;
+	cfmakeraw(&tty->raw);
+	tty->raw.c_cflag |= CLOCAL | CREAD;
+	tty->raw.c_cc[VMIN] = 1;
+	tty->raw.c_cc[VTIME] = READ_VTIME;
+	if (tcsetattr(fd, TCSANOW, &tty->raw) < 0)
+		return -1;
+	set_low_latency(fd);
+	// Anything which arrived before we were ready is just noise
+	tcflush(fd, TCIFLUSH);
+	return 0;
+}
+
+void xmodem_tty_close(struct xmodem_tty *tty)
+{
+	if (tty->fd < 0)
+		return;
+	tcsetattr(tty->fd, TCSADRAIN, &tty->saved);
+	if (tty->close_fd)
+		close(tty->fd);
+	tty->fd = -1;
+}
+
+int xmodem_tty_run(struct xmodem_tty *tty, struct xmodem_server *xdm, xmodem_tty_packet packet, void *cb_data)
+{
+	struct pollfd pfd = {.fd = tty->fd, .events = POLLIN};
+	int64_t deadline, now;
+	ssize_t len = 0;
+	size_t pos = 0;
+	int timeout = -1;
+
+	if (flush_tx(tty, xdm) < 0)
+		return -1;
+	if (xmodem_server_is_done(xdm))
+		return 0;
+
+	// A blocking read only gives up once it has had a byte, so wait for
+	// the first one here, in case the server's timeout comes first
+	now = tty_time();
+	deadline = xmodem_server_next_deadline(xdm);
+	if (deadline >= 0)
+		timeout = deadline > now ? deadline - now : 0;
+	if (poll(&pfd, 1, timeout) < 0 && errno != EINTR)
+		return -1;
+	if (pfd.revents) {
+		if (set_vmin(tty, xmodem_server_frame_remaining(xdm)) < 0)
+			return -1;
+		len = read(tty->fd, tty->buffer, sizeof(tty->buffer));
+		if (len == 0) {
+			// Hung up
+			errno = EPIPE;
+			return -1;
+		}
+		if (len < 0 && errno != EINTR)
+			return -1;
+	}
+
+	now = tty_time();
+	do {
+		const uint8_t *data;
+		uint32_t block_num;
+		int data_len;
+
+		if ((ssize_t)pos < len)
+			pos += xmodem_server_rx_bytes(xdm, &tty->buffer[pos], len - pos);
+		data_len = xmodem_server_process_borrow(xdm, &data, &block_num, now);
+		if (data_len > 0) {
+			if (packet(xdm, data, data_len, block_num, cb_data) < 0) {
+				static const uint8_t cancel[2] = {XMODEM_CAN, XMODEM_CAN};
+
+				// Best effort, as we're giving up anyway
+				if (write(tty->fd, cancel, sizeof(cancel)) < 0) {
+					// Nothing more we can do
+				}
+				errno = ECANCELED;
+				return -1;
+			}
+			xmodem_server_release_packet(xdm);
+		}
+		if (flush_tx(tty, xdm) < 0)
+			return -1;
+	} while (((ssize_t)pos < len || xmodem_server_get_state(xdm) == XMODEM_STATE_PROCESS_PACKET) &&
+			!xmodem_server_is_done(xdm));
+	return xmodem_server_is_done(xdm) ? 0 : 1;
+}
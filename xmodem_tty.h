@@ -0,0 +1,101 @@
+/**
+ * Serial transport for a single xmodem_server on Linux. A tty or pty is put
+ * into raw mode, and VMIN/VTIME are set from xmodem_server_frame_remaining,
+ * so each read blocks until the rest of the frame (or at least 64 bytes of
+ * it) has arrived, or the line goes quiet for a tenth of a second, rather
+ * than returning a byte or two at a time. Where the driver supports it,
+ * ASYNC_LOW_LATENCY is set so data is pushed to the reader as soon as it
+ * arrives. Data is fed to the server with xmodem_server_rx_bytes, and
+ * responses are written as soon as they are queued.
+ * The fd is left blocking, as VMIN/VTIME are ignored otherwise, so this is
+ * for a thread (or process) per port. For many ports in one thread, see
+ * xmodem_mux
+ */
+#ifndef XMODEM_TTY_H
+#define XMODEM_TTY_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <termios.h>
+
+#include "xmodem_server.h"
+
+/**
+ * Size of the read buffer. This has room for the rest of one frame & all
+ * of the next, in case the sender has got ahead (eg: when streaming)
+ */
+#ifndef XMODEM_TTY_READ_SIZE
+#define XMODEM_TTY_READ_SIZE (2 * (XMODEM_MAX_PACKET_SIZE + 5))
+#endif
+
+/**
+ * Callback function to deliver a received packet
+ * @param xdm xmodem_server the packet arrived on
+ * @param data Packet data. Only valid for the duration of the callback
+ * @param len Number of bytes in data
+ * @param block_num 0-based index of the block
+ * @param cb_data user-supplied pointer given to xmodem_tty_run
+ * @return < 0 to abort the transfer, >= 0 to accept the packet
+ */
+typedef int (*xmodem_tty_packet)(struct xmodem_server *xdm, const uint8_t *data, int len, uint32_t block_num, void *cb_data);
+
+/**
+ * This contains the state for the transport.
+ * None of its contents should be accessed directly, this structure
+ * should be considered opaque
+ */
+struct xmodem_tty {
+	int fd;
+	bool close_fd; // Was fd opened by xmodem_tty_open?
+	struct termios saved; // Settings to put back on close
+	struct termios raw; // Settings in use, with the current VMIN
+	uint8_t buffer[XMODEM_TTY_READ_SIZE];
+};
+
+/**
+ * Open a tty or pty & set it up for receiving
+ * @param tty Transport state area to initialise
+ * @param path Device to open
+ * @param speed Baud rate (eg: B115200), or B0 to leave it as it is
+ * @return < 0 on failure (with errno set), >= 0 on success
+ */
+int xmodem_tty_open(struct xmodem_tty *tty, const char *path, speed_t speed);
+
+/**
+ * Set up an fd which is already open (eg: the slave side of a pty). The fd
+ * is made blocking, and is not closed by xmodem_tty_close
+ * @param tty Transport state area to initialise
+ * @param fd tty to use
+ * @return < 0 on failure (with errno set), >= 0 on success
+ */
+int xmodem_tty_init(struct xmodem_tty *tty, int fd);
+
+/**
+ * Put the tty back how it was, and close it if it was opened by
+ * xmodem_tty_open
+ */
+void xmodem_tty_close(struct xmodem_tty *tty);
+
+/**
+ * Wait for data (or the server's next timeout), and process it. The server
+ * must have been initialised without a tx_byte callback, so its responses
+ * are queued for this to write
+ * @param tty Transport state
+ * @param xdm xmodem_server to feed
+ * @param packet Callback to deliver each packet
+ * @param cb_data user-supplied pointer to be supplied to packet
+ * @return > 0 while the transfer is in progress, 0 once it is done, or < 0
+ *   on error (with errno set), eg: if the other end hangs up
+ */
+int xmodem_tty_run(struct xmodem_tty *tty, struct xmodem_server *xdm, xmodem_tty_packet packet, void *cb_data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
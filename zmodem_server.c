@@ -0,0 +1,692 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "xmodem_server.h"
+#include "zmodem_server.h"
+
+/* ZMODEM protocol constants */
+#define ZPAD '*'
+#define ZDLE 0x18
+#define ZBIN 'A'
+#define ZHEX 'B'
+#define ZBIN32 'C'
+
+/* Header types */
+#define ZRQINIT 0
+#define ZRINIT 1
+#define ZSINIT 2
+#define ZACK 3
+#define ZFILE 4
+#define ZABORT 7
+#define ZFIN 8
+#define ZRPOS 9
+#define ZDATA 10
+#define ZEOF 11
+#define ZCAN 16
+
+/* Subpacket terminators, and other ZDLE sequences */
+#define ZCRCE 'h' // End of frame, header follows
+#define ZCRCG 'i' // Frame continues, no response needed
+#define ZCRCQ 'j' // Frame continues, ZACK expected
+#define ZCRCW 'k' // End of frame, ZACK expected
+#define ZRUB0 'l' // 0x7f
+#define ZRUB1 'm' // 0xff
+
+/* ZRINIT capability flags */
+#define CANFDX 0x01
+#define CANOVIO 0x02
+#define CANFC32 0x20
+
+#define XON 0x11
+#define XOFF 0x13
+
+// Running CRC-32 over a block and its (inverted) CRC always gives this
+#define ZMODEM_CRC32_RESIDUE 0xdebb20e3
+
+// How many milliseconds without progress before we ask the client to resend
+#define ZMODEM_TIMEOUT 2000
+
+// How many errors without any good data before we just fail
+#define ZMODEM_MAX_ERRORS 10
+
+// Results from unescape() other than plain data bytes
+#define ZMODEM_NONE -1 // Nothing yet (ZDLE or flow control)
+#define ZMODEM_BAD -2 // Invalid escape sequence
+#define ZMODEM_FRAME_END 0x100 // ORed with the ZCRCx terminator
+
+static const char *state_name(zmodem_server_state state) {
+	#define ZDMSTAT(a) case ZMODEM_STATE_ ##a: return #a
+	switch(state) {
+		ZDMSTAT(HEADER);
+		ZDMSTAT(HEADER_START);
+		ZDMSTAT(HEADER_FORMAT);
+		ZDMSTAT(HEADER_DATA);
+		ZDMSTAT(SUBPACKET);
+		ZDMSTAT(SUBPACKET_CRC);
+		ZDMSTAT(PROCESS_PACKET);
+		ZDMSTAT(SUCCESSFUL);
+		ZDMSTAT(FAILURE);
+		default: return "UNKNOWN";
+	}
+	#undef ZDMSTAT
+}
+
+/**
+ * Reflected CRC-32 (polynomial 0xedb88320), as used for ZBIN32 headers and
+ * their subpackets
+ */
+static const uint32_t crc32_table[256] = {
+	0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
+	0xe963a535, 0x9e6495a3, 0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988,
+	0x09b64c2b, 0x7eb17cbd, 0xe7b82d07, 0x90bf1d91, 0x1db71064, 0x6ab020f2,
+	0xf3b97148, 0x84be41de, 0x1adad47d, 0x6ddde4eb, 0xf4d4b551, 0x83d385c7,
+	0x136c9856, 0x646ba8c0, 0xfd62f97a, 0x8a65c9ec, 0x14015c4f, 0x63066cd9,
+	0xfa0f3d63, 0x8d080df5, 0x3b6e20c8, 0x4c69105e, 0xd56041e4, 0xa2677172,
+	0x3c03e4d1, 0x4b04d447, 0xd20d85fd, 0xa50ab56b, 0x35b5a8fa, 0x42b2986c,
+	0xdbbbc9d6, 0xacbcf940, 0x32d86ce3, 0x45df5c75, 0xdcd60dcf, 0xabd13d59,
+	0x26d930ac, 0x51de003a, 0xc8d75180, 0xbfd06116, 0x21b4f4b5, 0x56b3c423,
+	0xcfba9599, 0xb8bda50f, 0x2802b89e, 0x5f058808, 0xc60cd9b2, 0xb10be924,
+	0x2f6f7c87, 0x58684c11, 0xc1611dab, 0xb6662d3d, 0x76dc4190, 0x01db7106,
+	0x98d220bc, 0xefd5102a, 0x71b18589, 0x06b6b51f, 0x9fbfe4a5, 0xe8b8d433,
+	0x7807c9a2, 0x0f00f934, 0x9609a88e, 0xe10e9818, 0x7f6a0dbb, 0x086d3d2d,
+	0x91646c97, 0xe6635c01, 0x6b6b51f4, 0x1c6c6162, 0x856530d8, 0xf262004e,
+	0x6c0695ed, 0x1b01a57b, 0x8208f4c1, 0xf50fc457, 0x65b0d9c6, 0x12b7e950,
+	0x8bbeb8ea, 0xfcb9887c, 0x62dd1ddf, 0x15da2d49, 0x8cd37cf3, 0xfbd44c65,
+	0x4db26158, 0x3ab551ce, 0xa3bc0074, 0xd4bb30e2, 0x4adfa541, 0x3dd895d7,
+	0xa4d1c46d, 0xd3d6f4fb, 0x4369e96a, 0x346ed9fc, 0xad678846, 0xda60b8d0,
+	0x44042d73, 0x33031de5, 0xaa0a4c5f, 0xdd0d7cc9, 0x5005713c, 0x270241aa,
+	0xbe0b1010, 0xc90c2086, 0x5768b525, 0x206f85b3, 0xb966d409, 0xce61e49f,
+	0x5edef90e, 0x29d9c998, 0xb0d09822, 0xc7d7a8b4, 0x59b33d17, 0x2eb40d81,
+	0xb7bd5c3b, 0xc0ba6cad, 0xedb88320, 0x9abfb3b6, 0x03b6e20c, 0x74b1d29a,
+	0xead54739, 0x9dd277af, 0x04db2615, 0x73dc1683, 0xe3630b12, 0x94643b84,
+	0x0d6d6a3e, 0x7a6a5aa8, 0xe40ecf0b, 0x9309ff9d, 0x0a00ae27, 0x7d079eb1,
+	0xf00f9344, 0x8708a3d2, 0x1e01f268, 0x6906c2fe, 0xf762575d, 0x806567cb,
+	0x196c3671, 0x6e6b06e7, 0xfed41b76, 0x89d32be0, 0x10da7a5a, 0x67dd4acc,
+	0xf9b9df6f, 0x8ebeeff9, 0x17b7be43, 0x60b08ed5, 0xd6d6a3e8, 0xa1d1937e,
+	0x38d8c2c4, 0x4fdff252, 0xd1bb67f1, 0xa6bc5767, 0x3fb506dd, 0x48b2364b,
+	0xd80d2bda, 0xaf0a1b4c, 0x36034af6, 0x41047a60, 0xdf60efc3, 0xa867df55,
+	0x316e8eef, 0x4669be79, 0xcb61b38c, 0xbc66831a, 0x256fd2a0, 0x5268e236,
+	0xcc0c7795, 0xbb0b4703, 0x220216b9, 0x5505262f, 0xc5ba3bbe, 0xb2bd0b28,
+	0x2bb45a92, 0x5cb36a04, 0xc2d7ffa7, 0xb5d0cf31, 0x2cd99e8b, 0x5bdeae1d,
+	0x9b64c2b0, 0xec63f226, 0x756aa39c, 0x026d930a, 0x9c0906a9, 0xeb0e363f,
+	0x72076785, 0x05005713, 0x95bf4a82, 0xe2b87a14, 0x7bb12bae, 0x0cb61b38,
+	0x92d28e9b, 0xe5d5be0d, 0x7cdcefb7, 0x0bdbdf21, 0x86d3d2d4, 0xf1d4e242,
+	0x68ddb3f8, 0x1fda836e, 0x81be16cd, 0xf6b9265b, 0x6fb077e1, 0x18b74777,
+	0x88085ae6, 0xff0f6a70, 0x66063bca, 0x11010b5c, 0x8f659eff, 0xf862ae69,
+	0x616bffd3, 0x166ccf45, 0xa00ae278, 0xd70dd2ee, 0x4e048354, 0x3903b3c2,
+	0xa7672661, 0xd06016f7, 0x4969474d, 0x3e6e77db, 0xaed16a4a, 0xd9d65adc,
+	0x40df0b66, 0x37d83bf0, 0xa9bcae53, 0xdebb9ec5, 0x47b2cf7f, 0x30b5ffe9,
+	0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6, 0xbad03605, 0xcdd70693,
+	0x54de5729, 0x23d967bf, 0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94,
+	0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d,
+};
+
+uint32_t zmodem_server_crc32_buf(uint32_t crc, const uint8_t *data, size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+		crc = crc32_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+static void crc_update(struct zmodem_server *zdm, const uint8_t *data, size_t len)
+{
+	if (zdm->crc32)
+		zdm->crc = zmodem_server_crc32_buf(zdm->crc, data, len);
+	else
+		zdm->crc = xmodem_server_crc_buf(zdm->crc, data, len);
+}
+
+/**
+ * Remove a queued response, along with its bytes
+ */
+static void tx_queue_drop(struct zmodem_server *zdm, int index)
+{
+	int start = 0;
+
+	for (int i = 0; i < index; i++)
+		start += zdm->tx_queue_lens[i];
+	memmove(&zdm->tx_queue[start], &zdm->tx_queue[start + zdm->tx_queue_lens[index]],
+		zdm->tx_queue_len - start - zdm->tx_queue_lens[index]);
+	zdm->tx_queue_len -= zdm->tx_queue_lens[index];
+	memmove(&zdm->tx_queue_lens[index], &zdm->tx_queue_lens[index + 1], zdm->tx_queue_count - index - 1);
+	zdm->tx_queue_count--;
+}
+
+/**
+ * Send a response to the client, either directly via the tx_byte callback,
+ * or by queueing it for zmodem_server_pending_tx. Responses are queued
+ * whole, as the client can't make sense of part of a header
+ */
+static void tx_response(struct zmodem_server *zdm, const uint8_t *data, int len)
+{
+	// Don't drop the first response once some of it has been collected
+	int keep = zdm->tx_queue_started ? 1 : 0;
+
+	if (zdm->tx_byte) {
+		for (int i = 0; i < len; i++)
+			zdm->tx_byte(zdm, data[i], zdm->cb_data);
+		return;
+	}
+	// If the queue is full the oldest responses are the least useful, so
+	// drop them to make room
+	while (zdm->tx_queue_len + len > ZMODEM_TX_QUEUE_SIZE && zdm->tx_queue_count > keep) {
+		tx_queue_drop(zdm, keep);
+		zdm->tx_overflows++;
+	}
+	if (zdm->tx_queue_len + len > ZMODEM_TX_QUEUE_SIZE) {
+		zdm->tx_overflows++;
+		return;
+	}
+	memcpy(&zdm->tx_queue[zdm->tx_queue_len], data, len);
+	zdm->tx_queue_len += len;
+	zdm->tx_queue_lens[zdm->tx_queue_count++] = len;
+}
+
+/**
+ * Send a hex header. We only ever send short headers, and hex ones can't be
+ * mistaken for anything else if the client is still busy sending
+ */
+static void send_header(struct zmodem_server *zdm, uint8_t type, const uint8_t data[4])
+{
+	static const char hex[] = "0123456789abcdef";
+	uint8_t hdr[7] = {type, data[0], data[1], data[2], data[3]};
+	uint16_t crc = xmodem_server_crc_buf(0, hdr, 5);
+	uint8_t response[22] = {ZPAD, ZPAD, ZDLE, ZHEX};
+	int len = 4;
+
+	hdr[5] = crc >> 8;
+	hdr[6] = crc & 0xff;
+	for (int i = 0; i < 7; i++) {
+		response[len++] = hex[hdr[i] >> 4];
+		response[len++] = hex[hdr[i] & 0xf];
+	}
+	response[len++] = '\r';
+	response[len++] = '\n' | 0x80;
+	// Release the client in case it has been flow controlled
+	if (type != ZACK && type != ZFIN)
+		response[len++] = XON;
+	tx_response(zdm, response, len);
+}
+
+/**
+ * Send a header carrying a file position. Positions are only 32 bits on the
+ * wire, so past 4 GiB they wrap, as the client's do
+ */
+static void send_pos(struct zmodem_server *zdm, uint8_t type, uint64_t pos)
+{
+	const uint8_t data[4] = {pos & 0xff, (pos >> 8) & 0xff, (pos >> 16) & 0xff, (pos >> 24) & 0xff};
+	send_header(zdm, type, data);
+}
+
+static void send_zrinit(struct zmodem_server *zdm)
+{
+	// We buffer nothing ourselves, so the client can stream freely
+	const uint8_t data[4] = {0, 0, 0, CANFDX | CANOVIO | CANFC32};
+	send_header(zdm, ZRINIT, data);
+}
+
+/**
+ * Give up on the transfer, telling the client to stop
+ */
+static void fail(struct zmodem_server *zdm)
+{
+	uint8_t cancel[20];
+
+	zdm->state = ZMODEM_STATE_FAILURE;
+	memset(cancel, ZDLE, 10);
+	memset(&cancel[10], '\b', 10);
+	tx_response(zdm, cancel, sizeof(cancel));
+}
+
+/**
+ * Something has gone wrong, so discard everything up to the next header and
+ * ask the client to restart from the last good data
+ */
+static void resync(struct zmodem_server *zdm)
+{
+	zdm->error_count++;
+	zdm->state = ZMODEM_STATE_HEADER;
+	if (zdm->file_open)
+		send_pos(zdm, ZRPOS, zdm->file_offset);
+	else
+		send_zrinit(zdm);
+}
+
+static void start_subpacket(struct zmodem_server *zdm)
+{
+	zdm->packet_len = 0;
+	zdm->crc = zdm->crc32 ? 0xffffffff : 0;
+	zdm->escape = false;
+	zdm->state = ZMODEM_STATE_SUBPACKET;
+}
+
+/**
+ * Remove the ZDLE escaping from an incoming byte
+ * @return The decoded byte, ZMODEM_FRAME_END | terminator at the end of a
+ *   subpacket, ZMODEM_NONE if there is no byte yet, or ZMODEM_BAD
+ */
+static int unescape(struct zmodem_server *zdm, uint8_t byte)
+{
+	// Flow control characters are always escaped when they are data
+	if ((byte & 0x7f) == XON || (byte & 0x7f) == XOFF)
+		return ZMODEM_NONE;
+	if (!zdm->escape) {
+		if (byte == ZDLE) {
+			zdm->escape = true;
+			return ZMODEM_NONE;
+		}
+		return byte;
+	}
+	zdm->escape = false;
+	switch (byte) {
+	case ZCRCE:
+	case ZCRCG:
+	case ZCRCQ:
+	case ZCRCW:
+		return ZMODEM_FRAME_END | byte;
+	case ZRUB0:
+		return 0x7f;
+	case ZRUB1:
+		return 0xff;
+	}
+	if ((byte & 0x60) == 0x40)
+		return byte ^ 0x40;
+	return ZMODEM_BAD;
+}
+
+static int hex_value(uint8_t byte)
+{
+	if (byte >= '0' && byte <= '9')
+		return byte - '0';
+	if (byte >= 'a' && byte <= 'f')
+		return byte - 'a' + 10;
+	if (byte >= 'A' && byte <= 'F')
+		return byte - 'A' + 10;
+	return -1;
+}
+
+/**
+ * Called once all of a header has been received
+ */
+static void header_complete(struct zmodem_server *zdm)
+{
+	uint32_t pos = zdm->hdr[1] | zdm->hdr[2] << 8 | zdm->hdr[3] << 16 | (uint32_t)zdm->hdr[4] << 24;
+	bool ok;
+
+	if (zdm->hdr_format == ZBIN32)
+		ok = zmodem_server_crc32_buf(0xffffffff, zdm->hdr, 9) == ZMODEM_CRC32_RESIDUE;
+	else
+		ok = xmodem_server_crc_buf(0, zdm->hdr, 7) == 0;
+	if (!ok) {
+		resync(zdm);
+		return;
+	}
+	// Restart our timer
+	zdm->last_event_time = 0;
+	zdm->state = ZMODEM_STATE_HEADER;
+
+	switch (zdm->hdr[0]) {
+	case ZRQINIT:
+		send_zrinit(zdm);
+		break;
+
+	case ZDATA:
+		if (!zdm->file_open || pos != (uint32_t)zdm->file_offset) {
+			resync(zdm);
+			break;
+		}
+		// fall through
+	case ZSINIT:
+	case ZFILE:
+		// The subpackets use the same CRC as the header that introduced them
+		zdm->frame_type = zdm->hdr[0];
+		zdm->crc32 = zdm->hdr_format == ZBIN32;
+		start_subpacket(zdm);
+		break;
+
+	case ZEOF:
+		// A ZEOF that doesn't match what we've got is stale, so ignore it
+		if (zdm->file_open && pos == (uint32_t)zdm->file_offset) {
+			zdm->file_open = false;
+			send_zrinit(zdm);
+		}
+		break;
+
+	case ZFIN:
+		send_pos(zdm, ZFIN, 0);
+		zdm->state = ZMODEM_STATE_SUCCESSFUL;
+		break;
+
+	case ZCAN:
+	case ZABORT:
+		zdm->state = ZMODEM_STATE_FAILURE;
+		break;
+
+	default:
+		break;
+	}
+}
+
+/**
+ * Called once the data & CRC bytes of a subpacket have been received
+ */
+static void subpacket_complete(struct zmodem_server *zdm)
+{
+	if (zdm->crc != (zdm->crc32 ? ZMODEM_CRC32_RESIDUE : 0))
+		resync(zdm);
+	else
+		zdm->state = ZMODEM_STATE_PROCESS_PACKET;
+}
+
+/**
+ * Handle the ZFILE subpacket, which contains the file name & details
+ */
+static void process_file(struct zmodem_server *zdm)
+{
+	const char *name = (const char *)zdm->packet_data;
+	const char *end;
+
+	zdm->packet_data[zdm->packet_len] = '\0';
+	zdm->state = ZMODEM_STATE_HEADER;
+	// The client repeats ZFILE if it sees more than one ZRINIT, so only
+	// report each file once
+	if (!zdm->file_open || zdm->file_offset != 0) {
+		zdm->file_size = -1;
+		end = memchr(name, '\0', zdm->packet_len);
+		if (end && end[1] >= '0' && end[1] <= '9')
+			zdm->file_size = strtoll(&end[1], NULL, 10);
+		zdm->file_open = true;
+		zdm->file_offset = 0;
+		if (zdm->file_info)
+			zdm->file_info(zdm, name, zdm->file_size, zdm->cb_data);
+	}
+	send_pos(zdm, ZRPOS, zdm->file_offset);
+}
+
+bool zmodem_server_rx_byte(struct zmodem_server *zdm, uint8_t byte) {
+	int c;
+
+	if (zdm->state == ZMODEM_STATE_PROCESS_PACKET || zmodem_server_is_done(zdm))
+		return zdm->state == ZMODEM_STATE_PROCESS_PACKET;
+	// The client is still sending, so restart our timer
+	zdm->last_event_time = 0;
+
+	// Five CANs in a row aborts the transfer, wherever they turn up
+	zdm->can_count = byte == ZDLE ? zdm->can_count + 1 : 0;
+	if (zdm->can_count >= 5) {
+		zdm->state = ZMODEM_STATE_FAILURE;
+		return false;
+	}
+
+	switch (zdm->state) {
+	case ZMODEM_STATE_HEADER:
+		if ((byte & 0x7f) == ZPAD)
+			zdm->state = ZMODEM_STATE_HEADER_START;
+		break;
+
+	case ZMODEM_STATE_HEADER_START:
+		if (byte == ZDLE)
+			zdm->state = ZMODEM_STATE_HEADER_FORMAT;
+		else if ((byte & 0x7f) != ZPAD)
+			zdm->state = ZMODEM_STATE_HEADER;
+		break;
+
+	case ZMODEM_STATE_HEADER_FORMAT:
+		if (byte == ZBIN || byte == ZHEX || byte == ZBIN32) {
+			zdm->hdr_format = byte;
+			zdm->hdr_len = 0;
+			zdm->escape = false;
+			zdm->state = ZMODEM_STATE_HEADER_DATA;
+		} else {
+			zdm->state = ZMODEM_STATE_HEADER;
+		}
+		break;
+
+	case ZMODEM_STATE_HEADER_DATA:
+		if (zdm->hdr_format == ZHEX) {
+			int nibble = hex_value(byte & 0x7f);
+			if (nibble < 0) {
+				resync(zdm);
+				break;
+			}
+			if (zdm->hdr_len & 1)
+				zdm->hdr[zdm->hdr_len / 2] |= nibble;
+			else
+				zdm->hdr[zdm->hdr_len / 2] = nibble << 4;
+			if (++zdm->hdr_len == 14)
+				header_complete(zdm);
+			break;
+		}
+		c = unescape(zdm, byte);
+		if (c == ZMODEM_NONE)
+			break;
+		if (c < 0 || c > 0xff) {
+			resync(zdm);
+			break;
+		}
+		zdm->hdr[zdm->hdr_len++] = c;
+		if (zdm->hdr_len == (zdm->hdr_format == ZBIN32 ? 9 : 7))
+			header_complete(zdm);
+		break;
+
+	case ZMODEM_STATE_SUBPACKET:
+		c = unescape(zdm, byte);
+		if (c == ZMODEM_NONE)
+			break;
+		if (c == ZMODEM_BAD) {
+			resync(zdm);
+			break;
+		}
+		if (c & ZMODEM_FRAME_END) {
+			// The terminator is covered by the CRC too
+			zdm->frame_end = c & 0xff;
+			crc_update(zdm, &zdm->frame_end, 1);
+			zdm->crc_len = 0;
+			zdm->state = ZMODEM_STATE_SUBPACKET_CRC;
+			break;
+		}
+		if (zdm->packet_len >= ZMODEM_MAX_SUBPACKET_SIZE) {
+			resync(zdm);
+			break;
+		}
+		zdm->packet_data[zdm->packet_len++] = c;
+		crc_update(zdm, &zdm->packet_data[zdm->packet_len - 1], 1);
+		break;
+
+	case ZMODEM_STATE_SUBPACKET_CRC: {
+		uint8_t crc_byte;
+		c = unescape(zdm, byte);
+		if (c == ZMODEM_NONE)
+			break;
+		if (c < 0 || c > 0xff) {
+			resync(zdm);
+			break;
+		}
+		crc_byte = c;
+		crc_update(zdm, &crc_byte, 1);
+		if (++zdm->crc_len == (zdm->crc32 ? 4 : 2))
+			subpacket_complete(zdm);
+		break;
+	}
+
+	default:
+		break;
+	}
+
+	return zdm->state == ZMODEM_STATE_PROCESS_PACKET;
+}
+
+/**
+ * Does this byte need to go through unescape()?
+ */
+static bool is_special(uint8_t byte)
+{
+	return byte == ZDLE || (byte & 0x7f) == XON || (byte & 0x7f) == XOFF;
+}
+
+size_t zmodem_server_rx_bytes(struct zmodem_server *zdm, const uint8_t *data, size_t len)
+{
+	size_t pos = 0;
+
+	while (pos < len && zdm->state != ZMODEM_STATE_PROCESS_PACKET && !zmodem_server_is_done(zdm)) {
+		size_t run = 0;
+		size_t room;
+
+		if (zdm->state != ZMODEM_STATE_SUBPACKET || zdm->escape) {
+			zmodem_server_rx_byte(zdm, data[pos++]);
+			continue;
+		}
+
+		// Copy & CRC the run of bytes which need no unescaping in one go
+		room = ZMODEM_MAX_SUBPACKET_SIZE - zdm->packet_len;
+		while (run < len - pos && run < room && !is_special(data[pos + run]))
+			run++;
+		if (run == 0) {
+			zmodem_server_rx_byte(zdm, data[pos++]);
+			continue;
+		}
+		memcpy(&zdm->packet_data[zdm->packet_len], &data[pos], run);
+		crc_update(zdm, &data[pos], run);
+		zdm->packet_len += run;
+		zdm->can_count = 0;
+		zdm->last_event_time = 0;
+		pos += run;
+	}
+
+	return pos;
+}
+
+const char *zmodem_server_state_name(const struct zmodem_server *zdm)
+{
+	return state_name(zdm->state);
+}
+
+int zmodem_server_init(struct zmodem_server *zdm, zmodem_tx_byte tx_byte, void *cb_data) {
+	memset(zdm, 0, sizeof(*zdm));
+	zdm->tx_byte = tx_byte;
+	zdm->cb_data = cb_data;
+	zdm->file_size = -1;
+
+	send_zrinit(zdm);
+
+	return 0;
+}
+
+void zmodem_server_set_file_callback(struct zmodem_server *zdm, zmodem_file_info file_info) {
+	zdm->file_info = file_info;
+}
+
+int64_t zmodem_server_file_size(const struct zmodem_server *zdm) {
+	return zdm->file_size;
+}
+
+const uint8_t *zmodem_server_pending_tx(const struct zmodem_server *zdm, size_t *len) {
+	*len = zdm->tx_queue_len;
+	return zdm->tx_queue;
+}
+
+void zmodem_server_tx_done(struct zmodem_server *zdm, size_t len) {
+	// Drop the responses which have been sent completely, and note if the
+	// next one has been started
+	while (len > 0 && zdm->tx_queue_count > 0) {
+		if (len < zdm->tx_queue_lens[0]) {
+			memmove(zdm->tx_queue, &zdm->tx_queue[len], zdm->tx_queue_len - len);
+			zdm->tx_queue_len -= len;
+			zdm->tx_queue_lens[0] -= len;
+			zdm->tx_queue_started = true;
+			return;
+		}
+		len -= zdm->tx_queue_lens[0];
+		tx_queue_drop(zdm, 0);
+		zdm->tx_queue_started = false;
+	}
+}
+
+uint32_t zmodem_server_tx_overflows(const struct zmodem_server *zdm) {
+	return zdm->tx_overflows;
+}
+
+zmodem_server_state zmodem_server_get_state(const struct zmodem_server *zdm) {
+	return zdm->state;
+}
+
+bool zmodem_server_is_done(const struct zmodem_server *zdm) {
+	return zdm->state == ZMODEM_STATE_SUCCESSFUL || zdm->state == ZMODEM_STATE_FAILURE;
+}
+
+int zmodem_server_process_borrow(struct zmodem_server *zdm, const uint8_t **packet, uint64_t *offset, int64_t ms_time) {
+	if (zdm->borrowed)
+		zmodem_server_release_packet(zdm);
+	if (zmodem_server_is_done(zdm))
+		return 0;
+	// Avoid confusion with 0 default value
+	if (ms_time == 0)
+		ms_time = 1;
+	// Initialise our timer
+	if (zdm->last_event_time == 0)
+		zdm->last_event_time = ms_time;
+	// A subpacket which has fully arrived can't time out
+	if (zdm->state != ZMODEM_STATE_PROCESS_PACKET && ms_time - zdm->last_event_time > ZMODEM_TIMEOUT) {
+		// Waiting for a client to turn up isn't an error
+		if (zdm->file_open)
+			resync(zdm);
+		else
+			send_zrinit(zdm);
+		zdm->last_event_time = ms_time;
+	}
+	if (zdm->error_count >= ZMODEM_MAX_ERRORS && !zmodem_server_is_done(zdm)) {
+		fail(zdm);
+		zdm->last_event_time = ms_time;
+	}
+	if (zdm->state != ZMODEM_STATE_PROCESS_PACKET)
+		return 0;
+	zdm->last_event_time = ms_time;
+
+	switch (zdm->frame_type) {
+	case ZSINIT:
+		// We have no use for the attention string
+		zdm->state = ZMODEM_STATE_HEADER;
+		send_pos(zdm, ZACK, 0);
+		return 0;
+
+	case ZFILE:
+		process_file(zdm);
+		return 0;
+
+	default:
+		break;
+	}
+
+	*packet = zdm->packet_data;
+	*offset = zdm->file_offset;
+	zdm->borrowed = true;
+	if (zdm->packet_len == 0) {
+		zmodem_server_release_packet(zdm);
+		return 0;
+	}
+	return zdm->packet_len;
+}
+
+void zmodem_server_release_packet(struct zmodem_server *zdm) {
+	if (!zdm->borrowed)
+		return;
+	zdm->borrowed = false;
+	zdm->file_offset += zdm->packet_len;
+	zdm->error_count = 0;
+	if (zdm->frame_end == ZCRCQ || zdm->frame_end == ZCRCW)
+		send_pos(zdm, ZACK, zdm->file_offset);
+	if (zdm->frame_end == ZCRCG || zdm->frame_end == ZCRCQ)
+		start_subpacket(zdm);
+	else
+		zdm->state = ZMODEM_STATE_HEADER;
+}
+
+int zmodem_server_process(struct zmodem_server *zdm, uint8_t *packet, uint64_t *offset, int64_t ms_time) {
+	const uint8_t *data;
+	int len = zmodem_server_process_borrow(zdm, &data, offset, ms_time);
+	if (len > 0) {
+		memcpy(packet, data, len);
+		zmodem_server_release_packet(zdm);
+	}
+	return len;
+}
@@ -0,0 +1,239 @@
+/**
+ * Implementation of the receiver side of the ZModem data transfer protocol
+ * This follows the same model as xmodem_server - it is asynchronous, so
+ * there are no blocking read calls, and it does not allocate any dynamic
+ * memory.
+ * Data arrives in streamed subpackets, which are only acknowledged when the
+ * sender asks for it. Errors are recovered by asking the sender to restart
+ * from the last good file offset (ZRPOS), rather than resending single blocks.
+ * File offsets in the protocol are 32 bits, and are taken to wrap every
+ * 4 GiB, so the offsets given to the caller keep counting past that
+ */
+#ifndef ZMODEM_SERVER_H
+#define ZMODEM_SERVER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * Largest data subpacket we can accept. lrzsz sends up to 1024 bytes per
+ * subpacket unless told to use 8k blocks
+ */
+#ifndef ZMODEM_MAX_SUBPACKET_SIZE
+#define ZMODEM_MAX_SUBPACKET_SIZE 1024
+#endif
+
+/**
+ * When no tx_byte callback is supplied, response headers are queued
+ * internally until collected with zmodem_server_pending_tx. A hex header is
+ * 21 bytes (22 with the trailing XON), and the abort sequence is 20 bytes.
+ * If it fills up, the oldest responses are dropped whole, so a partial
+ * header is never sent. This must be no more than 255
+ */
+#ifndef ZMODEM_TX_QUEUE_SIZE
+#define ZMODEM_TX_QUEUE_SIZE 64
+#endif
+
+/**
+ * The different states that the internal zmodem state machine may be in
+ */
+typedef enum {
+	ZMODEM_STATE_HEADER, // Looking for the start of a header (ZPAD)
+	ZMODEM_STATE_HEADER_START, // Got ZPAD, waiting for ZDLE
+	ZMODEM_STATE_HEADER_FORMAT, // Got ZDLE, waiting for the header format
+	ZMODEM_STATE_HEADER_DATA, // Receiving the header contents
+	ZMODEM_STATE_SUBPACKET, // Receiving subpacket data
+	ZMODEM_STATE_SUBPACKET_CRC, // Receiving the CRC at the end of a subpacket
+	ZMODEM_STATE_PROCESS_PACKET, // A subpacket is waiting to be processed
+	ZMODEM_STATE_SUCCESSFUL,
+	ZMODEM_STATE_FAILURE,
+
+	ZMODEM_STATE_COUNT,
+} zmodem_server_state;
+
+struct zmodem_server;
+
+/**
+ * Callback function to transmit a byte to the zmodem client
+ */
+typedef void (*zmodem_tx_byte)(struct zmodem_server *zdm, uint8_t byte, void *cb_data);
+
+/**
+ * Callback function to report the details of each file as it is offered
+ * @param zdm zmodem server state
+ * @param name Name of the file. Only valid for the duration of the callback
+ * @param size Declared size of the file in bytes, or -1 if not given
+ * @param cb_data user-supplied pointer given to zmodem_server_init
+ */
+typedef void (*zmodem_file_info)(struct zmodem_server *zdm, const char *name, int64_t size, void *cb_data);
+
+/**
+ * This contains the state for the zmodem server.
+ * None of its contents should be accessed directly, this structure
+ * should be considered opaque
+ */
+struct zmodem_server {
+	zmodem_server_state state; // What state are we in?
+	uint8_t hdr[9]; // Incoming header: type, 4 data bytes & up to 4 CRC bytes
+	uint8_t hdr_len; // How many header bytes (or hex digits) have we received
+	uint8_t hdr_format; // ZBIN, ZHEX or ZBIN32
+	uint8_t frame_type; // Which header the current subpackets belong to
+	uint8_t frame_end; // How the last subpacket was terminated (ZCRCx)
+	bool crc32; // Do the current subpackets use CRC-32?
+	bool escape; // Was the last byte a ZDLE?
+	uint8_t can_count; // How many CANs in a row have we seen
+	uint8_t crc_len; // How many CRC bytes have we received
+	uint32_t crc; // Running CRC of the incoming header/subpacket
+	uint8_t packet_data[ZMODEM_MAX_SUBPACKET_SIZE + 1]; // Incoming subpacket (+1 for a NUL)
+	int packet_len;
+	bool borrowed; // Is the caller holding packet_data from zmodem_server_process_borrow?
+	bool file_open; // Have we accepted a file, and not yet seen its ZEOF?
+	int64_t file_size; // Declared size of the current file (-1 if unknown)
+	uint64_t file_offset; // How much of the current file have we received (only the low 32 bits go on the wire)
+	int64_t last_event_time; // When did we last receive a byte or do something interesting?
+	uint32_t error_count; // How many errors have we seen since the last good data?
+	zmodem_tx_byte tx_byte;
+	void *cb_data;
+	uint8_t tx_queue[ZMODEM_TX_QUEUE_SIZE]; // Responses waiting to be sent if there is no tx_byte
+	uint8_t tx_queue_len;
+	uint8_t tx_queue_lens[ZMODEM_TX_QUEUE_SIZE]; // Bytes left of each queued response, so they are only dropped whole
+	uint8_t tx_queue_count; // Number of responses in tx_queue
+	bool tx_queue_started; // Has part of the first response been collected?
+	uint32_t tx_overflows; // Responses dropped as the tx queue was full
+	zmodem_file_info file_info;
+};
+
+/**
+ * Initialise the internal zmodem server state. This queues a ZRINIT header
+ * to tell the client that we are ready
+ * @param zdm Zmodem server state area to initialise
+ * @param tx_byte callback to be called for response bytes. If NULL, responses
+ *   are queued and must be collected with zmodem_server_pending_tx
+ * @param cb_data user-supplied pointer to be supplied to the callback functions
+ * @return < 0 on failure, >= 0 on success
+ */
+int zmodem_server_init(struct zmodem_server *zdm, zmodem_tx_byte tx_byte, void *cb_data);
+
+/**
+ * Set the callback used to report the name & size of each file
+ */
+void zmodem_server_set_file_callback(struct zmodem_server *zdm, zmodem_file_info file_info);
+
+/**
+ * Get the declared size of the file currently being received
+ * @return Size of the file in bytes, or -1 if unknown
+ */
+int64_t zmodem_server_file_size(const struct zmodem_server *zdm);
+
+/**
+ * Send a single byte to the zmodem state machine
+ * @returns true if a subpacket is now available for processing, false if more data is needed
+ */
+bool zmodem_server_rx_byte(struct zmodem_server *zdm, uint8_t byte);
+
+/**
+ * Send a block of bytes to the zmodem state machine. This is equivalent to
+ * calling zmodem_server_rx_byte for each byte, but runs of subpacket data
+ * which need no unescaping are copied & CRC'd in bulk.
+ * Bytes are only consumed up to the end of the next complete subpacket (or
+ * the end of the transfer). Once zmodem_server_process has collected that
+ * subpacket, the remaining bytes should be supplied again
+ * @param zdm zmodem_server state
+ * @param data Incoming bytes
+ * @param len Number of bytes in data
+ * @return Number of bytes consumed from data
+ */
+size_t zmodem_server_rx_bytes(struct zmodem_server *zdm, const uint8_t *data, size_t len);
+
+/**
+ * Get the response bytes waiting to be sent, when no tx_byte callback was
+ * given to zmodem_server_init. These should be checked after each call to
+ * zmodem_server_rx_byte/zmodem_server_rx_bytes/zmodem_server_process
+ * @param zdm zmodem_server state
+ * @param len Area to store the number of bytes waiting
+ * @return Pointer to the waiting bytes. Valid until the next call to any other zmodem_server function
+ */
+const uint8_t *zmodem_server_pending_tx(const struct zmodem_server *zdm, size_t *len);
+
+/**
+ * Remove bytes from the response queue once they have been sent
+ * @param zdm zmodem_server state
+ * @param len Number of bytes from the start of zmodem_server_pending_tx that were sent
+ */
+void zmodem_server_tx_done(struct zmodem_server *zdm, size_t len);
+
+/**
+ * Get the number of responses which have been dropped whole because the tx
+ * queue was full, ie: zmodem_server_pending_tx wasn't collected often enough
+ */
+uint32_t zmodem_server_tx_overflows(const struct zmodem_server *zdm);
+
+/**
+ * Determine the current state of the zmodem transfer
+ */
+zmodem_server_state zmodem_server_get_state(const struct zmodem_server *zdm);
+
+/**
+ * Returns a human readable version of the current state
+ */
+const char *zmodem_server_state_name(const struct zmodem_server *zdm);
+
+/**
+ * Extend the ZModem 32-bit CRC over a buffer. The CRC is not inverted, so
+ * start from 0xffffffff and invert the result to get the transmitted value.
+ * Note: This function should not normally be need to be called explicitly,
+ * it is provided to make writing test cases easier
+ * @param crc CRC to extend
+ * @param data Data to add to the CRC
+ * @param len Number of bytes in data
+ * @return Updated CRC
+ */
+uint32_t zmodem_server_crc32_buf(uint32_t crc, const uint8_t *data, size_t len);
+
+/**
+ * Process the internal state and determine if there is file data ready
+ * This function should be called periodically to correctly process timeouts
+ * @param zdm zmodem_server state
+ * @param packet Area to store the next subpacket. Must be at least ZMODEM_MAX_SUBPACKET_SIZE long
+ * @param offset Area to store the offset of the data within the file
+ * @param ms_time Current time in milliseconds (used to determine timeouts)
+ * @return Number of bytes of data copied into 'packet', or 0 if no new data is available
+ */
+int zmodem_server_process(struct zmodem_server *zdm, uint8_t *packet, uint64_t *offset, int64_t ms_time);
+
+/**
+ * As for zmodem_server_process, but instead of copying the data out, provides
+ * direct access to it.
+ * The data remains valid until zmodem_server_release_packet is called or
+ * zmodem_server_process/zmodem_server_process_borrow is next called. Any
+ * acknowledgement the sender asked for is held back until then
+ * @param zdm zmodem_server state
+ * @param packet Updated to point to the subpacket data
+ * @param offset Area to store the offset of the data within the file
+ * @param ms_time Current time in milliseconds (used to determine timeouts)
+ * @return Number of bytes of data available at 'packet', or 0 if no new data is available
+ */
+int zmodem_server_process_borrow(struct zmodem_server *zdm, const uint8_t **packet, uint64_t *offset, int64_t ms_time);
+
+/**
+ * Finish with data returned by zmodem_server_process_borrow
+ * @param zdm zmodem_server state
+ */
+void zmodem_server_release_packet(struct zmodem_server *zdm);
+
+/**
+ * Determine if the zmodem transfer is complete (success or failure)
+ * @return true if the transfer has been finished, false otherwise
+ */
+bool zmodem_server_is_done(const struct zmodem_server *zdm);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif